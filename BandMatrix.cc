@@ -0,0 +1,84 @@
+// Symmetric positive definite band matrix with a Cholesky solver
+
+#ifndef __BandMatrix_cc__
+#define __BandMatrix_cc__
+
+#ifndef __BandMatrix_hh__
+#include "BandMatrix.hh"
+#endif
+
+#include <cmath>
+
+void BandMatrix::Resize( unsigned int _n, unsigned int _w ) {
+
+	n = _n;
+	w = _w;
+	band.assign( n * ( w + 1 ), 0. );
+
+	return;
+
+}
+
+int BandMatrix::Decompose() {
+
+	BandMatrix &a = *this;
+	double sum;
+	unsigned int k0;
+
+	for( unsigned int j = 0; j < n; j++ ) {
+
+		// Diagonal
+		k0 = j > w ? j - w : 0;
+		sum = a(j,j);
+		for( unsigned int k = k0; k < j; k++ )
+			sum -= a(j,k) * a(j,k);
+
+		if( !( sum > 0 ) ) return 1;
+		a(j,j) = sqrt( sum );
+
+		// Column below the diagonal, within the band
+		for( unsigned int i = j + 1; i < n && i <= j + w; i++ ) {
+
+			k0 = i > w ? i - w : 0;
+			sum = a(i,j);
+			for( unsigned int k = k0; k < j; k++ )
+				sum -= a(i,k) * a(j,k);
+			a(i,j) = sum / a(j,j);
+
+		}
+
+	}
+
+	return 0;
+
+}
+
+void BandMatrix::Solve( double *b ) const {
+
+	const BandMatrix &a = *this;
+	unsigned int k0, k1;
+
+	// L y = b
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		k0 = i > w ? i - w : 0;
+		for( unsigned int k = k0; k < i; k++ )
+			b[i] -= a(i,k) * b[k];
+		b[i] /= a(i,i);
+
+	}
+
+	// L^T x = y
+	for( unsigned int i = n; i-- > 0; ) {
+
+		k1 = i + w < n - 1 ? i + w : n - 1;
+		for( unsigned int k = i + 1; k <= k1; k++ )
+			b[i] -= a(k,i) * b[k];
+		b[i] /= a(i,i);
+
+	}
+
+	return;
+
+}
+#endif
@@ -0,0 +1,50 @@
+// Symmetric positive definite band matrix with a Cholesky solver,
+// for normal equations where each parameter only couples to its
+// neighbours, e.g. the coefficients of a B-spline. Decomposing and
+// solving take O(n w^2) and O(n w) for size n and half-width w.
+
+#ifndef __BandMatrix_hh__
+#define __BandMatrix_hh__
+
+#include <vector>
+
+using namespace std;
+
+class BandMatrix {
+
+public:
+
+	BandMatrix( unsigned int _n = 0, unsigned int _w = 0 ){
+		Resize( _n, _w );
+	};
+
+	// Set the size and half-width, all elements become zero
+	void Resize( unsigned int _n, unsigned int _w );
+
+	inline unsigned int Size() const { return n; };
+	inline unsigned int Width() const { return w; };
+
+	// Element i,j of the lower band, i.e. 0 <= i - j <= w
+	inline double& operator()( unsigned int i, unsigned int j ){
+		return band[ i * ( w + 1 ) + ( i - j ) ];
+	};
+	inline double operator()( unsigned int i, unsigned int j ) const {
+		return band[ i * ( w + 1 ) + ( i - j ) ];
+	};
+
+	// Replace the matrix by its Cholesky factor L, with A = L L^T.
+	// Returns 0 on success and 1 if it is not positive definite.
+	int Decompose();
+
+	// Solve A x = b in place, after Decompose()
+	void Solve( double *b ) const;
+
+private:
+
+	unsigned int n;
+	unsigned int w;
+	vector<double> band;
+
+};
+
+#endif
@@ -0,0 +1,651 @@
+// Calibration database of fitted efficiency curves across detectors and runs
+
+#ifndef __CalibDB_cc__
+#define __CalibDB_cc__
+
+#ifndef __CalibDB_hh__
+#include "CalibDB.hh"
+#endif
+
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+static const char kMagic[8] = { 'G', 'E', 'F', 'F', 'C', 'D', 'B', 0 };
+static const char kIndexMagic[8] = { 'G', 'E', 'F', 'F', 'C', 'D', 'X', 0 };
+static const uint32_t kByteOrder = 0x01020304;
+static const uint32_t kRecordMagic = 0x4c414347;
+
+// Largest coefficients of a record, far above any model
+static const uint32_t kMaxPars = 1024;
+
+// Floor of log2 of the number of runs, 0 to 32
+static unsigned int SpanClass( const GeffCalibIndex &e ) {
+
+	uint64_t n = (uint64_t)e.runlast - e.runfirst + 1;
+	unsigned int c = 0;
+	while( n >>= 1 ) c++;
+
+	return c;
+
+}
+
+// Order of List(): detector, first run, time, then as appended
+static bool RunLess( const GeffCalibIndex &a, const GeffCalibIndex &b ) {
+
+	if( a.detector != b.detector ) return a.detector < b.detector;
+	if( a.runfirst != b.runfirst ) return a.runfirst < b.runfirst;
+	if( a.time != b.time ) return a.time < b.time;
+	return a.offset < b.offset;
+
+}
+
+// Order of the index: as RunLess, but grouped by span class after the
+// detector, so that the ranges of a group are no more than twice as long
+// as each other
+static bool IndexLess( const GeffCalibIndex &a, const GeffCalibIndex &b ) {
+
+	if( a.detector != b.detector ) return a.detector < b.detector;
+	unsigned int ca = SpanClass( a ), cb = SpanClass( b );
+	if( ca != cb ) return ca < cb;
+	if( a.runfirst != b.runfirst ) return a.runfirst < b.runfirst;
+	if( a.time != b.time ) return a.time < b.time;
+	return a.offset < b.offset;
+
+}
+
+// Newest first, then the last appended
+static bool NewerFirst( const GeffCalibIndex &a, const GeffCalibIndex &b ) {
+
+	if( a.time != b.time ) return a.time > b.time;
+	return a.offset > b.offset;
+
+}
+
+// Read exactly n bytes at offset
+static bool ReadAt( int fd, void *buf, unsigned long n, uint64_t offset ) {
+
+	char *c = (char*)buf;
+	while( n > 0 ) {
+
+		ssize_t r = pread( fd, c, n, offset );
+		if( r <= 0 ) return false;
+		c += r;
+		n -= r;
+		offset += r;
+
+	}
+
+	return true;
+
+}
+
+// Size of a record from its header, 0 if it is not one
+static uint64_t RecordSize( const GeffCalibRecord &rec ) {
+
+	if( rec.magic != kRecordMagic || rec.npar == 0 || rec.npar > kMaxPars ) return 0;
+
+	uint64_t size = sizeof(GeffCalibRecord) + ( (uint64_t)rec.npar * ( rec.npar + 1 ) ) * sizeof(double);
+	size += rec.infosize;
+
+	return size == rec.size ? size : 0;
+
+}
+
+int CalibDB::Open( const string &_path, bool _writable ) {
+
+	Close();
+
+	path = _path;
+	writable = _writable;
+	fd = open( path.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644 );
+	if( fd < 0 ) {
+
+		cerr << "Cannot open the calibration database " << path << endl;
+		return 1;
+
+	}
+
+	// A new database gets its header under the lock
+	GeffCalibHeader hdr;
+	flock( fd, writable ? LOCK_EX : LOCK_SH );
+
+	struct stat st;
+	if( writable && fstat( fd, &st ) == 0 && st.st_size == 0 ) {
+
+		memset( &hdr, 0, sizeof(hdr) );
+		memcpy( hdr.magic, kMagic, sizeof(kMagic) );
+		hdr.byteorder = kByteOrder;
+		hdr.version = kVersion;
+		hdr.id = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::system_clock::now().time_since_epoch() ).count();
+
+		if( pwrite( fd, &hdr, sizeof(hdr), 0 ) != (ssize_t)sizeof(hdr) ) {
+
+			if( ftruncate( fd, 0 ) ) {}
+			memset( &hdr, 0, sizeof(hdr) );
+
+		}
+
+	}
+
+	bool valid = ReadAt( fd, &hdr, sizeof(hdr), 0 ) &&
+				 memcmp( hdr.magic, kMagic, sizeof(kMagic) ) == 0 &&
+				 hdr.byteorder == kByteOrder && hdr.version == kVersion;
+
+	flock( fd, LOCK_UN );
+
+	if( !valid ) {
+
+		cerr << path << " is not a calibration database of this version\n";
+		Close();
+		return 1;
+
+	}
+
+	id = hdr.id;
+
+	// The index, then whatever was appended after it was written
+	if( LoadIndex() ) {
+
+		index.clear();
+		logsize = sizeof(GeffCalibHeader);
+		dirty = true;
+
+	}
+
+	if( Scan( logsize ) > 0 ) dirty = true;
+
+	if( dirty ) SaveIndex();
+
+	return 0;
+
+}
+
+void CalibDB::Close() {
+
+	if( fd >= 0 ) {
+
+		if( dirty ) SaveIndex();
+		close( fd );
+
+	}
+
+	fd = -1;
+	writable = dirty = false;
+	id = logsize = 0;
+	index.clear();
+
+	return;
+
+}
+
+int CalibDB::Refresh() {
+
+	if( fd < 0 ) return 1;
+
+	flock( fd, LOCK_SH );
+	Scan( logsize );
+	flock( fd, LOCK_UN );
+
+	return 0;
+
+}
+
+unsigned long CalibDB::Scan( uint64_t offset ) {
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 ) return 0;
+
+	// Stop at the end or at a record that is incomplete or fails its
+	// checksum, e.g. of a writer that died, which the next Append() then
+	// overwrites
+	unsigned long n = 0;
+	GeffCalibRecord rec;
+	string buf;
+	vector<GeffCalibIndex> added;
+	while( offset + sizeof(rec) <= (uint64_t)st.st_size && ReadRecord( offset, rec, buf ) == 0 ) {
+
+		uint64_t size = rec.size;
+		if( offset + size > (uint64_t)st.st_size ) break;
+
+		GeffCalibIndex entry;
+		entry.detector = rec.detector;
+		entry.runfirst = rec.runfirst;
+		entry.runlast = rec.runlast;
+		entry.reserved = 0;
+		entry.time = rec.time;
+		entry.offset = offset;
+		added.push_back( entry );
+
+		offset += size;
+		n++;
+
+	}
+
+	logsize = offset;
+	if( n > 0 ) {
+
+		Insert( added );
+		dirty = true;
+
+	}
+
+	return n;
+
+}
+
+void CalibDB::Insert( vector<GeffCalibIndex> &entries ) {
+
+	// The index is grouped by detector and span class, so new records
+	// belong all over it, and one at a time would be quadratic
+	sort( entries.begin(), entries.end(), IndexLess );
+
+	unsigned long nold = index.size();
+	index.insert( index.end(), entries.begin(), entries.end() );
+	inplace_merge( index.begin(), index.begin() + nold, index.end(), IndexLess );
+
+	return;
+
+}
+
+int CalibDB::LoadIndex() {
+
+	int ifd = open( ( path + ".idx" ).c_str(), O_RDONLY | O_CLOEXEC );
+	if( ifd < 0 ) return 1;
+
+	GeffCalibHeader hdr;
+	struct stat st, ist;
+	bool valid = fstat( fd, &st ) == 0 && fstat( ifd, &ist ) == 0 && ReadAt( ifd, &hdr, sizeof(hdr), 0 ) &&
+				 (uint64_t)ist.st_size == sizeof(hdr) + hdr.count * sizeof(GeffCalibIndex) &&
+				 memcmp( hdr.magic, kIndexMagic, sizeof(kIndexMagic) ) == 0 &&
+				 hdr.byteorder == kByteOrder && hdr.version == kVersion && hdr.id == id &&
+				 hdr.logsize >= sizeof(GeffCalibHeader) && hdr.logsize <= (uint64_t)st.st_size;
+
+	if( valid ) {
+
+		index.resize( hdr.count );
+		valid = ReadAt( ifd, index.data(), hdr.count * sizeof(GeffCalibIndex), sizeof(hdr) );
+
+	}
+
+	close( ifd );
+
+	// The index is written sorted, anything else is not trusted
+	for( unsigned long i = 1; valid && i < index.size(); i++ )
+		if( IndexLess( index[i], index[i-1] ) ) valid = false;
+
+	if( !valid ) return 1;
+
+	logsize = hdr.logsize;
+
+	return 0;
+
+}
+
+int CalibDB::SaveIndex() {
+
+	GeffCalibHeader hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, kIndexMagic, sizeof(kIndexMagic) );
+	hdr.byteorder = kByteOrder;
+	hdr.version = kVersion;
+	hdr.id = id;
+	hdr.count = index.size();
+	hdr.logsize = logsize;
+
+	// A temporary name of this process, then renamed, so that readers
+	// see either index. It may not be writable for a reader.
+	ostringstream tmp;
+	tmp << path << ".idx.tmp" << getpid();
+	string tmpfile = tmp.str();
+
+	FILE *out = fopen( tmpfile.c_str(), "wb" );
+	if( !out ) return 1;
+
+	bool ok = fwrite( &hdr, sizeof(hdr), 1, out ) == 1 &&
+			  fwrite( index.data(), sizeof(GeffCalibIndex), index.size(), out ) == index.size();
+	ok = fclose( out ) == 0 && ok;
+
+	if( !ok || rename( tmpfile.c_str(), ( path + ".idx" ).c_str() ) != 0 ) {
+
+		remove( tmpfile.c_str() );
+		return 1;
+
+	}
+
+	dirty = false;
+
+	return 0;
+
+}
+
+int CalibDB::Append( CalibEntry &e ) {
+
+	uint32_t n = e.par.size();
+	if( fd < 0 || !writable || n == 0 || n > kMaxPars || e.cov.size() != (unsigned long)n * n ||
+	    e.runfirst > e.runlast ) {
+
+		cerr << "Cannot add this calibration to " << path << endl;
+		return 1;
+
+	}
+
+	if( e.time == 0 ) e.time = ::time( NULL );
+
+	GeffCalibRecord rec;
+	memset( &rec, 0, sizeof(rec) );
+	rec.magic = kRecordMagic;
+	rec.detector = e.detector;
+	rec.runfirst = e.runfirst;
+	rec.runlast = e.runlast;
+	rec.npar = n;
+	rec.time = e.time;
+	strncpy( rec.model, e.model.c_str(), sizeof(rec.model) - 1 );
+	rec.E0 = e.E0;
+	rec.Elow = e.Elow;
+	rec.Eupp = e.Eupp;
+	rec.norm = e.norm;
+	rec.chisq = e.chisq;
+	rec.ndf = e.ndf;
+	rec.status = e.status;
+	rec.valid = e.valid;
+	rec.infosize = e.info.size();
+	rec.size = sizeof(rec) + ( n + (uint64_t)n * n ) * sizeof(double) + e.info.size();
+
+	// The whole record in one buffer, for one write
+	string buf( rec.size, '\0' );
+	char *p = &buf[0];
+	memcpy( p + sizeof(rec), e.par.data(), n * sizeof(double) );
+	memcpy( p + sizeof(rec) + n * sizeof(double), e.cov.data(), (uint64_t)n * n * sizeof(double) );
+	memcpy( p + sizeof(rec) + ( n + (uint64_t)n * n ) * sizeof(double), e.info.data(), e.info.size() );
+	memcpy( p, &rec, sizeof(rec) );
+	rec.checksum = EffCache::Checksum( p, buf.size() );
+	memcpy( p, &rec, sizeof(rec) );
+
+	// Records of other processes first, then this one after the last
+	// complete record, replacing anything left incomplete
+	flock( fd, LOCK_EX );
+	Scan( logsize );
+
+	bool ok = pwrite( fd, p, buf.size(), logsize ) == (ssize_t)buf.size() &&
+			  ftruncate( fd, logsize + buf.size() ) == 0 && fdatasync( fd ) == 0;
+
+	if( ok ) Scan( logsize );
+	flock( fd, LOCK_UN );
+
+	if( !ok ) {
+
+		cerr << "Cannot write to the calibration database " << path << endl;
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+int CalibDB::ReadRecord( uint64_t offset, GeffCalibRecord &rec, string &buf ) const {
+
+	if( !ReadAt( fd, &rec, sizeof(rec), offset ) ) return 1;
+
+	uint64_t size = RecordSize( rec );
+	if( size == 0 ) return 1;
+
+	buf.assign( size, '\0' );
+	char *p = &buf[0];
+	if( !ReadAt( fd, p, size, offset ) ) return 1;
+
+	// Checksum with the field itself as 0
+	memset( p + offsetof( GeffCalibRecord, checksum ), 0, sizeof(rec.checksum) );
+
+	return EffCache::Checksum( p, size ) != rec.checksum;
+
+}
+
+int CalibDB::ReadEntry( uint64_t offset, CalibEntry &e ) const {
+
+	GeffCalibRecord rec;
+	string buf;
+	if( ReadRecord( offset, rec, buf ) ) return 1;
+
+	unsigned int n = rec.npar;
+	const double *par = (const double*)( buf.data() + sizeof(rec) );
+
+	e.detector = rec.detector;
+	e.runfirst = rec.runfirst;
+	e.runlast = rec.runlast;
+	e.time = rec.time;
+	e.model.assign( rec.model, strnlen( rec.model, sizeof(rec.model) ) );
+	e.E0 = rec.E0;
+	e.Elow = rec.Elow;
+	e.Eupp = rec.Eupp;
+	e.norm = rec.norm;
+	e.chisq = rec.chisq;
+	e.ndf = rec.ndf;
+	e.status = rec.status;
+	e.valid = rec.valid;
+	e.par.assign( par, par + n );
+	e.cov.assign( par + n, par + n + n * n );
+	e.info.assign( (const char*)( par + n + n * n ), rec.infosize );
+
+	return 0;
+
+}
+
+int CalibDB::Find( unsigned int detector, unsigned int run, CalibEntry &e, int64_t asof ) const {
+
+	// In each span class, back from the last entry that starts at or
+	// before run over those long enough to reach it. Ranges of a class
+	// are shorter than 2^(c+1) runs, so only the few starting within
+	// that of run are looked at, however wide other ranges are.
+	vector<GeffCalibIndex> candidates;
+	for( unsigned int c = 0; c <= 32; c++ ) {
+
+		unsigned long i = UpperBound( detector, c, run );
+		for( ; i > 0 && index[i-1].detector == detector && SpanClass( index[i-1] ) == c; i-- ) {
+
+			const GeffCalibIndex &x = index[i-1];
+			if( (uint64_t)x.runfirst + ( (uint64_t)2 << c ) - 2 < run ) break;
+			if( x.runlast < run || ( asof != 0 && x.time > asof ) ) continue;
+			candidates.push_back( x );
+
+		}
+
+	}
+
+	// The newest that can be read, passing over corrupt records
+	while( !candidates.empty() ) {
+
+		vector<GeffCalibIndex>::iterator best = min_element( candidates.begin(), candidates.end(), NewerFirst );
+		if( ReadEntry( best->offset, e ) == 0 ) return 0;
+		cerr << "Corrupt record in " << path << " at byte " << best->offset << endl;
+		candidates.erase( best );
+
+	}
+
+	return 1;
+
+}
+
+unsigned long CalibDB::UpperBound( unsigned int detector, unsigned int c, unsigned int run ) const {
+
+	unsigned long lo = 0, hi = index.size();
+	while( lo < hi ) {
+
+		unsigned long mid = lo + ( hi - lo ) / 2;
+		const GeffCalibIndex &x = index[mid];
+		unsigned int cx = SpanClass( x );
+		bool after = x.detector != detector ? x.detector > detector :
+					 cx != c ? cx > c : x.runfirst > run;
+		if( after ) hi = mid;
+		else lo = mid + 1;
+
+	}
+
+	return lo;
+
+}
+
+int CalibDB::List( unsigned int detector, vector<CalibEntry> &entries ) const {
+
+	entries.clear();
+
+	unsigned long i = 0, end = index.size();
+	if( detector != kAll ) {
+
+		GeffCalibIndex key;
+		memset( &key, 0, sizeof(key) );
+		key.detector = detector;
+		i = lower_bound( index.begin(), index.end(), key, IndexLess ) - index.begin();
+		key.detector = detector + 1;
+		if( detector + 1 != 0 )
+			end = lower_bound( index.begin(), index.end(), key, IndexLess ) - index.begin();
+
+	}
+
+	// In run order rather than that of the index
+	vector<GeffCalibIndex> sorted( index.begin() + i, index.begin() + end );
+	sort( sorted.begin(), sorted.end(), RunLess );
+
+	CalibEntry e;
+	for( i = 0; i < sorted.size(); i++ ) {
+
+		if( ReadEntry( sorted[i].offset, e ) ) {
+
+			cerr << "Corrupt record in " << path << " at byte " << sorted[i].offset << endl;
+			return 1;
+
+		}
+
+		entries.push_back( e );
+
+	}
+
+	return 0;
+
+}
+
+int CalibDB::Export( ostream &os ) const {
+
+	os.precision( 17 );
+	os << "# detector\trunfirst\trunlast\ttime\tdate\tmodel\tE0\tElow\tEupp\tnorm";
+	os << "\tchisq\tndf\tstatus\tvalid\tnpar\tpar[npar]\tcov[npar*npar]\n";
+
+	vector<GeffCalibIndex> sorted( index );
+	sort( sorted.begin(), sorted.end(), RunLess );
+
+	CalibEntry e;
+	for( unsigned long i = 0; i < sorted.size(); i++ ) {
+
+		if( ReadEntry( sorted[i].offset, e ) ) {
+
+			cerr << "Corrupt record in " << path << " at byte " << sorted[i].offset << endl;
+			return 1;
+
+		}
+
+		os << e.detector << "\t" << e.runfirst << "\t" << e.runlast << "\t" << e.time;
+		os << "\t" << FormatTime( e.time ) << "\t" << e.model << "\t" << e.E0;
+		os << "\t" << e.Elow << "\t" << e.Eupp << "\t" << e.norm << "\t" << e.chisq;
+		os << "\t" << e.ndf << "\t" << e.status << "\t" << e.valid << "\t" << e.par.size();
+		for( unsigned int k = 0; k < e.par.size(); k++ )
+			os << "\t" << e.par[k];
+		for( unsigned int k = 0; k < e.cov.size(); k++ )
+			os << "\t" << e.cov[k];
+		os << "\n";
+
+	}
+
+	os.flush();
+
+	return os.fail() ? 1 : 0;
+
+}
+
+void CalibDB::WriteCurve( ostream &os, const CalibEntry &e ) {
+
+	unsigned int n = e.par.size();
+
+	os.precision( 17 );
+	os << "# geff calibration of detector " << e.detector;
+	os << " for runs " << e.runfirst << " to " << e.runlast << endl;
+	os << "# fitted " << FormatTime( e.time ) << " UTC, chisq " << e.chisq;
+	os << " / " << e.ndf << ( e.valid ? "" : ", not valid" ) << endl;
+	if( e.info.size() ) os << "# " << e.info << endl;
+	os << "model\t" << e.model << endl;
+	os << "E0\t" << e.E0 << endl;
+	os << "range\t" << e.Elow << "\t" << e.Eupp << endl;
+	os << "norm\t" << e.norm << endl;
+	os << "npar\t" << n << endl;
+
+	os << "par";
+	for( unsigned int i = 0; i < n; i++ )
+		os << "\t" << e.par[i];
+	os << endl;
+
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		os << "cov";
+		for( unsigned int j = 0; j < n; j++ )
+			os << "\t" << e.cov[i*n+j];
+		os << endl;
+
+	}
+
+	return;
+
+}
+
+string CalibDB::FormatTime( int64_t t ) {
+
+	time_t tt = t;
+	struct tm tm;
+	char buf[32];
+	if( !gmtime_r( &tt, &tm ) || !strftime( buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm ) )
+		return "-";
+
+	return buf;
+
+}
+
+int CalibDB::ParseTime( const string &s, int64_t &t ) {
+
+	// Seconds since the epoch
+	char *end;
+	long long secs = strtoll( s.c_str(), &end, 10 );
+	if( !s.empty() && *end == 0 ) {
+
+		t = secs;
+		return 0;
+
+	}
+
+	// A date, with or without the time of day, in UTC
+	struct tm tm;
+	memset( &tm, 0, sizeof(tm) );
+	const char *rest = strptime( s.c_str(), "%Y-%m-%d", &tm );
+	if( rest && *rest ) rest = strptime( rest, " %H:%M:%S", &tm );
+	if( !rest || *rest ) return 1;
+
+	t = timegm( &tm );
+
+	return 0;
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+// Calibration database of fitted efficiency curves across detectors
+// and runs. Every fit is appended to one file with its detector, the
+// runs it is valid for and the time it was made, so that earlier
+// calibrations are never overwritten and any of them can be found
+// again. Free of ROOT, so sort code can link it from libgeffcore.a.
+//
+//   CalibDB db;
+//   if( db.Open( "calib.gdb" ) ) return 1;
+//   CalibEntry e;
+//   if( db.Find( 12, 1234, e ) == 0 ) ...	// detector 12 in run 1234
+//
+// The entry for a run is the newest one whose run range holds it, or
+// the newest made at or before a given time, to reproduce an earlier
+// analysis. The index is sorted by detector, then by span class, the
+// floor of log2 of the number of runs, then by first run and time. A
+// lookup is a binary search in each of the 33 classes and a walk back
+// over the entries of the class that start close enough to reach the
+// run, so wide or open-ended ranges do not slow down the narrow ones:
+// O( log n ) unless many ranges hold the same run.
+//
+// Layout, all in native byte order:
+//   <db>        GeffCalibHeader, then the records one after another
+//     GeffCalibRecord               detector, runs, time, fit summary
+//     double[npar]                  coefficients of the curve
+//     double[npar*npar]             their covariance
+//     char[infosize]                free text, e.g. the input files
+//   <db>.idx    GeffCalibHeader, then GeffCalibIndex[count], sorted,
+//               written again from the database if in another order
+// The index covers the first logsize bytes of the database. Records
+// after that, e.g. appended by another process, are read on Open() and
+// the index is written again. Appends hold an exclusive lock on the
+// database, so many fits may add to it at the same time.
+
+#ifndef __CalibDB_hh__
+#define __CalibDB_hh__
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct GeffCalibHeader {
+
+	char magic[8];			// "GEFFCDB", or "GEFFCDX" for the index
+	uint32_t byteorder;		// 0x01020304 as written
+	uint32_t version;
+	uint64_t id;			// creation time (ns), same in the index
+	uint64_t count;			// index only, entries
+	uint64_t logsize;		// index only, bytes of the database covered
+
+};
+
+struct GeffCalibRecord {
+
+	uint32_t magic;			// 0x4c414347, "GCAL"
+	uint32_t size;			// bytes of the whole record
+	uint32_t detector;
+	uint32_t runfirst;
+	uint32_t runlast;
+	uint32_t npar;
+	int64_t time;			// of the fit, seconds since the epoch
+	char model[16];
+	double E0, Elow, Eupp;
+	double norm;			// normalisation of the first source
+	double chisq;
+	uint32_t ndf;
+	int32_t status;
+	uint32_t valid;
+	uint32_t infosize;
+	uint64_t checksum;		// of the record with this set to 0
+
+};
+
+struct GeffCalibIndex {
+
+	uint32_t detector;
+	uint32_t runfirst;
+	uint32_t runlast;
+	uint32_t reserved;
+	int64_t time;
+	uint64_t offset;		// of the record in the database
+
+};
+
+// One calibration, as in the curve file of geff --curve
+struct CalibEntry {
+
+	unsigned int detector;
+	unsigned int runfirst, runlast;
+	int64_t time;
+	string model;
+	double E0, Elow, Eupp, norm;
+	vector<double> par;		// npar coefficients
+	vector<double> cov;		// npar x npar
+	double chisq;
+	unsigned int ndf;
+	int status;
+	bool valid;
+	string info;
+
+	CalibEntry(){
+		detector = runfirst = runlast = 0;
+		time = 0;
+		E0 = Elow = Eupp = norm = chisq = 0.;
+		ndf = status = 0;
+		valid = false;
+	};
+
+};
+
+class CalibDB {
+
+public:
+
+	static const uint32_t kVersion = 1;
+
+	// Any detector in List()
+	static const unsigned int kAll = 0xffffffff;
+
+	CalibDB(){
+		fd = -1;
+		writable = dirty = false;
+		id = logsize = 0;
+	};
+	~CalibDB(){ Close(); };
+
+	CalibDB( const CalibDB& ) = delete;
+	CalibDB& operator=( const CalibDB& ) = delete;
+
+	// Open a database, created if needed when writable. Returns 0 on success.
+	int Open( const string &_path, bool _writable = false );
+
+	// Write the index if it changed and close
+	void Close();
+
+	// Read the records appended since Open(), e.g. by other processes
+	int Refresh();
+
+	// Append an entry, stamped with the current time if its time is 0.
+	// Returns 0 on success.
+	int Append( CalibEntry &e );
+
+	// Newest entry of detector whose runs hold run, made at or before
+	// asof unless it is 0. Returns 0 if there is one, 1 otherwise.
+	int Find( unsigned int detector, unsigned int run, CalibEntry &e, int64_t asof = 0 ) const;
+
+	// All entries of detector, or of every detector with kAll, sorted by
+	// detector, first run and time. Returns 0 on success.
+	int List( unsigned int detector, vector<CalibEntry> &entries ) const;
+
+	// Every entry as a line of tab-separated columns, for bulk export
+	int Export( ostream &os ) const;
+
+	// An entry in the curve file format of geff_eval.hh, with the
+	// detector, runs and fit summary as comments
+	static void WriteCurve( ostream &os, const CalibEntry &e );
+
+	// Time as YYYY-MM-DD HH:MM:SS in UTC and back, also from seconds
+	// since the epoch. ParseTime returns 0 on success.
+	static string FormatTime( int64_t t );
+	static int ParseTime( const string &s, int64_t &t );
+
+	inline unsigned long Size() const { return index.size(); };
+	inline const string& GetPath() const { return path; };
+
+private:
+
+	// Read the record at offset whole into buf and check it, 0 if valid
+	int ReadRecord( uint64_t offset, GeffCalibRecord &rec, string &buf ) const;
+
+	// Read the record at offset, 0 on success
+	int ReadEntry( uint64_t offset, CalibEntry &e ) const;
+
+	// Add the valid records from offset on to the index, logsize is
+	// then the end of the last of them. Returns the number added.
+	unsigned long Scan( uint64_t offset );
+
+	// Sort the entries and merge them into the index, in one pass
+	// over it however many there are
+	void Insert( vector<GeffCalibIndex> &entries );
+
+	// First entry after those of detector and span class c that start
+	// at or before run
+	unsigned long UpperBound( unsigned int detector, unsigned int c, unsigned int run ) const;
+
+	int LoadIndex();
+	int SaveIndex();
+
+	string path;
+	int fd;
+	bool writable, dirty;
+	uint64_t id, logsize;
+
+	vector<GeffCalibIndex> index;
+
+};
+
+#endif
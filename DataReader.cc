@@ -0,0 +1,214 @@
+// Fast reader for the columns of numbers in efficiency and
+// normalisation files
+
+#ifndef __DataReader_cc__
+#define __DataReader_cc__
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool DataReader::mapfiles = true;
+
+int DataReader::Open( const string &filename ) {
+
+	Close();
+	fname = filename;
+
+	int fd = open( filename.c_str(), O_RDONLY );
+	if( fd < 0 ) return 1;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 ) {
+
+		close( fd );
+		return 1;
+
+	}
+
+	fsize = st.st_size;
+	fmtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	regular = S_ISREG( st.st_mode );
+
+	// Map regular files in one go
+	if( mapfiles && S_ISREG( st.st_mode ) && st.st_size > 0 ) {
+
+		void *p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+		if( p != MAP_FAILED ) {
+
+			madvise( p, st.st_size, MADV_SEQUENTIAL );
+			buf = (const char*)p;
+			len = st.st_size;
+			mapped = true;
+			close( fd );
+			return 0;
+
+		}
+
+	}
+
+	// Otherwise read it in large blocks
+	char block[1<<16];
+	ssize_t n;
+	while( ( n = read( fd, block, sizeof(block) ) ) > 0 )
+		copy.append( block, n );
+	close( fd );
+
+	if( n < 0 ) {
+
+		copy.clear();
+		return 1;
+
+	}
+
+	buf = copy.data();
+	len = copy.size();
+
+	return 0;
+
+}
+
+bool DataReader::Changed() const {
+
+	if( !regular ) return false;
+
+	struct stat st;
+	if( stat( fname.c_str(), &st ) != 0 ) return true;
+
+	return (uint64_t)st.st_size != fsize ||
+		   (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != fmtime;
+
+}
+
+void DataReader::Close() {
+
+	if( mapped ) munmap( (void*)buf, len );
+
+	buf = 0;
+	len = 0;
+	mapped = false;
+	copy.clear();
+
+	return;
+
+}
+
+unsigned int DataReader::Parse( unsigned int ncols, vector<double> *cols[] ) {
+
+	return Parse( buf, buf + len, ncols, cols, fname );
+
+}
+
+unsigned int DataReader::ParseLine( const char *begin, const char *end,
+								   unsigned int n, double *val,
+								   const char **stop ) {
+
+	const char *p = begin;
+	unsigned int i = 0;
+
+	while( i < n ) {
+
+		// Skip the separators
+		while( p < end && ( *p == ' ' || *p == '\t' || *p == '\v' || *p == '\f' ) )
+			p++;
+
+		if( p == end ) break;
+
+		// from_chars doesn't take a leading plus
+		const char *num = p;
+		if( *num == '+' ) num++;
+
+		from_chars_result r = from_chars( num, end, val[i] );
+		if( r.ec != errc() ) break;
+
+		p = r.ptr;
+		i++;
+
+		// Like operator>>, anything glued to a number ends the line
+		if( p < end && *p != ' ' && *p != '\t' && *p != '\v' && *p != '\f' )
+			break;
+
+	}
+
+	if( stop ) *stop = p;
+
+	return i;
+
+}
+
+unsigned int DataReader::Parse( const char *begin, const char *end,
+							   unsigned int ncols, vector<double> *cols[],
+							   const string &name ) {
+
+	vector<double> val( ncols );
+	unsigned int bad = 0;
+	unsigned long lineno = 0;
+	unsigned int n;
+	const char *p = begin;
+	const char *eol, *q;
+
+	// Reserve space for one row per line
+	unsigned long nlines = 1;
+	for( q = begin; q < end && ( q = (const char*)memchr( q, '\n', end - q ) ); q++ )
+		nlines++;
+	for( unsigned int j = 0; j < ncols; j++ )
+		cols[j]->reserve( cols[j]->size() + nlines );
+
+	while( p < end ) {
+
+		lineno++;
+
+		// Numbers first, they stop at the end of the line by themselves
+		n = 0;
+		q = p;
+		if( *p != '#' ) n = ParseLine( p, end, ncols, val.data(), &q );
+
+		// Find the end of the line from where the numbers stopped
+		eol = q;
+		while( eol < end && *eol != '\n' && *eol != '\r' )
+			eol++;
+
+		if( n == ncols ) {
+
+			for( unsigned int j = 0; j < ncols; j++ )
+				cols[j]->push_back( val[j] );
+
+		}
+
+		// Anything but comments and blank lines is reported
+		else if( *p != '#' ) {
+
+			for( ; q < eol && isspace( (unsigned char)*q ); q++ );
+
+			if( n > 0 || q < eol ) {
+
+				cerr << name << ":" << lineno << ": expected " << ncols;
+				cerr << " numbers but found " << n << ", line ignored\n";
+				bad++;
+
+			}
+
+		}
+
+		// Next line, taking CRLF as one
+		p = eol;
+		if( p < end && *p == '\r' ) p++;
+		if( p < end && *p == '\n' ) p++;
+
+	}
+
+	return bad;
+
+}
+#endif
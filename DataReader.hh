@@ -0,0 +1,86 @@
+// Fast reader for the columns of numbers in efficiency and
+// normalisation files. The whole file is mapped into memory and
+// numbers are converted with std::from_chars, which is neither
+// locale-aware nor buffered through a stream.
+
+#ifndef __DataReader_hh__
+#define __DataReader_hh__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class DataReader {
+
+public:
+
+	DataReader(){
+		buf = 0;
+		len = 0;
+		mapped = false;
+		fsize = 0;
+		fmtime = 0;
+		regular = false;
+	};
+	~DataReader(){ Close(); };
+
+	DataReader( const DataReader& ) = delete;
+	DataReader& operator=( const DataReader& ) = delete;
+
+	// Map a file, returns 0 on success and 1 if it can't be read
+	int Open( const string &filename );
+	void Close();
+
+	// Map files, the default, or read them into memory. A file that is
+	// truncated while its mapping is parsed kills the process with
+	// SIGBUS, so files that may be rewritten at any time, as with
+	// --watch, are read. Set it before any thread reads.
+	static inline void SetMapping( bool m ){ mapfiles = m; };
+
+	// Has the file changed in size or modification time since Open()?
+	// Always false for pipes, whose writes count as changes.
+	bool Changed() const;
+
+	// Parse the open file into ncols columns. Lines starting with '#' and
+	// blank lines are skipped, extra numbers on a line are ignored and
+	// lines with too few numbers are reported with their line number.
+	// Lines may end with LF, CRLF or CR. Returns the malformed line count.
+	unsigned int Parse( unsigned int ncols, vector<double> *cols[] );
+
+	// The same for any buffer in memory, name is used in the warnings
+	static unsigned int Parse( const char *begin, const char *end,
+							  unsigned int ncols, vector<double> *cols[],
+							  const string &name );
+
+	// Parse up to n numbers from the start of a line, returns how many
+	// were read and optionally where the parsing stopped
+	static unsigned int ParseLine( const char *begin, const char *end,
+								  unsigned int n, double *val,
+								  const char **stop = 0 );
+
+	inline const char* Data() const { return buf; };
+	inline unsigned long Size() const { return len; };
+
+	// Size and modification time (ns) of the file when it was opened,
+	// i.e. of what is parsed
+	inline uint64_t FileSize() const { return fsize; };
+	inline int64_t FileTime() const { return fmtime; };
+
+private:
+
+	string fname;
+	const char *buf;
+	unsigned long len;
+	bool mapped;
+	string copy;	// fallback when mmap fails, e.g. for pipes
+	uint64_t fsize;
+	int64_t fmtime;
+	bool regular;
+
+	static bool mapfiles;
+
+};
+
+#endif
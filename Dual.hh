@@ -0,0 +1,142 @@
+// Forward-mode automatic differentiation with dual numbers.
+// A Dual<N> carries a value and its gradient with respect to
+// up to N seeded variables, so that a model written once as a
+// template in the number type gives exact derivatives for free.
+
+#ifndef __Dual_hh__
+#define __Dual_hh__
+
+#include <cmath>
+
+template< unsigned int N >
+class Dual {
+
+public:
+
+	// Constant, i.e. all derivatives are zero
+	Dual( double _v = 0. ){
+		v = _v;
+		for( unsigned int i = 0; i < N; i++ ) d[i] = 0.;
+	};
+
+	// Independent variable number i, i.e. d/dx_i = 1
+	Dual( double _v, unsigned int i ){
+		v = _v;
+		for( unsigned int j = 0; j < N; j++ ) d[j] = 0.;
+		if( i < N ) d[i] = 1.;
+	};
+
+	inline double Value() const { return v; };
+	inline double Deriv( unsigned int i ) const { return d[i]; };
+	static inline unsigned int Size(){ return N; };
+
+	// Apply a scalar function with value f and slope df at v
+	inline Dual Chain( double f, double df ) const {
+		Dual r( f );
+		for( unsigned int i = 0; i < N; i++ ) r.d[i] = df * d[i];
+		return r;
+	};
+
+	inline Dual& operator+=( const Dual& b ){
+		v += b.v;
+		for( unsigned int i = 0; i < N; i++ ) d[i] += b.d[i];
+		return *this;
+	};
+
+	inline Dual& operator-=( const Dual& b ){
+		v -= b.v;
+		for( unsigned int i = 0; i < N; i++ ) d[i] -= b.d[i];
+		return *this;
+	};
+
+	inline Dual& operator*=( const Dual& b ){
+		for( unsigned int i = 0; i < N; i++ ) d[i] = d[i] * b.v + v * b.d[i];
+		v *= b.v;
+		return *this;
+	};
+
+	inline Dual& operator/=( const Dual& b ){
+		double inv = 1. / b.v;
+		v *= inv;
+		for( unsigned int i = 0; i < N; i++ ) d[i] = ( d[i] - v * b.d[i] ) * inv;
+		return *this;
+	};
+
+	inline Dual& operator+=( double b ){ v += b; return *this; };
+	inline Dual& operator-=( double b ){ v -= b; return *this; };
+
+	inline Dual& operator*=( double b ){
+		v *= b;
+		for( unsigned int i = 0; i < N; i++ ) d[i] *= b;
+		return *this;
+	};
+
+	inline Dual& operator/=( double b ){ return (*this) *= 1. / b; };
+
+	double v;
+	double d[N];
+
+};
+
+// Arithmetic
+template< unsigned int N >
+inline Dual<N> operator-( const Dual<N>& a ){ Dual<N> r(a); r *= -1.; return r; }
+
+template< unsigned int N >
+inline Dual<N> operator+( Dual<N> a, const Dual<N>& b ){ return a += b; }
+template< unsigned int N >
+inline Dual<N> operator-( Dual<N> a, const Dual<N>& b ){ return a -= b; }
+template< unsigned int N >
+inline Dual<N> operator*( Dual<N> a, const Dual<N>& b ){ return a *= b; }
+template< unsigned int N >
+inline Dual<N> operator/( Dual<N> a, const Dual<N>& b ){ return a /= b; }
+
+template< unsigned int N >
+inline Dual<N> operator+( Dual<N> a, double b ){ return a += b; }
+template< unsigned int N >
+inline Dual<N> operator-( Dual<N> a, double b ){ return a -= b; }
+template< unsigned int N >
+inline Dual<N> operator*( Dual<N> a, double b ){ return a *= b; }
+template< unsigned int N >
+inline Dual<N> operator/( Dual<N> a, double b ){ return a /= b; }
+
+template< unsigned int N >
+inline Dual<N> operator+( double a, Dual<N> b ){ return b += a; }
+template< unsigned int N >
+inline Dual<N> operator-( double a, const Dual<N>& b ){ Dual<N> r(-b); return r += a; }
+template< unsigned int N >
+inline Dual<N> operator*( double a, Dual<N> b ){ return b *= a; }
+template< unsigned int N >
+inline Dual<N> operator/( double a, const Dual<N>& b ){ Dual<N> r(a); return r /= b; }
+
+// Elementary functions, found by argument dependent lookup so
+// that templated code can call exp(), log(), etc. unqualified
+template< unsigned int N >
+inline Dual<N> exp( const Dual<N>& a ){
+	double e = std::exp( a.v );
+	return a.Chain( e, e );
+}
+
+template< unsigned int N >
+inline Dual<N> log( const Dual<N>& a ){
+	return a.Chain( std::log( a.v ), 1. / a.v );
+}
+
+template< unsigned int N >
+inline Dual<N> sqrt( const Dual<N>& a ){
+	double s = std::sqrt( a.v );
+	return a.Chain( s, 0.5 / s );
+}
+
+template< unsigned int N >
+inline Dual<N> pow( const Dual<N>& a, double b ){
+	double p = std::pow( a.v, b - 1. );
+	return a.Chain( p * a.v, b * p );
+}
+
+// Value of a number whether it is a dual or not
+inline double DualValue( double a ){ return a; }
+template< unsigned int N >
+inline double DualValue( const Dual<N>& a ){ return a.v; }
+
+#endif
@@ -0,0 +1,243 @@
+// Binary columnar cache of efficiency and normalisation files
+
+#ifndef __EffCache_cc__
+#define __EffCache_cc__
+
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char kMagic[8] = { 'G', 'E', 'F', 'F', 'B', 'I', 'N', 0 };
+static const uint32_t kByteOrder = 0x01020304;
+
+// Size and modification time of the text file
+static bool SourceStamp( const string &textfile, uint64_t &size, int64_t &mtime ) {
+
+	struct stat st;
+	if( stat( textfile.c_str(), &st ) != 0 ) return false;
+
+	size = st.st_size;
+	mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+	return true;
+
+}
+
+uint64_t EffCache::Checksum( const void *p, unsigned long n ) {
+
+	const unsigned char *c = (const unsigned char*)p;
+	uint64_t h = 14695981039346656037ULL;
+	uint64_t w;
+	unsigned long i = 0;
+
+	for( ; i + 8 <= n; i += 8 ) {
+
+		memcpy( &w, c + i, 8 );
+		h ^= w;
+		h *= 1099511628211ULL;
+
+	}
+
+	for( ; i < n; i++ ) {
+
+		h ^= c[i];
+		h *= 1099511628211ULL;
+
+	}
+
+	return h;
+
+}
+
+int EffCache::Write( const string &textfile, unsigned int ncols,
+					vector<double> *cols[], uint64_t srcsize, int64_t srcmtime ) {
+
+	GeffBinHeader hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, kMagic, sizeof(kMagic) );
+	hdr.byteorder = kByteOrder;
+	hdr.version = kVersion;
+	hdr.ncols = ncols;
+	hdr.nrows = cols[0]->size();
+	hdr.srcsize = srcsize;
+	hdr.srcmtime = srcmtime;
+	hdr.checksum = Checksum( &hdr, offsetof( GeffBinHeader, checksum ) );
+
+	// Column descriptors
+	vector<GeffBinColumn> desc( ncols );
+	uint64_t offset = sizeof(hdr) + ncols * sizeof(GeffBinColumn);
+	for( unsigned int j = 0; j < ncols; j++ ) {
+
+		desc[j].offset = offset;
+		desc[j].checksum = Checksum( cols[j]->data(), hdr.nrows * sizeof(double) );
+		offset += hdr.nrows * sizeof(double);
+
+	}
+
+	// Write to a temporary file of this process and rename, so readers
+	// never see half a cache and conversions of the same file don't clash
+	string cachefile = CacheName( textfile );
+	string tmpfile = cachefile + ".tmp" + to_string( getpid() );
+	ofstream out( tmpfile.c_str(), ios::out | ios::binary | ios::trunc );
+
+	if( !out.is_open() ) {
+
+		cerr << "Could not open " << tmpfile << endl;
+		return 1;
+
+	}
+
+	out.write( (const char*)&hdr, sizeof(hdr) );
+	out.write( (const char*)desc.data(), ncols * sizeof(GeffBinColumn) );
+	for( unsigned int j = 0; j < ncols; j++ )
+		out.write( (const char*)cols[j]->data(), hdr.nrows * sizeof(double) );
+	out.close();
+
+	if( out.fail() || rename( tmpfile.c_str(), cachefile.c_str() ) != 0 ) {
+
+		cerr << "Could not write " << cachefile << endl;
+		remove( tmpfile.c_str() );
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+int EffCache::Read( const string &textfile, unsigned int ncols,
+				   vector<double> *cols[] ) {
+
+	// The text file decides whether the cache is up to date
+	uint64_t srcsize;
+	int64_t srcmtime;
+	if( !SourceStamp( textfile, srcsize, srcmtime ) ) return 1;
+
+	string cachefile = CacheName( textfile );
+	int fd = open( cachefile.c_str(), O_RDONLY );
+	if( fd < 0 ) return 1;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || (uint64_t)st.st_size < sizeof(GeffBinHeader) ) {
+
+		close( fd );
+		return 1;
+
+	}
+
+	unsigned long len = st.st_size;
+	void *map = mmap( 0, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED ) return 1;
+
+	const char *buf = (const char*)map;
+	GeffBinHeader hdr;
+	memcpy( &hdr, buf, sizeof(hdr) );
+
+	// Check everything before touching the columns
+	int result = 1;
+	const GeffBinColumn *desc = (const GeffBinColumn*)( buf + sizeof(hdr) );
+	uint64_t colsize = hdr.nrows * sizeof(double);
+
+	if( memcmp( hdr.magic, kMagic, sizeof(kMagic) ) != 0 ||
+	    hdr.byteorder != kByteOrder || hdr.version != kVersion ||
+	    hdr.checksum != Checksum( &hdr, offsetof( GeffBinHeader, checksum ) ) ) {
+
+		cerr << cachefile << " is not a valid cache, reading the text file\n";
+
+	}
+
+	else if( hdr.ncols != ncols ) {
+
+		cerr << cachefile << " has " << hdr.ncols << " columns instead of ";
+		cerr << ncols << ", reading the text file\n";
+
+	}
+
+	else if( hdr.srcsize != srcsize || hdr.srcmtime != srcmtime ) {
+
+		cout << cachefile << " is out of date, reading the text file\n";
+
+	}
+
+	else if( len < sizeof(hdr) + ncols * sizeof(GeffBinColumn) ) {
+
+		cerr << cachefile << " is truncated, reading the text file\n";
+
+	}
+
+	else {
+
+		result = 0;
+		for( unsigned int j = 0; j < ncols && result == 0; j++ ) {
+
+			if( desc[j].offset % sizeof(double) != 0 ||
+			    desc[j].offset + colsize > len ||
+			    desc[j].checksum != Checksum( buf + desc[j].offset, colsize ) ) {
+
+				cerr << cachefile << " has a bad column, reading the text file\n";
+				result = 1;
+
+			}
+
+		}
+
+		// No parsing, the columns are copied as they are
+		for( unsigned int j = 0; j < ncols && result == 0; j++ ) {
+
+			const double *col = (const double*)( buf + desc[j].offset );
+			cols[j]->insert( cols[j]->end(), col, col + hdr.nrows );
+
+		}
+
+	}
+
+	munmap( map, len );
+
+	return result;
+
+}
+
+int EffCache::Convert( const string &textfile, unsigned int ncols ) {
+
+	DataReader reader;
+
+	if( reader.Open( textfile ) ) {
+
+		cerr << "Could not open " << textfile << endl;
+		return 1;
+
+	}
+
+	vector< vector<double> > data( ncols );
+	vector< vector<double>* > cols( ncols );
+	for( unsigned int j = 0; j < ncols; j++ )
+		cols[j] = &data[j];
+
+	reader.Parse( ncols, cols.data() );
+	reader.Close();
+
+	if( Write( textfile, ncols, cols.data(), reader.FileSize(), reader.FileTime() ) ) return 1;
+
+	cout << "Converted " << textfile << " (" << data[0].size();
+	cout << " rows) to " << CacheName( textfile ) << endl;
+
+	return 0;
+
+}
+#endif
@@ -0,0 +1,72 @@
+// Binary columnar cache of efficiency and normalisation files.
+//
+// A text file data.dat may be converted to data.dat.geffbin, which is
+// picked up instead of the text whenever it is newer, i.e. the size and
+// modification time of the text file still match those stored in it.
+//
+// Layout, all in native byte order and 8-byte aligned:
+//   GeffBinHeader                 magic, version, sizes, text file stamp
+//   GeffBinColumn[ncols]          offset and checksum of each column
+//   double[nrows] x ncols         the columns, e.g. E, dE, eff, deff
+
+#ifndef __EffCache_hh__
+#define __EffCache_hh__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct GeffBinHeader {
+
+	char magic[8];			// "GEFFBIN"
+	uint32_t byteorder;		// 0x01020304 as written
+	uint32_t version;
+	uint32_t ncols;
+	uint32_t reserved;
+	uint64_t nrows;
+	uint64_t srcsize;		// size of the text file
+	int64_t srcmtime;		// modification time of the text file (ns)
+	uint64_t checksum;		// of the header up to here
+
+};
+
+struct GeffBinColumn {
+
+	uint64_t offset;		// from the start of the file
+	uint64_t checksum;		// of the column data
+
+};
+
+class EffCache {
+
+public:
+
+	static const uint32_t kVersion = 1;
+
+	// Name of the cache that belongs to a text file
+	static inline string CacheName( const string &textfile ){
+		return textfile + ".geffbin";
+	};
+
+	// Write columns read from a text file to its cache, stamped with the
+	// size and modification time (ns) the text had when it was read, so
+	// that a change after that makes the cache out of date. 0 on success.
+	static int Write( const string &textfile, unsigned int ncols,
+					 vector<double> *cols[], uint64_t srcsize, int64_t srcmtime );
+
+	// Fill columns from the cache of a text file if it is valid and
+	// up to date, returns 0 on success and 1 if the text must be read
+	static int Read( const string &textfile, unsigned int ncols,
+					vector<double> *cols[] );
+
+	// Parse a text file with ncols columns and write its cache
+	static int Convert( const string &textfile, unsigned int ncols );
+
+	// 64-bit FNV-1a over 8-byte words, plus any tail bytes
+	static uint64_t Checksum( const void *p, unsigned long n );
+
+};
+
+#endif
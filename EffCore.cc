@@ -0,0 +1,585 @@
+// Fitting core without ROOT
+
+#ifndef __EffCore_cc__
+#define __EffCore_cc__
+
+#ifndef __EffCore_hh__
+#include "EffCore.hh"
+#endif
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#include <fstream>
+#include <iostream>
+
+int CoreFitter::Fit( const vector<double> &p, CoreResult &res ) {
+
+	if( Setup() || p.size() != npars ) return 1;
+
+	res.par = p;
+	res.niter = 0;
+
+	// Start from sensible normalisations, then a second pass is needed
+	// only if the energy errors that matter differ for the fitted curve
+	ClassifyCoordErrors( res.par.data() );
+	ScaleNorms( res.par );
+	int status = 1;
+	for( unsigned int pass = 0; pass < 2; pass++ ) {
+
+		unsigned int niter = 0;
+		status = Minimise( res.par, res.chisq, niter );
+		res.niter += niter;
+
+		if( status || !ClassifyCoordErrors( res.par.data() ) ) break;
+
+	}
+
+	if( status == 1 ) return 1;
+
+	// Covariance from the normal equations at the minimum, which
+	// for a chi2 is twice the inverse of its Hessian
+	vector<double> r, jac, grad;
+	res.chisq = Residuals( res.par.data(), r, &jac );
+	NormalEquations( r, jac, res.cov, grad );
+	if( InvertSym( res.cov, npars, fixed ) ) return 1;
+
+	// With the chi2 gradient 2 J^T r, Minuit's 0.5 g^T C g
+	res.edm = 0;
+	for( unsigned int l = 0; l < npars; l++ )
+		for( unsigned int m = 0; m < npars; m++ )
+			res.edm += 2. * grad[l] * res.cov[l*npars+m] * grad[m];
+
+	// Degrees of freedom from the data only, not the penalty
+	unsigned int ndata = 0;
+	res.nfree = 0;
+	for( unsigned int l = 0; l < npars; l++ )
+		if( !fixed[l] ) res.nfree++;
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*data)[i];
+		for( unsigned int j = 0; j < src.Size(); j++ )
+			if( src.deff[j] != 0 || coord[i][j] ) ndata++;
+		for( unsigned int j = 0; j < src.NormSize(); j++ )
+			if( src.dnorm[j] != 0 ) ndata++;
+
+	}
+
+	res.ndf = ndata > res.nfree ? ndata - res.nfree : 0;
+
+	return status;
+
+}
+
+int CoreFitter::Setup() {
+
+	if( !data || !model || data->Size() == 0 ) return 1;
+
+	nsources = data->Size();
+	npoly = model->NPars();
+	npars = npoly + nsources;
+
+	fixed.assign( npars, false );
+	fixed[npoly] = FirstNormFixed();
+
+	return 0;
+
+}
+
+double CoreFitter::Chi2( const double *p, double *grad ) const {
+
+	vector<double> r, jac;
+	if( !grad ) return Residuals( p, r, 0 );
+
+	double chisq = Residuals( p, r, &jac );
+	for( unsigned int l = 0; l < npars; l++ )
+		grad[l] = 0;
+
+	for( unsigned int k = 0; k < r.size(); k++ )
+		for( unsigned int l = 0; l < npars; l++ )
+			grad[l] += 2. * jac[k*npars+l] * r[k];
+
+	return chisq;
+
+}
+
+bool CoreFitter::FirstNormFixed() const {
+
+	return (*data)[0].NormSize() == 0 || (*data)[0].dnorm[0] / (*data)[0].norm[0] < 1e-9;
+
+}
+
+double CoreFitter::Residuals( const double *p, vector<double> &res, vector<double> *jac ) const {
+
+	res.clear();
+	if( jac ) jac->clear();
+
+	double chisq = 0;
+	double r;
+	vector<double> row( npars );
+
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*data)[i];
+
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+
+			r = PointResidual( i, src.E[j], src.dE[j], src.eff[j], src.deff[j],
+							  coord[i][j], p, row.data() );
+
+			res.push_back( r );
+			chisq += r * r;
+			if( jac ) jac->insert( jac->end(), row.begin(), row.end() );
+
+		}
+
+	}
+
+	// Normalisation data
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*data)[i];
+
+		for( unsigned int j = 0; j < src.NormSize(); j++ ) {
+
+			row.assign( npars, 0. );
+			r = 0;
+
+			if( src.dnorm[j] != 0 ) {
+
+				r = ( src.norm[j] - p[npoly+i] ) / src.dnorm[j];
+				row[npoly+i] = -1. / src.dnorm[j];
+
+			}
+
+			res.push_back( r );
+			chisq += r * r;
+			if( jac ) jac->insert( jac->end(), row.begin(), row.end() );
+
+		}
+
+	}
+
+	// Smoothness penalty as extra residuals, sqrt( lambda ) times
+	// the second differences of the coefficients
+	if( lambda > 0 ) {
+
+		double sl = sqrt( lambda );
+		for( unsigned int k = 2; k < npoly; k++ ) {
+
+			row.assign( npars, 0. );
+			r = sl * ( p[k] - 2. * p[k-1] + p[k-2] );
+			row[k] = sl;
+			row[k-1] = -2. * sl;
+			row[k-2] = sl;
+
+			res.push_back( r );
+			chisq += r * r;
+			if( jac ) jac->insert( jac->end(), row.begin(), row.end() );
+
+		}
+
+	}
+
+	return chisq;
+
+}
+
+double CoreFitter::PointResidual( unsigned int i, double E, double dE, double eff, double deff,
+								 bool coord, const double *p, double *row ) const {
+
+	for( unsigned int l = 0; l < npars; l++ )
+		row[l] = 0;
+
+	// Exact derivatives of the whole residual, including the effective
+	// variance, when the coefficients and one normalisation fit in a dual
+	if( npoly + 1 <= kMaxModelPars ) {
+
+		ModelDual q[kMaxModelPars];
+		for( unsigned int l = 0; l < npoly; l++ )
+			q[l] = ModelDual( p[l], l );
+		ModelDual n( p[npoly+i], npoly );
+
+		ModelDual f = model->Value( E, q ) / n;
+		ModelDual e2 = deff * deff;
+		if( coord ) {
+
+			ModelDual dfdx = model->DerivE( E, q ) / n * dE;
+			e2 += dfdx * dfdx;
+
+		}
+
+		if( e2.Value() <= 0 ) return 0;
+
+		ModelDual r = ( eff - f ) / sqrt( e2 );
+		for( unsigned int l = 0; l < npoly; l++ )
+			row[l] = r.Deriv(l);
+		row[npoly+i] = r.Deriv(npoly);
+
+		return r.Value();
+
+	}
+
+	// Otherwise the effective variance is held constant
+	vector<double> grad( npoly );
+	double M = model->Gradient( E, p, grad.data() );
+	double n = p[npoly+i];
+	double e2 = deff * deff;
+	if( coord ) {
+
+		double dfdx = model->DerivE( E, p ) / n * dE;
+		e2 += dfdx * dfdx;
+
+	}
+
+	if( e2 <= 0 ) return 0;
+
+	double s = sqrt( e2 );
+	for( unsigned int l = 0; l < npoly; l++ )
+		row[l] = -grad[l] / n / s;
+	row[npoly+i] = M / ( n * n ) / s;
+
+	return ( eff - M / n ) / s;
+
+}
+
+bool CoreFitter::ClassifyCoordErrors( const double *p ) {
+
+	bool changed = ( coord.size() != nsources );
+	coord.resize( nsources );
+
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*data)[i];
+		if( coord[i].size() != src.Size() ) {
+
+			coord[i].assign( src.Size(), false );
+			changed = true;
+
+		}
+
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+
+			bool sig = CoordError( i, src.E[j], src.dE[j], src.deff[j], p );
+			if( sig != coord[i][j] ) changed = true;
+			coord[i][j] = sig;
+
+		}
+
+	}
+
+	return changed;
+
+}
+
+bool CoreFitter::CoordError( unsigned int i, double E, double dE, double deff, const double *p ) const {
+
+	if( dE == 0 ) return false;
+
+	// Compare ( dE * deff/dE )^2 to the efficiency error
+	double dfdx = model->DerivE( E, p ) / p[npoly+i] * dE;
+	return dfdx * dfdx > xthresh * deff * deff;
+
+}
+
+void CoreFitter::ScaleNorms( vector<double> &p ) const {
+
+	// The efficiency is M / n, so 1 / n is a linear least squares
+	// problem for each source with the curve M held constant
+	vector<double> trial( p );
+	vector<double> M;
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*data)[i];
+		if( fixed[npoly+i] || src.Size() == 0 ) continue;
+
+		M.resize( src.Size() );
+		model->Values( src.Size(), src.E.data(), p.data(), M.data() );
+
+		double sxy = 0, sxx = 0, w;
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+
+			if( src.deff[j] == 0 || !isfinite( M[j] ) ) continue;
+			w = 1. / ( src.deff[j] * src.deff[j] );
+			sxy += w * src.eff[j] * M[j];
+			sxx += w * M[j] * M[j];
+
+		}
+
+		if( sxy > 0 && sxx > 0 ) trial[npoly+i] = sxx / sxy;
+
+	}
+
+	if( Chi2( trial.data() ) < Chi2( p.data() ) ) p = trial;
+
+	return;
+
+}
+
+void CoreFitter::NormalEquations( const vector<double> &res, const vector<double> &jac,
+								 vector<double> &hess, vector<double> &grad ) const {
+
+	hess.assign( npars * npars, 0. );
+	grad.assign( npars, 0. );
+
+	for( unsigned int k = 0; k < res.size(); k++ ) {
+
+		const double *a = &jac[k*npars];
+		for( unsigned int l = 0; l < npars; l++ ) {
+
+			if( a[l] == 0 || fixed[l] ) continue;
+			grad[l] += a[l] * res[k];
+			for( unsigned int m = 0; m < npars; m++ )
+				if( !fixed[m] ) hess[l*npars+m] += a[l] * a[m];
+
+		}
+
+	}
+
+	return;
+
+}
+
+int CoreFitter::Minimise( vector<double> &p, double &chisq, unsigned int &niter ) const {
+
+	vector<double> res, jac, hess, grad, damped, trial( npars ), step( npars );
+	double mu = 1e-3, nu = 2.;
+	double chisq_new;
+
+	chisq = Residuals( p.data(), res, &jac );
+	if( !isfinite( chisq ) ) return 1;
+	if( verbose ) cout << "Native fit, initial chisq = " << chisq << endl;
+
+	for( niter = 0; niter < maxiter; niter++ ) {
+
+		NormalEquations( res, jac, hess, grad );
+
+		// Increase the damping until the chi2 goes down, and relax it by
+		// how well the quadratic model predicted the drop (Nielsen)
+		bool accepted = false;
+		while( mu < 1e10 ) {
+
+			damped = hess;
+			for( unsigned int l = 0; l < npars; l++ )
+				damped[l*npars+l] *= 1. + mu;
+
+			if( InvertSym( damped, npars, fixed ) ) {
+
+				mu *= nu;
+				nu *= 2.;
+				continue;
+
+			}
+
+			for( unsigned int l = 0; l < npars; l++ ) {
+
+				step[l] = 0;
+				for( unsigned int m = 0; m < npars; m++ )
+					step[l] -= damped[l*npars+m] * grad[m];
+				trial[l] = p[l] + step[l];
+
+			}
+
+			chisq_new = Chi2( trial.data() );
+			if( chisq_new <= chisq ) {
+
+				// Predicted drop of the chi2 for this step
+				double pred = 0;
+				for( unsigned int l = 0; l < npars; l++ )
+					pred -= step[l] * ( grad[l] - mu * hess[l*npars+l] * step[l] );
+
+				double rho = pred > 0 ? ( chisq - chisq_new ) / pred : 0;
+				double t = 2. * rho - 1.;
+				mu *= max( 1. / 3., 1. - t * t * t );
+				mu = max( mu, 1e-12 );
+				nu = 2.;
+				accepted = true;
+				break;
+
+			}
+
+			mu *= nu;
+			nu *= 2.;
+
+		}
+
+		// No step lowers the chi2, so this is the minimum
+		if( !accepted ) break;
+
+		double change = chisq - chisq_new;
+		p = trial;
+		chisq = Residuals( p.data(), res, &jac );
+
+		if( change <= 1e-10 * ( 1. + chisq ) ) break;
+
+	}
+
+	if( verbose ) {
+
+		cout << "Native fit, chisq = " << chisq << " after ";
+		cout << niter << " iterations\n";
+
+	}
+
+	return niter < maxiter ? 0 : 2;
+
+}
+
+int CoreFitter::InvertSym( vector<double> &m, unsigned int n, const vector<bool> &fixed ) {
+
+	// Free rows and columns only
+	vector<unsigned int> idx;
+	for( unsigned int i = 0; i < n; i++ )
+		if( !fixed[i] ) idx.push_back( i );
+
+	unsigned int nf = idx.size();
+	vector<double> a( nf * nf ), inv( nf * nf, 0. );
+	for( unsigned int i = 0; i < nf; i++ )
+		for( unsigned int j = 0; j < nf; j++ )
+			a[i*nf+j] = m[idx[i]*n+idx[j]];
+
+	// Cholesky decomposition a = L L^T, stored in the lower triangle
+	for( unsigned int j = 0; j < nf; j++ ) {
+
+		double sum = a[j*nf+j];
+		for( unsigned int k = 0; k < j; k++ )
+			sum -= a[j*nf+k] * a[j*nf+k];
+		if( !( sum > 0 ) ) return 1;
+		a[j*nf+j] = sqrt( sum );
+
+		for( unsigned int i = j + 1; i < nf; i++ ) {
+
+			sum = a[i*nf+j];
+			for( unsigned int k = 0; k < j; k++ )
+				sum -= a[i*nf+k] * a[j*nf+k];
+			a[i*nf+j] = sum / a[j*nf+j];
+
+		}
+
+	}
+
+	// Solve L L^T x = e_c for each column c of the inverse
+	vector<double> x( nf );
+	for( unsigned int c = 0; c < nf; c++ ) {
+
+		for( unsigned int i = 0; i < nf; i++ ) {
+
+			double sum = ( i == c ) ? 1. : 0.;
+			for( unsigned int k = 0; k < i; k++ )
+				sum -= a[i*nf+k] * x[k];
+			x[i] = sum / a[i*nf+i];
+
+		}
+
+		for( unsigned int i = nf; i-- > 0; ) {
+
+			double sum = x[i];
+			for( unsigned int k = i + 1; k < nf; k++ )
+				sum -= a[k*nf+i] * x[k];
+			x[i] = sum / a[i*nf+i];
+
+		}
+
+		for( unsigned int i = 0; i < nf; i++ )
+			inv[i*nf+c] = x[i];
+
+	}
+
+	m.assign( n * n, 0. );
+	for( unsigned int i = 0; i < nf; i++ )
+		for( unsigned int j = 0; j < nf; j++ )
+			m[idx[i]*n+idx[j]] = inv[i*nf+j];
+
+	return 0;
+
+}
+
+int CoreFitter::ReadColumns( const string &filename, unsigned int ncols,
+							vector<double> *cols[], const string &what ) {
+
+	// An up to date binary cache needs no parsing
+	if( EffCache::Read( filename, ncols, cols ) == 0 ) {
+
+		cout << "Opened " << what << " cache: " << EffCache::CacheName( filename ) << endl;
+		return 0;
+
+	}
+
+	DataReader reader;
+	if( reader.Open( filename ) ) {
+
+		cerr << "Could not open " << filename << endl;
+		return 1;
+
+	}
+
+	cout << "Opened " << what << " file: " << filename << endl;
+
+	reader.Parse( ncols, cols );
+	reader.Close();
+
+	// Rewritten while it was parsed, so the columns may be a mix
+	if( reader.Changed() ) {
+
+		cerr << filename << " changed while it was read\n";
+		for( unsigned int j = 0; j < ncols; j++ )
+			cols[j]->clear();
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+int CoreFitter::WriteCurve( const string &filename, const string &modelname,
+						   double E0, double Elow, double Eupp, unsigned int npoly,
+						   const vector<double> &par, const vector<double> &cov ) {
+
+	unsigned int n = par.size();
+	if( npoly >= n || cov.size() != n * n ) return 1;
+
+	ofstream curvefile;
+	curvefile.open( filename.c_str(), ios::out );
+	if( !curvefile.is_open() ) {
+
+		cerr << "Cannot write " << filename << endl;
+		return 1;
+
+	}
+
+	// Full precision, so that the curve is exactly the fitted one
+	curvefile.precision( 17 );
+	curvefile << "# geff fitted efficiency curve, read with geff_eval.hh\n";
+	curvefile << "model\t" << modelname << endl;
+	curvefile << "E0\t" << E0 << endl;
+	curvefile << "range\t" << Elow << "\t" << Eupp << endl;
+	curvefile << "norm\t" << par[npoly] << endl;
+	curvefile << "npar\t" << npoly << endl;
+
+	curvefile << "par";
+	for( unsigned int i = 0; i < npoly; i++ )
+		curvefile << "\t" << par[i];
+	curvefile << endl;
+
+	for( unsigned int i = 0; i < npoly; i++ ) {
+
+		curvefile << "cov";
+		for( unsigned int j = 0; j < npoly; j++ )
+			curvefile << "\t" << cov[i*n+j];
+		curvefile << endl;
+
+	}
+
+	curvefile.close();
+	cout << "Fitted curve written to " << filename << endl;
+
+	return 0;
+
+}
+#endif
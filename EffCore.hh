@@ -0,0 +1,152 @@
+// Fitting core without ROOT. The global chi2 of all sources, i.e. the
+// efficiency data with effective variance and the normalisations, is
+// minimised with Levenberg-Marquardt on exact derivatives from dual
+// numbers. Only the standard library is needed, so the core can be
+// linked on its own (libgeffcore.a) into programs that must not load
+// ROOT, e.g. geff-core or DAQ processes. GlobalFitter is an adapter
+// over it: the classification of the energy errors, the residuals and
+// their Jacobian, the chi2 and its gradient and the fit itself are all
+// done here, and FitEff reads its text files and caches through it.
+
+#ifndef __EffCore_hh__
+#define __EffCore_hh__
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+#ifndef __EffModels_hh__
+#include "EffModels.hh"
+#endif
+
+using namespace std;
+
+// Result of a fit, the parameters are the coefficients of the model
+// followed by the normalisations of the sources
+struct CoreResult {
+
+	vector<double> par;
+	vector<double> cov;		// npars x npars, zero for fixed parameters
+	double chisq;
+	double edm;			// expected distance to the minimum, as Minuit's
+	unsigned int ndf;
+	unsigned int nfree;
+	unsigned int niter;
+
+	inline double Error( unsigned int i ) const {
+		return sqrt( cov[ i * par.size() + i ] );
+	};
+
+};
+
+class CoreFitter {
+
+public:
+
+	CoreFitter(){
+		xthresh = 1e-4;
+		lambda = 0;
+		maxiter = 200;
+		verbose = false;
+	};
+
+	// Share the data, nothing is copied
+	inline void SetData( EffDataPtr _data ){ data = _data; };
+	inline void SetModel( shared_ptr<const EffModel> _model ){ model = _model; };
+
+	// Energy errors only count where ( dE * deff/dE )^2 exceeds
+	// xthresh * deff^2, as in GlobalFitter
+	inline void SetCoordErrorThreshold( double t ){ xthresh = t; };
+
+	// Penalty lambda times the squared second differences of the
+	// coefficients, for splines, zero by default
+	inline void SetPenalty( double _lambda ){ lambda = _lambda; };
+
+	inline void SetMaxIterations( unsigned int n ){ maxiter = n; };
+	inline void SetVerbose( bool v ){ verbose = v; };
+
+	// Fit from the parameters p, returns 0 on convergence, 2 if it stopped
+	// at the iteration limit with res holding the best point so far, and 1
+	// on failure. The first normalisation is fixed if the first source has
+	// no data for it.
+	int Fit( const vector<double> &p, CoreResult &res );
+
+	// Sizes of the problem and the fixed parameters from the data and
+	// the model, done by Fit() too. Returns 1 if either is missing.
+	int Setup();
+
+	// Chi2 at p with the energy errors of the last classification, and
+	// unless grad is null its gradient, npars values
+	double Chi2( const double *p, double *grad = 0 ) const;
+
+	// Normalised residuals at p, the efficiency points of all sources,
+	// then their normalisations and the penalty, and unless jac is null
+	// the Jacobian, npars values per row. Returns the chi2.
+	double Residuals( const double *p, vector<double> &res, vector<double> *jac ) const;
+
+	// Residual of an efficiency point E, eff +/- deff of source i at p,
+	// with its energy error dE if coord, and its row of the Jacobian
+	double PointResidual( unsigned int i, double E, double dE, double eff, double deff,
+						 bool coord, const double *p, double *row ) const;
+
+	// Find the energy errors that matter at p, true if any changed
+	bool ClassifyCoordErrors( const double *p );
+
+	// Does the energy error dE of a point of source i matter at p?
+	bool CoordError( unsigned int i, double E, double dE, double deff, const double *p ) const;
+
+	// Classification of the points of each source, which is kept as
+	// set when only some points are added or removed
+	inline const vector< vector<bool> >& CoordErrors() const { return coord; };
+	inline void SetCoordErrors( const vector< vector<bool> > &c ){ coord = c; };
+
+	// Is the first normalisation fixed in the fit?
+	bool FirstNormFixed() const;
+
+	// Invert the symmetric positive definite n x n matrix m in place,
+	// leaving the rows and columns in fixed as zero. Returns 0 on success.
+	static int InvertSym( vector<double> &m, unsigned int n, const vector<bool> &fixed );
+
+	// Read ncols columns from the binary cache of a file if it is up to
+	// date, or from the text otherwise. Returns 0 on success.
+	static int ReadColumns( const string &filename, unsigned int ncols,
+						   vector<double> *cols[], const string &what );
+
+	// Write a fitted curve for geff_eval.hh. par holds the npoly
+	// coefficients followed by the normalisations and cov their
+	// covariance, of size par.size() squared. Returns 0 on success.
+	static int WriteCurve( const string &filename, const string &modelname,
+						  double E0, double Elow, double Eupp, unsigned int npoly,
+						  const vector<double> &par, const vector<double> &cov );
+
+private:
+
+	// Set the free normalisations to their best values for the curve
+	// of the coefficients in p, if that lowers the chi2
+	void ScaleNorms( vector<double> &p ) const;
+
+	// Levenberg-Marquardt from p, returns 0 on convergence, 2 at the
+	// iteration limit and 1 if the chi2 cannot be computed
+	int Minimise( vector<double> &p, double &chisq, unsigned int &niter ) const;
+
+	// J^T J and J^T r over the rows, without the fixed parameters
+	void NormalEquations( const vector<double> &res, const vector<double> &jac,
+						 vector<double> &hess, vector<double> &grad ) const;
+
+	EffDataPtr data;
+	shared_ptr<const EffModel> model;
+	vector< vector<bool> > coord;
+	vector<bool> fixed;
+	unsigned int npoly, nsources, npars;
+	double xthresh, lambda;
+	unsigned int maxiter;
+	bool verbose;
+
+};
+
+#endif
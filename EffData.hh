@@ -0,0 +1,81 @@
+// Efficiency and normalisation data of all sources, read once
+// by FitEff and shared with GlobalFitter without any copies
+
+#ifndef __EffData_hh__
+#define __EffData_hh__
+
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// Data of a single source, each column is contiguous
+struct EffSource {
+
+	// Efficiency data
+	vector<double> E;		// energy (keV)
+	vector<double> dE;		// error on energy (keV)
+	vector<double> eff;		// efficiency (arb.)
+	vector<double> deff;	// error on efficiency (arb.)
+
+	// Normalisation data
+	vector<double> norm;	// normalisation (%/arb.)
+	vector<double> dnorm;	// error on normalisation (%/arb.)
+
+	inline unsigned int Size() const { return E.size(); };
+	inline unsigned int NormSize() const { return norm.size(); };
+
+};
+
+// Data of all sources, filled by the reader and afterwards only
+// shared as an immutable object through an EffDataPtr. Copying is
+// disabled so that the data can only ever be moved. A new set that
+// differs in one source shares all the others with the old one.
+class EffData {
+
+public:
+
+	EffData( unsigned int n = 0 ){
+		Resize( n );
+	};
+
+	// The same sources as old, except for source i
+	EffData( const EffData &old, unsigned int i, EffSource &&src ){
+		sources = old.sources;
+		sources[i] = make_shared<EffSource>( std::move( src ) );
+	};
+
+	EffData( const EffData& ) = delete;
+	EffData& operator=( const EffData& ) = delete;
+	EffData( EffData&& ) = default;
+	EffData& operator=( EffData&& ) = default;
+
+	inline unsigned int Size() const { return sources.size(); };
+	inline void Resize( unsigned int n ){
+		unsigned int old = sources.size();
+		sources.resize( n );
+		for( unsigned int i = old; i < n; i++ )
+			sources[i] = make_shared<EffSource>();
+	};
+
+	// Only for filling, a source may be shared with another set
+	inline const EffSource& operator[]( unsigned int i ) const { return *sources[i]; };
+	inline EffSource& operator[]( unsigned int i ){ return *sources[i]; };
+
+	// Total number of efficiency and normalisation points
+	inline unsigned long NPoints() const {
+		unsigned long n = 0;
+		for( unsigned int i = 0; i < sources.size(); i++ )
+			n += sources[i]->Size() + sources[i]->NormSize();
+		return n;
+	};
+
+private:
+
+	vector< shared_ptr<EffSource> > sources;
+
+};
+
+typedef shared_ptr<const EffData> EffDataPtr;
+
+#endif
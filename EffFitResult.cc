@@ -0,0 +1,131 @@
+// Result of a fit as geff keeps it
+
+#ifndef __EffFitResult_cc__
+#define __EffFitResult_cc__
+
+#ifndef __EffFitResult_hh__
+#include "EffFitResult.hh"
+#endif
+
+#include "Fit/FitResult.h"
+
+#include <cmath>
+#include <iomanip>
+
+EffFitResult::EffFitResult( const ROOT::Fit::FitResult &res ) {
+
+	unsigned int n = res.NPar();
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		par.push_back( res.Value(i) );
+		err.push_back( res.Error(i) );
+		fixed.push_back( res.IsParameterFixed(i) );
+		names.push_back( res.ParName(i) );
+
+	}
+
+	cov.resize( (unsigned long)n * n );
+	for( unsigned int i = 0; i < n; i++ )
+		for( unsigned int j = 0; j < n; j++ )
+			cov[i*n+j] = res.CovMatrix( i, j );
+
+	minimizer = res.MinimizerType();
+	chisq = res.Chi2();
+	edm = res.Edm();
+	ndf = res.Ndf();
+	nfree = res.NFreeParameters();
+	ncalls = res.NCalls();
+	status = res.Status();
+	covstatus = res.CovMatrixStatus();
+	valid = res.IsValid();
+
+}
+
+void EffFitResult::Print( ostream &os ) const {
+
+	os << "\n****************************************\n";
+	if( !valid ) {
+
+		if( status != 0 ) os << "         Invalid FitResult  (status = " << status << " )";
+		else os << "      FitResult before fitting";
+		os << "\n****************************************\n";
+
+	}
+
+	// Names and values in columns, as ROOT does
+	const unsigned int nw = 25, nn = 12;
+	const ios_base::fmtflags flags = os.flags();
+
+	os << "Minimizer is " << minimizer << endl;
+	os << left << setw(nw) << "Chi2" << " = " << right << setw(nn) << chisq << endl;
+	os << left << setw(nw) << "NDf" << " = " << right << setw(nn) << ndf << endl;
+	os << left << setw(nw) << "Edm" << " = " << right << setw(nn) << edm << endl;
+	os << left << setw(nw) << "NCalls" << " = " << right << setw(nn) << ncalls << endl;
+
+	for( unsigned int i = 0; i < par.size(); i++ ) {
+
+		os << left << setw(nw) << names[i] << " = " << right << setw(nn) << par[i];
+		if( fixed[i] ) os << setw(9) << " " << setw(nn) << " " << " \t (fixed)";
+		else os << "   +/-   " << left << setw(nn) << err[i] << right;
+		os << endl;
+
+	}
+
+	os.flags( flags );
+
+	return;
+
+}
+
+void EffFitResult::PrintCovMatrix( ostream &os ) const {
+
+	if( !valid || cov.empty() ) return;
+
+	const unsigned int parw = 12, matw = 12;
+	const streamsize prec = os.precision( 5 );
+	const ios_base::fmtflags flags = os.flags();
+
+	// The covariance, then the correlation, of the free parameters
+	for( unsigned int k = 0; k < 2; k++ ) {
+
+		os << ( k == 0 ? "\nCovariance Matrix:\n\n" : "\nCorrelation Matrix:\n\n" );
+		os << setw(parw) << " " << "\t";
+		for( unsigned int i = 0; i < par.size(); i++ )
+			if( !fixed[i] ) os << right << setw(matw) << names[i];
+		os << endl;
+
+		for( unsigned int i = 0; i < par.size(); i++ ) {
+
+			if( fixed[i] ) continue;
+
+			os << left << setw(parw) << names[i] << "\t";
+			for( unsigned int j = 0; j < par.size(); j++ ) {
+
+				if( fixed[j] ) continue;
+
+				double c = CovMatrix( i, j );
+				if( k == 1 ) {
+
+					double d = CovMatrix( i, i ) * CovMatrix( j, j );
+					c = d > 0 ? c / sqrt( d ) : 0.;
+
+				}
+
+				os << right << setw(matw) << c;
+
+			}
+
+			os << endl;
+
+		}
+
+	}
+
+	os.precision( prec );
+	os.flags( flags );
+
+	return;
+
+}
+
+#endif
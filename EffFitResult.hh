@@ -0,0 +1,72 @@
+// Result of a fit as geff keeps it: the parameters with their names,
+// errors and covariance, and the summary of the minimisation. It has
+// the accessors of ROOT::Fit::FitResult that geff uses and is filled
+// from one through its public interface only, so that the fit cache
+// can store and restore it whatever the version of ROOT.
+
+#ifndef __EffFitResult_hh__
+#define __EffFitResult_hh__
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace ROOT { namespace Fit { class FitResult; } }
+
+struct EffFitResult {
+
+	vector<double> par;
+	vector<double> err;
+	vector<double> cov;		// npar x npar, empty if there is none
+	vector<bool> fixed;
+	vector<string> names;
+	string minimizer;		// e.g. "Minuit2 / Migrad"
+	double chisq;
+	double edm;
+	unsigned int ndf;
+	unsigned int nfree;
+	unsigned int ncalls;
+	int status;
+	int covstatus;
+	bool valid;
+
+	EffFitResult(){
+		chisq = edm = 0.;
+		ndf = nfree = ncalls = 0;
+		status = -1;
+		covstatus = 0;
+		valid = false;
+	};
+
+	// From a ROOT fit
+	explicit EffFitResult( const ROOT::Fit::FitResult &res );
+
+	inline unsigned int NPar() const { return par.size(); };
+	inline const vector<double>& Parameters() const { return par; };
+	inline const vector<double>& Errors() const { return err; };
+	inline double Value( unsigned int i ) const { return par[i]; };
+	inline double Error( unsigned int i ) const { return err[i]; };
+	inline double CovMatrix( unsigned int i, unsigned int j ) const {
+		return cov.empty() ? 0. : cov[ i * par.size() + j ];
+	};
+	inline string ParName( unsigned int i ) const { return names[i]; };
+	inline bool IsParameterFixed( unsigned int i ) const { return fixed[i]; };
+
+	inline double Chi2() const { return chisq; };
+	inline double Edm() const { return edm; };
+	inline unsigned int Ndf() const { return ndf; };
+	inline unsigned int NFreeParameters() const { return nfree; };
+	inline unsigned int NCalls() const { return ncalls; };
+	inline int Status() const { return status; };
+	inline int CovMatrixStatus() const { return covstatus; };
+	inline bool IsValid() const { return valid; };
+
+	// Laid out as by ROOT::Fit::FitResult
+	void Print( ostream &os ) const;
+	void PrintCovMatrix( ostream &os ) const;
+
+};
+
+#endif
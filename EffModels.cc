@@ -0,0 +1,406 @@
+// Efficiency models and their registry
+
+#ifndef __EffModels_cc__
+#define __EffModels_cc__
+
+#ifndef __EffModels_hh__
+#include "EffModels.hh"
+#endif
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#include <algorithm>
+#include <iostream>
+
+const double kStartPoly[5] = { -1.84, -0.52, -0.01, 0.06, -0.06 };
+
+// Polynomial
+double PolyModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double f = Value( E, c );
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	for( unsigned int k = 0; k < n; k++ ) {
+
+		grad[k] = f * Lk;
+		Lk *= L;
+
+	}
+
+	return f;
+
+}
+
+vector<double> PolyModel::Start() const {
+
+	vector<double> c( n, 0. );
+	for( unsigned int k = 0; k < n && k < 5; k++ )
+		c[k] = kStartPoly[k];
+
+	return c;
+
+}
+
+// B-spline
+unsigned int SplineModel::Basis( double L, double *b, double *db ) const {
+
+	// Knot interval, the end intervals extend beyond the range
+	double x = ( L - l0 ) / h;
+	int k = (int)floor( x );
+	if( k < 0 ) k = 0;
+	if( k > (int)nknots ) k = nknots;
+
+	// Uniform cubic B-spline on [k,k+1)
+	double u = x - k;
+	double v = 1. - u;
+
+	b[0] = v * v * v / 6.;
+	b[1] = ( 3. * u * u * u - 6. * u * u + 4. ) / 6.;
+	b[2] = ( -3. * u * u * u + 3. * u * u + 3. * u + 1. ) / 6.;
+	b[3] = u * u * u / 6.;
+
+	db[0] = -0.5 * v * v / h;
+	db[1] = ( 1.5 * u * u - 2. * u ) / h;
+	db[2] = ( -1.5 * u * u + u + 0.5 ) / h;
+	db[3] = 0.5 * u * u / h;
+
+	return k;
+
+}
+
+double SplineModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double b[4], db[4];
+	unsigned int k = Basis( log( E / E0 ), b, db );
+	double f = Value( E, c );
+
+	for( unsigned int m = 0; m < NPars(); m++ )
+		grad[m] = 0;
+
+	for( unsigned int m = 0; m < 4; m++ )
+		grad[k+m] = f * b[m];
+
+	return f;
+
+}
+
+vector<double> SplineModel::Start() const {
+
+	// The default polynomial at the peak of each basis function
+	vector<double> c( NPars(), 0. );
+	double L, Lm;
+	for( unsigned int k = 0; k < c.size(); k++ ) {
+
+		L = Greville( k );
+		Lm = 1.;
+		for( unsigned int m = 0; m < 5; m++ ) {
+
+			c[k] += kStartPoly[m] * Lm;
+			Lm *= L;
+
+		}
+
+	}
+
+	return c;
+
+}
+
+// RadWare/Jaeckel
+double RadwareModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double x = log( E / 100. );
+	double y = log( E / 1000. );
+
+	double a = c[0] + c[1] * x + c[2] * x * x;
+	double b = c[3] + c[4] * y + c[5] * y * y;
+	double ga = exp( -c[6] * log( a ) );
+	double gb = exp( -c[6] * log( b ) );
+	double s = ga + gb;
+	double R = exp( -log( s ) / c[6] );
+	double f = exp( R ) * 1e-4;
+
+	// dM/dp = M dR/dp, with the weights of the two branches
+	double wa = f * R * ga / s / a;
+	double wb = f * R * gb / s / b;
+
+	grad[0] = wa;
+	grad[1] = wa * x;
+	grad[2] = wa * x * x;
+	grad[3] = wb;
+	grad[4] = wb * y;
+	grad[5] = wb * y * y;
+	grad[6] = f * R * ( log( s ) / ( c[6] * c[6] ) +
+					   ( ga * log( a ) + gb * log( b ) ) / ( s * c[6] ) );
+
+	return f;
+
+}
+
+vector<double> RadwareModel::Start() const {
+
+	// Close to the default polynomial curve around E0 = 350 keV
+	const double c[7] = { 8.0, 2.0, 0., 6.8, -0.6, 0., 15. };
+
+	return vector<double>( c, c + 7 );
+
+}
+
+// Debertin
+double DebertinModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double f = Value( E, c );
+	double u = E0 / E;
+	double uk = 1.;
+
+	grad[0] = f;
+	grad[1] = f * log( E / E0 );
+	for( unsigned int k = 2; k < n; k++ ) {
+
+		uk *= u;
+		grad[k] = f * uk;
+
+	}
+
+	return f;
+
+}
+
+vector<double> DebertinModel::Start() const {
+
+	vector<double> c( n, 0. );
+	c[0] = kStartPoly[0];
+	c[1] = kStartPoly[1];
+
+	return c;
+
+}
+
+// Gray-Ahmad
+double GrayAhmadModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double u = E0 / E;
+	double L = log( E / E0 );
+	double L2 = L * L;
+
+	grad[0] = u;
+	grad[1] = u * L;
+	grad[2] = u * L2;
+	grad[3] = u * L2 * L2;
+	grad[4] = u * L2 * L2 * L;
+
+	return Value( E, c );
+
+}
+
+vector<double> GrayAhmadModel::Start() const {
+
+	// exp( a + b L ) of the default polynomial to first order
+	vector<double> c( 5, 0. );
+	c[0] = exp( kStartPoly[0] );
+	c[1] = c[0] * ( kStartPoly[1] + 1. );
+
+	return c;
+
+}
+
+// Simulated curve
+int SimTable::Read( const string &filename, unsigned int _ncells ) {
+
+	DataReader reader;
+	if( reader.Open( filename ) ) {
+
+		cerr << "Could not open simulated efficiency table " << filename << endl;
+		return 1;
+
+	}
+
+	vector<double> E, eff;
+	vector<double> *cols[2] = { &E, &eff };
+	reader.Parse( 2, cols );
+	reader.Close();
+
+	if( Build( E, eff, _ncells ) ) {
+
+		cerr << filename << " needs at least 2 points with E > 0 and eff > 0\n";
+		return 1;
+
+	}
+
+	cout << "Read " << E.size() << " points of a simulated efficiency curve from ";
+	cout << filename << endl;
+
+	return 0;
+
+}
+
+int SimTable::Build( vector<double> E, vector<double> eff, unsigned int _ncells ) {
+
+	// Points in log-log, sorted, without duplicate energies
+	vector< pair<double,double> > pts;
+	for( unsigned int i = 0; i < E.size() && i < eff.size(); i++ )
+		if( E[i] > 0 && eff[i] > 0 )
+			pts.push_back( make_pair( log( E[i] ), log( eff[i] ) ) );
+
+	sort( pts.begin(), pts.end() );
+	vector<double> x, y;
+	for( unsigned int i = 0; i < pts.size(); i++ ) {
+
+		if( i && pts[i].first == x.back() ) continue;
+		x.push_back( pts[i].first );
+		y.push_back( pts[i].second );
+
+	}
+
+	unsigned int n = x.size();
+	if( n < 2 || _ncells == 0 ) return 1;
+
+	// Fritsch-Carlson slopes of the table points
+	vector<double> m( n );
+	Monotone( x, y, m );
+
+	// Resample onto the uniform grid and find its own monotone slopes
+	ncells = _ncells;
+	u0 = x[0];
+	du = ( x[n-1] - x[0] ) / ncells;
+	inv = 1. / du;
+
+	vector<double> gx( ncells + 1 ), gy( ncells + 1 ), gm( ncells + 1 );
+	unsigned int j = 0;
+	double h, t;
+	for( unsigned int k = 0; k <= ncells; k++ ) {
+
+		gx[k] = u0 + k * du;
+		while( j + 2 < n && x[j+1] <= gx[k] ) j++;
+
+		// Cubic Hermite of the table on [ x_j, x_j+1 ]
+		h = x[j+1] - x[j];
+		t = ( gx[k] - x[j] ) / h;
+		if( t > 1. ) t = 1.;
+		gy[k] = ( 2*t*t*t - 3*t*t + 1 ) * y[j] + ( t*t*t - 2*t*t + t ) * h * m[j] +
+				( -2*t*t*t + 3*t*t ) * y[j+1] + ( t*t*t - t*t ) * h * m[j+1];
+
+	}
+
+	Monotone( gx, gy, gm );
+
+	// Cubic of each cell in t, from the values and slopes at its ends
+	coef.resize( 4 * ncells );
+	double y0, y1, s0, s1;
+	for( unsigned int k = 0; k < ncells; k++ ) {
+
+		y0 = gy[k];
+		y1 = gy[k+1];
+		s0 = gm[k] * du;
+		s1 = gm[k+1] * du;
+
+		coef[4*k] = y0;
+		coef[4*k+1] = s0;
+		coef[4*k+2] = 3. * ( y1 - y0 ) - 2. * s0 - s1;
+		coef[4*k+3] = 2. * ( y0 - y1 ) + s0 + s1;
+
+	}
+
+	last = gy[ncells];
+	dlast = gm[ncells] * du;
+
+	return 0;
+
+}
+
+void SimTable::Monotone( const vector<double> &x, const vector<double> &y, vector<double> &m ) {
+
+	unsigned int n = x.size();
+	vector<double> d( n - 1 );
+	for( unsigned int i = 0; i + 1 < n; i++ )
+		d[i] = ( y[i+1] - y[i] ) / ( x[i+1] - x[i] );
+
+	m[0] = d[0];
+	m[n-1] = d[n-2];
+	for( unsigned int i = 1; i + 1 < n; i++ )
+		m[i] = ( d[i-1] * d[i] <= 0 ) ? 0. : 0.5 * ( d[i-1] + d[i] );
+
+	// Limit the slopes so that each interval stays monotone
+	double a, b, r;
+	for( unsigned int i = 0; i + 1 < n; i++ ) {
+
+		if( d[i] == 0 ) {
+
+			m[i] = m[i+1] = 0;
+			continue;
+
+		}
+
+		a = m[i] / d[i];
+		b = m[i+1] / d[i];
+		r = a * a + b * b;
+
+		if( r > 9. ) {
+
+			r = 3. / sqrt( r );
+			m[i] = r * a * d[i];
+			m[i+1] = r * b * d[i];
+
+		}
+
+	}
+
+	return;
+
+}
+
+// Simulation template
+double TemplateModel::Gradient( double E, const double *c, double *grad ) const {
+
+	double f = Value( E, c );
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	for( unsigned int k = 0; k < n; k++ ) {
+
+		grad[k] = f * Lk;
+		Lk *= L;
+
+	}
+
+	return f;
+
+}
+
+// Registry
+shared_ptr<EffModel> EffModel::Create( const string &name, double E0,
+									  double lmin, double lmax, const ModelOptions &opt ) {
+
+	if( name == "poly" )
+		return make_shared< EffModelAdapter<PolyModel> >( PolyModel( E0 ) );
+
+	if( name == "bspline" )
+		return make_shared< EffModelAdapter<SplineModel> >( SplineModel( E0, lmin, lmax, opt.nknots ) );
+
+	if( name == "radware" )
+		return make_shared< EffModelAdapter<RadwareModel> >( RadwareModel() );
+
+	if( name == "debertin" )
+		return make_shared< EffModelAdapter<DebertinModel> >( DebertinModel( E0 ) );
+
+	if( name == "grayahmad" )
+		return make_shared< EffModelAdapter<GrayAhmadModel> >( GrayAhmadModel( E0 ) );
+
+	if( name == "template" && opt.table )
+		return make_shared< EffModelAdapter<TemplateModel> >( TemplateModel( E0, opt.table, opt.ncorr ) );
+
+	return shared_ptr<EffModel>();
+
+}
+
+vector<string> EffModel::Names() {
+
+	const char *names[6] = { "poly", "bspline", "radware", "debertin", "grayahmad", "template" };
+
+	return vector<string>( names, names + 6 );
+
+}
+#endif
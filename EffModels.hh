@@ -0,0 +1,516 @@
+// Efficiency models. The efficiency of a source is M( E; c ) / n, with the
+// model M shared by all sources and n the normalisation of the source.
+//
+// Each model is a plain struct with its value and energy derivative
+// written once as templates in the number type, so that the fit gets
+// exact gradients from dual numbers, and an analytic gradient in its
+// coefficients for the error band. EffModelAdapter wraps a model in the
+// virtual EffModel interface, which is what GlobalFitter holds. The
+// calls inside an adapter are not virtual, so the batch evaluation
+// Values() is a plain loop that the compiler can vectorise.
+//
+//   poly       ln M = sum_k c_k L^k, L = ln( E / E0 ) (default)
+//   bspline    ln M = cubic B-spline in L, see GlobalFitter::SetSpline
+//   radware    ln( 1e4 M ) = [ ( A + B x + C x^2 )^-G + ( D + E y + F y^2 )^-G ]^( -1 / G ),
+//              x = ln( E / 100 keV ), y = ln( E / 1000 keV ), as in RadWare's effit
+//   debertin   ln M = a_0 + a_1 L + sum_k>1 a_k ( E0 / E )^( k - 1 )
+//   grayahmad  M = ( E0 / E ) ( a + b L + c L^2 + d L^4 + e L^5 )
+//   template   ln M = ln S( E ) + sum_k c_k L^k, a simulated curve S, e.g. from
+//              GEANT4, scaled by exp( c_0 ) with a low-order correction
+
+#ifndef __EffModels_hh__
+#define __EffModels_hh__
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef __Dual_hh__
+#include "Dual.hh"
+#endif
+
+using namespace std;
+
+// Maximum number of coefficients plus one normalisation for exact
+// derivatives with dual numbers
+constexpr unsigned int kMaxModelPars = 16;
+typedef Dual<kMaxModelPars> ModelDual;
+
+// Default starting curve, ln M = polynomial in ln( E / E0 ),
+// defined once in EffModels.cc
+extern const double kStartPoly[5];
+
+// Simulated efficiency curve as a monotone (Fritsch-Carlson) cubic in
+// ln( eff ) against u = ln( E ). It is resampled once onto a uniform grid
+// in u with the cubic of each cell precomputed, so a lookup is an index
+// computation and a cubic. Beyond the table it continues as a power law.
+class SimTable {
+
+public:
+
+	SimTable(){
+		ncells = 0;
+		u0 = du = inv = 0;
+	};
+
+	// Read a table of E (keV) | eff columns, returns 0 on success
+	int Read( const string &filename, unsigned int _ncells = 1024 );
+
+	// Build from points in any order, returns 0 on success
+	int Build( vector<double> E, vector<double> eff, unsigned int _ncells = 1024 );
+
+	// ln( eff ) and its slope d ln( eff ) / du at u = ln( E )
+	inline double LogEff( double u, double &slope ) const {
+		double x = ( u - u0 ) * inv;
+		if( x < 0 ) {
+			slope = coef[1] * inv;
+			return coef[0] + slope * ( u - u0 );
+		}
+		if( x >= ncells ) {
+			slope = dlast * inv;
+			return last + slope * ( u - u0 - ncells * du );
+		}
+		unsigned int k = (unsigned int)x;
+		double t = x - k;
+		const double *a = &coef[4*k];
+		slope = ( a[1] + t * ( 2. * a[2] + t * 3. * a[3] ) ) * inv;
+		return a[0] + t * ( a[1] + t * ( a[2] + t * a[3] ) );
+	};
+
+	inline unsigned int NCells() const { return ncells; };
+
+private:
+
+	// Fritsch-Carlson slopes m of the points x, y
+	static void Monotone( const vector<double> &x, const vector<double> &y, vector<double> &m );
+
+	unsigned int ncells;
+	double u0, du, inv;
+	vector<double> coef;	// 4 per cell, in t = ( u - u_k ) / du
+	double last, dlast;		// value and slope in t at the upper end
+
+};
+
+struct PolyModel {
+
+	PolyModel( double _E0, unsigned int _n = 5 ){ E0 = _E0; n = _n; };
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	string Name() const { return "poly"; };
+	unsigned int NPars() const { return n; };
+	string ParName( unsigned int k ) const { return string( 1, 'a' + k ); };
+	vector<double> Start() const;
+
+	double E0;
+	unsigned int n;
+
+};
+
+struct SplineModel {
+
+	// Uniform cubic B-spline with nknots interior knots from lmin to lmax
+	SplineModel( double _E0, double lmin, double lmax, unsigned int _nknots ){
+		E0 = _E0;
+		nknots = _nknots;
+		l0 = lmin;
+		h = ( lmax - lmin ) / ( nknots + 1 );
+	};
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	// The 4 basis functions that are not zero at L and their
+	// derivatives in L, returns the index of the first
+	unsigned int Basis( double L, double *b, double *db ) const;
+
+	// L at which coefficient k has its largest weight
+	inline double Greville( unsigned int k ) const { return l0 + ( (double)k - 1. ) * h; };
+
+	string Name() const { return "bspline"; };
+	unsigned int NPars() const { return nknots + 4; };
+	string ParName( unsigned int k ) const { return "c_" + to_string( k ); };
+	vector<double> Start() const;
+
+	double E0;
+	unsigned int nknots;
+	double l0, h;
+
+};
+
+struct RadwareModel {
+
+	RadwareModel(){};
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	string Name() const { return "radware"; };
+	unsigned int NPars() const { return 7; };
+	string ParName( unsigned int k ) const { return string( 1, 'A' + k ); };
+	vector<double> Start() const;
+
+};
+
+struct DebertinModel {
+
+	DebertinModel( double _E0, unsigned int _n = 5 ){ E0 = _E0; n = _n; };
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	string Name() const { return "debertin"; };
+	unsigned int NPars() const { return n; };
+	string ParName( unsigned int k ) const { return "a_" + to_string( k ); };
+	vector<double> Start() const;
+
+	double E0;
+	unsigned int n;
+
+};
+
+struct GrayAhmadModel {
+
+	GrayAhmadModel( double _E0 ){ E0 = _E0; };
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	string Name() const { return "grayahmad"; };
+	unsigned int NPars() const { return 5; };
+	string ParName( unsigned int k ) const { return string( 1, 'a' + k ); };
+	vector<double> Start() const;
+
+	double E0;
+
+};
+
+struct TemplateModel {
+
+	// exp( c_0 ) S( E ) with a correction polynomial of n - 1 orders
+	TemplateModel( double _E0, shared_ptr<const SimTable> _table, unsigned int _n = 3 ){
+		E0 = _E0;
+		table = _table;
+		n = _n;
+	};
+
+	template< typename T >
+	T Value( double E, const T *c ) const;
+	template< typename T >
+	T DerivE( double E, const T *c ) const;
+	double Gradient( double E, const double *c, double *grad ) const;
+
+	string Name() const { return "template"; };
+	unsigned int NPars() const { return n; };
+	string ParName( unsigned int k ) const { return k ? "c_" + to_string( k ) : "ln_s"; };
+	vector<double> Start() const { return vector<double>( n, 0. ); };
+
+	double E0;
+	shared_ptr<const SimTable> table;
+	unsigned int n;
+
+};
+
+// Settings of the models that have any
+struct ModelOptions {
+
+	ModelOptions(){
+		nknots = 8;
+		ncorr = 3;
+	};
+
+	unsigned int nknots;				// interior knots of a spline
+	shared_ptr<const SimTable> table;	// simulated curve of a template
+	unsigned int ncorr;					// scale and correction terms of a template
+
+};
+
+// Virtual interface to any of the models
+class EffModel {
+
+public:
+
+	virtual ~EffModel(){};
+
+	virtual string Name() const = 0;
+	virtual unsigned int NPars() const = 0;
+	virtual string ParName( unsigned int k ) const = 0;
+	virtual vector<double> Start() const = 0;
+
+	virtual double Value( double E, const double *c ) const = 0;
+	virtual ModelDual Value( double E, const ModelDual *c ) const = 0;
+	virtual double DerivE( double E, const double *c ) const = 0;
+	virtual ModelDual DerivE( double E, const ModelDual *c ) const = 0;
+
+	// Value and its gradient in the n = NPars() coefficients
+	virtual double Gradient( double E, const double *c, double *grad ) const = 0;
+
+	// Values at n energies at once
+	virtual void Values( unsigned int n, const double *E, const double *c, double *out ) const = 0;
+
+	// Model by name, with the reference energy E0, the fit range lmin
+	// to lmax in ln( E / E0 ) and any settings of the model. Returns an
+	// empty pointer for an unknown name or a template without a table.
+	static shared_ptr<EffModel> Create( const string &name, double E0,
+									   double lmin, double lmax, const ModelOptions &opt );
+
+	// Names of all models
+	static vector<string> Names();
+
+};
+
+template< class M >
+class EffModelAdapter : public EffModel {
+
+public:
+
+	EffModelAdapter( const M &_m ) : m(_m) {;};
+
+	string Name() const { return m.Name(); };
+	unsigned int NPars() const { return m.NPars(); };
+	string ParName( unsigned int k ) const { return m.ParName( k ); };
+	vector<double> Start() const { return m.Start(); };
+
+	double Value( double E, const double *c ) const { return m.Value( E, c ); };
+	ModelDual Value( double E, const ModelDual *c ) const { return m.Value( E, c ); };
+	double DerivE( double E, const double *c ) const { return m.DerivE( E, c ); };
+	ModelDual DerivE( double E, const ModelDual *c ) const { return m.DerivE( E, c ); };
+
+	double Gradient( double E, const double *c, double *grad ) const {
+		return m.Gradient( E, c, grad );
+	};
+
+	void Values( unsigned int n, const double *E, const double *c, double *out ) const {
+		for( unsigned int i = 0; i < n; i++ )
+			out[i] = m.Value( E[i], c );
+	};
+
+	// The model itself, e.g. for the basis of a spline
+	inline const M& Model() const { return m; };
+
+private:
+
+	M m;
+
+};
+
+// Polynomial
+template< typename T >
+T PolyModel::Value( double E, const T *c ) const {
+
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	T f = c[0];
+	for( unsigned int k = 1; k < n; k++ ) {
+
+		Lk *= L;
+		f += c[k] * Lk;
+
+	}
+
+	return exp( f );
+
+}
+
+template< typename T >
+T PolyModel::DerivE( double E, const T *c ) const {
+
+	// d/dE exp( P(L) ) = exp( P(L) ) * P'(L) / E
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	T g = 0.;
+	for( unsigned int k = 1; k < n; k++ ) {
+
+		g += c[k] * ( (double)k * Lk );
+		Lk *= L;
+
+	}
+
+	return Value( E, c ) * g / E;
+
+}
+
+// B-spline
+template< typename T >
+T SplineModel::Value( double E, const T *c ) const {
+
+	double b[4], db[4];
+	unsigned int k = Basis( log( E / E0 ), b, db );
+
+	T f = c[k] * b[0] + c[k+1] * b[1] + c[k+2] * b[2] + c[k+3] * b[3];
+
+	return exp( f );
+
+}
+
+template< typename T >
+T SplineModel::DerivE( double E, const T *c ) const {
+
+	double b[4], db[4];
+	unsigned int k = Basis( log( E / E0 ), b, db );
+
+	T g = c[k] * db[0] + c[k+1] * db[1] + c[k+2] * db[2] + c[k+3] * db[3];
+
+	return Value( E, c ) * g / E;
+
+}
+
+// RadWare/Jaeckel, two branches joined smoothly by G
+template< typename T >
+T RadwareModel::Value( double E, const T *c ) const {
+
+	double x = log( E / 100. );
+	double y = log( E / 1000. );
+
+	T a = c[0] + c[1] * x + c[2] * ( x * x );
+	T b = c[3] + c[4] * y + c[5] * ( y * y );
+	T s = exp( -c[6] * log( a ) ) + exp( -c[6] * log( b ) );
+
+	return exp( exp( -log( s ) / c[6] ) ) * 1e-4;
+
+}
+
+template< typename T >
+T RadwareModel::DerivE( double E, const T *c ) const {
+
+	double x = log( E / 100. );
+	double y = log( E / 1000. );
+
+	T a = c[0] + c[1] * x + c[2] * ( x * x );
+	T b = c[3] + c[4] * y + c[5] * ( y * y );
+	T ga = exp( -c[6] * log( a ) );
+	T gb = exp( -c[6] * log( b ) );
+	T s = ga + gb;
+	T R = exp( -log( s ) / c[6] );
+
+	// dR/da = R ( a^-G / s ) / a and the same for b
+	T dR = R * ( ga / s / a * ( c[1] + 2. * c[2] * x ) +
+				 gb / s / b * ( c[4] + 2. * c[5] * y ) ) / E;
+
+	return exp( R ) * 1e-4 * dR;
+
+}
+
+// Debertin, log-polynomial in 1/E with a power law
+template< typename T >
+T DebertinModel::Value( double E, const T *c ) const {
+
+	double u = E0 / E;
+	double uk = 1.;
+
+	T f = c[0] + c[1] * log( E / E0 );
+	for( unsigned int k = 2; k < n; k++ ) {
+
+		uk *= u;
+		f += c[k] * uk;
+
+	}
+
+	return exp( f );
+
+}
+
+template< typename T >
+T DebertinModel::DerivE( double E, const T *c ) const {
+
+	// d/dE u^k = -k u^k / E
+	double u = E0 / E;
+	double uk = 1.;
+
+	T g = c[1];
+	for( unsigned int k = 2; k < n; k++ ) {
+
+		uk *= u;
+		g -= c[k] * ( (double)( k - 1 ) * uk );
+
+	}
+
+	return Value( E, c ) * g / E;
+
+}
+
+// Gray-Ahmad
+template< typename T >
+T GrayAhmadModel::Value( double E, const T *c ) const {
+
+	double L = log( E / E0 );
+	double L2 = L * L;
+
+	return ( c[0] + c[1] * L + c[2] * L2 + c[3] * ( L2 * L2 ) + c[4] * ( L2 * L2 * L ) ) * ( E0 / E );
+
+}
+
+template< typename T >
+T GrayAhmadModel::DerivE( double E, const T *c ) const {
+
+	double L = log( E / E0 );
+	double L2 = L * L;
+
+	T p = c[0] + c[1] * L + c[2] * L2 + c[3] * ( L2 * L2 ) + c[4] * ( L2 * L2 * L );
+	T dp = c[1] + c[2] * ( 2. * L ) + c[3] * ( 4. * L2 * L ) + c[4] * ( 5. * L2 * L2 );
+
+	return ( dp - p ) * ( E0 / ( E * E ) );
+
+}
+
+// Simulation template
+template< typename T >
+T TemplateModel::Value( double E, const T *c ) const {
+
+	double slope;
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	T f = c[0] + table->LogEff( log( E ), slope );
+	for( unsigned int k = 1; k < n; k++ ) {
+
+		Lk *= L;
+		f += c[k] * Lk;
+
+	}
+
+	return exp( f );
+
+}
+
+template< typename T >
+T TemplateModel::DerivE( double E, const T *c ) const {
+
+	double slope;
+	double L = log( E / E0 );
+	double Lk = 1.;
+
+	table->LogEff( log( E ), slope );
+
+	T g = slope;
+	for( unsigned int k = 1; k < n; k++ ) {
+
+		g += c[k] * ( (double)k * Lk );
+		Lk *= L;
+
+	}
+
+	return Value( E, c ) * g / E;
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+// Plot of a fitted efficiency curve with ROOT graphics
+
+#ifndef __EffPlot_cc__
+#define __EffPlot_cc__
+
+#ifndef __EffPlot_hh__
+#include "EffPlot.hh"
+#endif
+
+#ifndef __convert__
+#include "convert.hh"
+#endif
+
+#include "TCanvas.h"
+#include "TGraph.h"
+#include "TGraphErrors.h"
+#include "TMultiGraph.h"
+#include "TLegend.h"
+#include "TAxis.h"
+
+class EffCanvas : public EffPlot {
+
+public:
+
+	EffCanvas( const string &name );
+	~EffCanvas();
+
+	int Draw( const EffPlotInput &in, const string &outputfile );
+
+private:
+
+	// The graphs are owned by the multigraph
+	unique_ptr< TCanvas > c1;
+	unique_ptr< TMultiGraph > mg;
+	unique_ptr< TLegend > leg;
+
+};
+
+EffCanvas::EffCanvas( const string &name ) {
+
+	c1.reset( new TCanvas( name.c_str(), "efficiency", 1200, 750 ) );
+
+}
+
+EffCanvas::~EffCanvas() {
+
+	// Before the canvas they may be drawn on
+	leg.reset();
+	mg.reset();
+	c1.reset();
+
+}
+
+int EffCanvas::Draw( const EffPlotInput &in, const string &outputfile ) {
+
+	// Start from a clean canvas, which frees the graphs of any
+	// earlier call together with their multigraph
+	c1->Clear();
+	leg.reset( new TLegend( 0.7, 0.7, 0.9, 0.9 ) );
+	mg.reset( new TMultiGraph() );
+
+	// Graphs for effiency function
+	unsigned int n = in.E.size();
+	TGraph *gFinal = new TGraph( n );
+	TGraph *gLow = new TGraph( n );
+	TGraph *gUpp = new TGraph( n );
+
+	// Fill points on graphs
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		gFinal->SetPoint( i, in.E[i], in.eff[i] );
+		gLow->SetPoint( i, in.E[i], in.eff[i] - in.err[i] );
+		gUpp->SetPoint( i, in.E[i], in.eff[i] + in.err[i] );
+
+	}
+
+	// Graphs for the data
+	unsigned int nsources = in.data->Size();
+	string title;
+	double scale;
+	for( unsigned int i = 0; i < nsources; i++ ) {
+
+		const EffSource &src = (*in.data)[i];
+		TGraphErrors *g = new TGraphErrors( src.Size() );
+
+		g->SetLineColor(i+1);
+		g->SetMarkerColor(i+1);
+		g->SetMarkerStyle(24+i*2);
+		g->SetMarkerSize(2);
+		g->SetLineWidth(2);
+
+		scale = in.norm[i];
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+
+			g->SetPoint( j, src.E[j], src.eff[j] * scale );
+			g->SetPointError( j, src.dE[j], src.deff[j] * scale );
+
+		}
+
+		title = "source #" + convertInt(i+1);
+		leg->AddEntry( g, title.c_str(), "lep" );
+
+		mg->Add( g, "P" );
+
+	}
+
+	// Some tidying up
+	gFinal->SetLineColor(nsources+1);
+	gFinal->SetLineWidth(2);
+	gLow->SetLineStyle(10);
+	gLow->SetLineColorAlpha(1,0.3);
+	gLow->SetLineWidth(2);
+	gUpp->SetLineStyle(10);
+	gUpp->SetLineColorAlpha(1,0.3);
+	gUpp->SetLineWidth(2);
+
+	leg->AddEntry( gFinal, "Fit results", "l" );
+	leg->AddEntry( gLow, "Upper/lower boundaries", "l" );
+
+	mg->Add(gLow,"C");
+	mg->Add(gUpp,"C");
+	mg->Add(gFinal,"C");
+	mg->Draw("A");
+	//c1->SetLogx();
+	mg->GetXaxis()->SetRangeUser( in.Elow, in.Eupp );
+	//c1->SetLogy();
+	mg->GetYaxis()->SetRangeUser( gFinal->Eval(in.Elow) * 0.9, gFinal->GetMaximum() * 1.1 );
+	//mg->GetYaxis()->UnZoom();
+	c1->SetGridy();
+	c1->SetGridx();
+
+	leg->Draw("same");
+
+	// Labels etc
+	mg->GetXaxis()->SetTitle("Energy (keV)");
+	mg->GetYaxis()->SetTitle("Efficiency");
+	mg->GetXaxis()->SetTickLength(0.015);
+	mg->GetYaxis()->SetTickLength(0.015);
+	mg->GetXaxis()->SetTitleSize(0.045);
+	mg->GetYaxis()->SetTitleSize(0.045);
+	mg->GetYaxis()->SetTitleOffset(0.75);
+
+	c1->Update();
+
+	c1->SaveAs( outputfile.c_str() );
+
+	return 0;
+
+}
+
+EffPlot* geff_plot_new( const char *name ) {
+
+	return new EffCanvas( name );
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+// Plot of a fitted efficiency curve with the data of all sources. This
+// is the only part of geff that needs the ROOT graphics libraries, so
+// geff-lite builds it as a plugin, libgeffplot.so, which is loaded the
+// first time a plot is drawn. The full geff links it in directly.
+
+#ifndef __EffPlot_hh__
+#define __EffPlot_hh__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+using namespace std;
+
+// What is drawn: the curve and its error band at the energies E, and
+// the data of every source scaled by its fitted normalisation
+struct EffPlotInput {
+
+	vector<double> E, eff, err;
+	EffDataPtr data;
+	vector<double> norm;
+	double Elow, Eupp;
+
+};
+
+class EffPlot {
+
+public:
+
+	virtual ~EffPlot(){};
+
+	// Draw onto the canvas, clearing what was drawn before, and save
+	// it to outputfile. Returns 0 on success.
+	virtual int Draw( const EffPlotInput &in, const string &outputfile ) = 0;
+
+};
+
+// Entry point of the plugin, a new plot with a canvas called name
+extern "C" EffPlot* geff_plot_new( const char *name );
+
+#endif
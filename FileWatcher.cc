@@ -0,0 +1,133 @@
+// Watches input files for changes with inotify
+
+#ifndef __FileWatcher_cc__
+#define __FileWatcher_cc__
+
+#ifndef __FileWatcher_hh__
+#include "FileWatcher.hh"
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+FileWatcher::FileWatcher() {
+
+	fd = inotify_init1( IN_CLOEXEC );
+	if( fd < 0 ) cerr << "Could not initialise inotify\n";
+
+}
+
+FileWatcher::~FileWatcher() {
+
+	if( fd >= 0 ) close( fd );
+
+}
+
+int FileWatcher::Add( const string &filename, unsigned int id ) {
+
+	if( fd < 0 ) return 1;
+
+	// Split into directory and name
+	string dir = ".";
+	string name = filename;
+	size_t pos = filename.find_last_of( '/' );
+	if( pos != string::npos ) {
+
+		dir = pos ? filename.substr( 0, pos ) : "/";
+		name = filename.substr( pos + 1 );
+
+	}
+
+	// Watch each directory once
+	bool known = false;
+	for( map<int,string>::iterator it = dirs.begin(); it != dirs.end(); ++it )
+		if( it->second == dir ) known = true;
+
+	if( !known ) {
+
+		int wd = inotify_add_watch( fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO );
+		if( wd < 0 ) {
+
+			cerr << "Could not watch " << dir << endl;
+			return 1;
+
+		}
+
+		dirs[wd] = dir;
+
+	}
+
+	files[ make_pair( dir, name ) ].push_back( id );
+
+	return 0;
+
+}
+
+int FileWatcher::ReadEvents( vector<unsigned int> &changed ) {
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len = read( fd, buf, sizeof(buf) );
+
+	if( len < 0 ) return ( errno == EINTR || errno == EAGAIN ) ? 0 : 1;
+
+	const struct inotify_event *ev;
+	for( char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len ) {
+
+		ev = (const struct inotify_event*)p;
+		if( !ev->len ) continue;
+
+		map<int,string>::iterator dir = dirs.find( ev->wd );
+		if( dir == dirs.end() ) continue;
+
+		map< pair<string,string>, vector<unsigned int> >::iterator f =
+			files.find( make_pair( dir->second, string( ev->name ) ) );
+		if( f == files.end() ) continue;
+
+		changed.insert( changed.end(), f->second.begin(), f->second.end() );
+
+	}
+
+	return 0;
+
+}
+
+int FileWatcher::Wait( vector<unsigned int> &changed, int settle_ms ) {
+
+	changed.clear();
+	if( fd < 0 ) return 1;
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	// Block for the first change, then collect until things settle
+	int timeout = -1;
+	while( true ) {
+
+		int n = poll( &pfd, 1, timeout );
+
+		if( n < 0 ) {
+
+			if( errno == EINTR ) continue;
+			return 1;
+
+		}
+
+		if( n == 0 ) break;
+		if( ReadEvents( changed ) ) return 1;
+		if( !changed.empty() ) timeout = settle_ms;
+
+	}
+
+	sort( changed.begin(), changed.end() );
+	changed.erase( unique( changed.begin(), changed.end() ), changed.end() );
+
+	return 0;
+
+}
+#endif
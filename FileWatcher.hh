@@ -0,0 +1,47 @@
+// Watches input files for changes with inotify, for geff --watch.
+// The directories are watched rather than the files themselves, so
+// that files replaced by a rename, as most editors and tools do, are
+// still seen.
+
+#ifndef __FileWatcher_hh__
+#define __FileWatcher_hh__
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class FileWatcher {
+
+public:
+
+	FileWatcher();
+	~FileWatcher();
+
+	FileWatcher( const FileWatcher& ) = delete;
+	FileWatcher& operator=( const FileWatcher& ) = delete;
+
+	inline bool IsOpen() const { return fd >= 0; };
+
+	// Watch a file, reporting id when it changes. Returns 0 on success.
+	int Add( const string &filename, unsigned int id );
+
+	// Block until files have changed and no more changes came for
+	// settle_ms, so a file being written is only reported once.
+	// The ids of the changed files are returned sorted and unique.
+	// Returns 0 on success and 1 on an error.
+	int Wait( vector<unsigned int> &changed, int settle_ms = 200 );
+
+private:
+
+	// Read pending events, adding the ids of changed files
+	int ReadEvents( vector<unsigned int> &changed );
+
+	int fd;
+	map<int,string> dirs;							// watch -> directory
+	map< pair<string,string>, vector<unsigned int> > files;	// directory, name -> ids
+
+};
+
+#endif
@@ -0,0 +1,303 @@
+// Content-addressed cache of fit results on local disk
+
+#ifndef __FitCache_cc__
+#define __FitCache_cc__
+
+#ifndef __FitCache_hh__
+#include "FitCache.hh"
+#endif
+
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char kMagic[8] = { 'G', 'E', 'F', 'F', 'F', 'I', 'T', 0 };
+static const uint32_t kByteOrder = 0x01020304;
+
+// Make a directory and its parents
+static bool MakeDir( const string &path ) {
+
+	for( size_t pos = 1; pos != string::npos; pos++ ) {
+
+		pos = path.find( '/', pos );
+		string part = path.substr( 0, pos );
+		if( mkdir( part.c_str(), 0755 ) != 0 && errno != EEXIST ) return false;
+		if( pos == string::npos ) break;
+
+	}
+
+	struct stat st;
+	return stat( path.c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+
+}
+
+FitCache::FitCache( const string &_dir ) : nhits(0), nmisses(0), nstores(0), hit_ns(0) {
+
+	dir = _dir;
+	if( dir.empty() ) {
+
+		const char *xdg = getenv( "XDG_CACHE_HOME" );
+		const char *home = getenv( "HOME" );
+		if( xdg && *xdg ) dir = string( xdg ) + "/geff";
+		else if( home && *home ) dir = string( home ) + "/.cache/geff";
+		else dir = "/tmp/geff-cache";
+
+	}
+
+	usable = MakeDir( dir );
+	if( !usable ) cerr << "Cannot use " << dir << " for the fit cache, fitting every time\n";
+
+}
+
+uint64_t FitCache::Hash( const EffData &d, uint64_t h ) {
+
+	// Each column with its size, so that columns cannot shift into each other
+	vector<uint64_t> parts( 1, h );
+	const vector<double> *cols[6];
+	for( unsigned int i = 0; i < d.Size(); i++ ) {
+
+		const EffSource &src = d[i];
+		cols[0] = &src.E; cols[1] = &src.dE; cols[2] = &src.eff;
+		cols[3] = &src.deff; cols[4] = &src.norm; cols[5] = &src.dnorm;
+
+		for( unsigned int k = 0; k < 6; k++ ) {
+
+			parts.push_back( cols[k]->size() );
+			parts.push_back( EffCache::Checksum( cols[k]->data(), cols[k]->size() * sizeof(double) ) );
+
+		}
+
+	}
+
+	return EffCache::Checksum( parts.data(), parts.size() * sizeof(uint64_t) );
+
+}
+
+uint64_t FitCache::Hash( const string &s, uint64_t h ) {
+
+	uint64_t parts[2] = { h, EffCache::Checksum( s.data(), s.size() ) };
+
+	return EffCache::Checksum( parts, sizeof(parts) );
+
+}
+
+uint64_t FitCache::HashFile( const string &filename ) {
+
+	ifstream in( filename.c_str(), ios::in | ios::binary );
+	if( !in.is_open() ) return 0;
+
+	stringstream ss;
+	ss << in.rdbuf();
+
+	return Hash( ss.str() );
+
+}
+
+string FitCache::EntryName( const string &key ) const {
+
+	char name[32];
+	snprintf( name, sizeof(name), "/%016llx.gfit", (unsigned long long)Hash( key ) );
+
+	return dir + name;
+
+}
+
+int64_t FitCache::EntryTime( const string &key ) const {
+
+	struct stat st;
+	if( !usable || stat( EntryName( key ).c_str(), &st ) != 0 ) return 0;
+
+	return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+}
+
+int FitCache::Load( const string &key, EffFitResult &res ) {
+
+	if( !usable ) return 1;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Entries are small, so read the whole file at once
+	string entry;
+	int fd = open( EntryName( key ).c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd >= 0 ) {
+
+		char buf[16384];
+		ssize_t n;
+		while( ( n = read( fd, buf, sizeof(buf) ) ) > 0 )
+			entry.append( buf, n );
+		close( fd );
+
+	}
+
+	const GeffFitHeader *hdr = (const GeffFitHeader*)entry.data();
+	unsigned long n = entry.size() >= sizeof(GeffFitHeader) ? hdr->npars : 0;
+	unsigned long ncov = n * ( n + 1 ) / 2;
+	unsigned long size = sizeof(GeffFitHeader) + ( 3 * n + ncov ) * sizeof(double);
+
+	// The whole key, not only its hash, must match
+	if( n == 0 || memcmp( hdr->magic, kMagic, sizeof(kMagic) ) != 0 ||
+	    hdr->byteorder != kByteOrder || hdr->version != kVersion || hdr->key != Hash( key ) ||
+	    entry.size() != size + hdr->namesize + hdr->keysize ||
+	    entry.compare( size + hdr->namesize, hdr->keysize, key ) != 0 ) {
+
+		nmisses++;
+		return 1;
+
+	}
+
+	const double *val = (const double*)( entry.data() + sizeof(GeffFitHeader) );
+	const double *err = val + n;
+	const double *fix = err + n;
+	const double *cov = fix + n;
+	const char *names = (const char*)( cov + ncov );
+	const char *end = names + hdr->namesize;
+
+	// The names of the parameters, then of the minimiser
+	vector<string> strs;
+	while( strs.size() <= n ) {
+
+		unsigned long len = strnlen( names, end - names );
+		if( names + len == end ) {
+
+			nmisses++;
+			return 1;
+
+		}
+
+		strs.push_back( string( names, len ) );
+		names += len + 1;
+
+	}
+
+	res = EffFitResult();
+	res.par.assign( val, val + n );
+	res.err.assign( err, err + n );
+	res.fixed.resize( n );
+	res.cov.resize( n * n );
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		res.fixed[i] = fix[i] != 0;
+		for( unsigned int j = 0; j <= i; j++ )
+			res.cov[i*n+j] = res.cov[j*n+i] = cov[ i * ( i + 1 ) / 2 + j ];
+
+	}
+
+	res.minimizer = strs.back();
+	strs.pop_back();
+	res.names = strs;
+	res.chisq = hdr->chisq;
+	res.edm = hdr->edm;
+	res.ndf = hdr->ndf;
+	res.nfree = hdr->nfree;
+	res.ncalls = hdr->ncalls;
+	res.status = hdr->status;
+	res.covstatus = hdr->covstatus;
+	res.valid = hdr->valid;
+
+	nhits++;
+	hit_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start ).count();
+
+	return 0;
+
+}
+
+int FitCache::Save( const string &key, const EffFitResult &res ) {
+
+	unsigned int n = res.NPar();
+	if( !usable || n == 0 ) return 1;
+
+	GeffFitHeader hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, kMagic, sizeof(kMagic) );
+	hdr.byteorder = kByteOrder;
+	hdr.version = kVersion;
+	hdr.key = Hash( key );
+	hdr.npars = n;
+	hdr.status = res.Status();
+	hdr.covstatus = res.CovMatrixStatus();
+	hdr.valid = res.IsValid();
+	hdr.nfree = res.NFreeParameters();
+	hdr.ndf = res.Ndf();
+	hdr.ncalls = res.NCalls();
+	hdr.chisq = res.Chi2();
+	hdr.edm = res.Edm();
+
+	vector<double> body;
+	for( unsigned int i = 0; i < n; i++ )
+		body.push_back( res.Value(i) );
+	for( unsigned int i = 0; i < n; i++ )
+		body.push_back( res.Error(i) );
+	for( unsigned int i = 0; i < n; i++ )
+		body.push_back( res.IsParameterFixed(i) ? 1. : 0. );
+	for( unsigned int i = 0; i < n; i++ )
+		for( unsigned int j = 0; j <= i; j++ )
+			body.push_back( res.CovMatrix( i, j ) );
+
+	string names;
+	for( unsigned int i = 0; i < n; i++ ) {
+
+		names += res.ParName(i);
+		names += '\0';
+
+	}
+
+	names += res.minimizer;
+	names += '\0';
+
+	hdr.namesize = names.size();
+	hdr.keysize = key.size();
+
+	// A temporary name of this process and thread, then renamed
+	ostringstream tmp;
+	tmp << EntryName( key ) << ".tmp" << getpid() << "_" << std::this_thread::get_id();
+	string tmpfile = tmp.str();
+
+	ofstream out( tmpfile.c_str(), ios::out | ios::binary | ios::trunc );
+	if( !out.is_open() ) return 1;
+
+	out.write( (const char*)&hdr, sizeof(hdr) );
+	out.write( (const char*)body.data(), body.size() * sizeof(double) );
+	out.write( names.data(), names.size() );
+	out.write( key.data(), key.size() );
+	out.close();
+
+	if( out.fail() || rename( tmpfile.c_str(), EntryName( key ).c_str() ) != 0 ) {
+
+		remove( tmpfile.c_str() );
+		return 1;
+
+	}
+
+	nstores++;
+
+	return 0;
+
+}
+
+void FitCache::PrintStats( ostream &os ) const {
+
+	os << "Fit cache " << dir << ": " << nhits << " hits, " << nmisses << " misses, ";
+	os << nstores << " stored";
+	if( nhits > 0 ) os << ", " << hit_ns / nhits / 1000. << " us per hit";
+	os << endl;
+
+	return;
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+// Content-addressed cache of fit results on local disk. The key is the
+// text of every setting that changes the fit, i.e. the model and its
+// order, E0, the range, the solver and its version, followed by a hash
+// of the parsed data of all sources. A GlobalFitter with a cache looks
+// its result up before fitting, so an unchanged input is answered by
+// reading one small file.
+//
+// Entries are <dir>/<hash of the key>.gfit, all in native byte order:
+//   GeffFitHeader                 magic, version, hash, fit summary
+//   double[npars] x 2             values and errors
+//   double[npars]                 1 for fixed parameters, 0 otherwise
+//   double[npars*(npars+1)/2]     covariance, lower triangle by rows
+//   char[namesize]                parameter names, then the minimiser,
+//                                 each ending with 0
+//   char[keysize]                 the key, compared on every lookup so
+//                                 that hashes that collide are misses
+// They are written to a temporary file and renamed, so that fits on
+// many threads or processes may share a directory.
+
+#ifndef __FitCache_hh__
+#define __FitCache_hh__
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+#ifndef __EffFitResult_hh__
+#include "EffFitResult.hh"
+#endif
+
+using namespace std;
+
+struct GeffFitHeader {
+
+	char magic[8];			// "GEFFFIT"
+	uint32_t byteorder;		// 0x01020304 as written
+	uint32_t version;
+	uint64_t key;			// hash of the key
+	uint32_t npars;
+	uint32_t namesize;		// bytes of the names
+	uint32_t keysize;		// bytes of the key
+	int32_t status;
+	int32_t covstatus;
+	uint32_t valid;
+	uint32_t nfree;
+	uint32_t ndf;
+	uint32_t ncalls;
+	uint32_t reserved;
+	double chisq;
+	double edm;
+
+};
+
+class FitCache {
+
+public:
+
+	static const uint32_t kVersion = 2;
+
+	// Cache in dir, created if needed. An empty dir means the default,
+	// $XDG_CACHE_HOME/geff or ~/.cache/geff.
+	FitCache( const string &_dir = "" );
+
+	inline const string& GetDir() const { return dir; };
+
+	// Hashes for the key, chained through h
+	static uint64_t Hash( const EffData &d, uint64_t h = 0 );
+	static uint64_t Hash( const string &s, uint64_t h = 0 );
+
+	// Hash of the contents of a file, 0 if it cannot be read
+	static uint64_t HashFile( const string &filename );
+
+	// Fill res with the entry of key, returns 0 on a hit
+	int Load( const string &key, EffFitResult &res );
+
+	// Store a result under key, returns 0 on success
+	int Save( const string &key, const EffFitResult &res );
+
+	// Modification time of an entry (ns), 0 if there is none
+	int64_t EntryTime( const string &key ) const;
+
+	// Hits, misses and stores so far, and the time spent on hits
+	void PrintStats( ostream &os ) const;
+
+	inline unsigned long GetHits() const { return nhits; };
+	inline unsigned long GetMisses() const { return nmisses; };
+
+private:
+
+	string EntryName( const string &key ) const;
+
+	string dir;
+	bool usable;
+
+	// Shared by all fitters using the cache
+	atomic<unsigned long> nhits, nmisses, nstores;
+	atomic<unsigned long> hit_ns;
+
+};
+
+#endif
@@ -0,0 +1,682 @@
+// Fit server for geffd on a Unix domain socket
+
+#ifndef __FitDaemon_cc__
+#define __FitDaemon_cc__
+
+#ifndef __FitDaemon_hh__
+#include "FitDaemon.hh"
+#endif
+
+#ifndef __FitEff_hh__
+#include "FitEff.hh"
+#endif
+
+#ifndef __GlobalFitter_hh__
+#include "GlobalFitter.hh"
+#endif
+
+#ifndef __StreamReader_hh__
+#include "StreamReader.hh"
+#endif
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Set by SIGINT and SIGTERM, polled by the accept loop
+static volatile sig_atomic_t signalled = 0;
+
+static void OnSignal( int ) {
+
+	signalled = 1;
+
+}
+
+// Output of the fitter to cout and cerr, e.g. the files it opened and
+// the fit result. The workers collect theirs per request and write it
+// as one block when done, so that requests do not interleave. Other
+// threads write through at once.
+class WorkerLog : public std::streambuf {
+
+public:
+
+	WorkerLog( std::ostream &_os, unsigned int _which ) : os( _os ), which( _which ) {
+		out = os.rdbuf( this );
+		logs[which] = this;
+	};
+	~WorkerLog(){
+		os.rdbuf( out );
+		logs[which] = 0;
+	};
+
+	// Write what the calling worker collected so far
+	static void Flush();
+
+	// Collect the output of the calling thread from now on
+	static void Collect(){ collecting = true; };
+
+protected:
+
+	virtual std::streamsize xsputn( const char *s, std::streamsize n );
+	virtual int overflow( int c );
+	virtual int sync();
+
+private:
+
+	std::ostream &os;
+	std::streambuf *out;
+	unsigned int which;		// 0 for cout, 1 for cerr
+
+	static WorkerLog *logs[2];
+	static mutex lmutex;
+	static thread_local bool collecting;
+	static thread_local string collected[2];
+
+};
+
+WorkerLog *WorkerLog::logs[2] = { 0, 0 };
+mutex WorkerLog::lmutex;
+thread_local bool WorkerLog::collecting = false;
+thread_local string WorkerLog::collected[2];
+
+std::streamsize WorkerLog::xsputn( const char *s, std::streamsize n ) {
+
+	if( collecting ) {
+
+		collected[which].append( s, n );
+		return n;
+
+	}
+
+	std::lock_guard<std::mutex> lock( lmutex );
+
+	return out->sputn( s, n );
+
+}
+
+int WorkerLog::overflow( int c ) {
+
+	if( c == traits_type::eof() ) return traits_type::not_eof( c );
+
+	char ch = c;
+
+	return xsputn( &ch, 1 ) == 1 ? c : traits_type::eof();
+
+}
+
+int WorkerLog::sync() {
+
+	if( collecting ) return 0;
+
+	std::lock_guard<std::mutex> lock( lmutex );
+
+	return out->pubsync();
+
+}
+
+void WorkerLog::Flush() {
+
+	std::lock_guard<std::mutex> lock( lmutex );
+	for( unsigned int i = 0; i < 2; i++ ) {
+
+		if( logs[i] && collected[i].size() ) {
+
+			logs[i]->out->sputn( collected[i].data(), collected[i].size() );
+			logs[i]->out->pubsync();
+
+		}
+
+		collected[i].clear();
+
+	}
+
+	return;
+
+}
+
+// Write all of a reply, without SIGPIPE if the client has gone
+static void SendAll( int fd, const string &s ) {
+
+	unsigned long done = 0;
+	while( done < s.size() ) {
+
+		ssize_t n = send( fd, s.data() + done, s.size() - done, MSG_NOSIGNAL );
+		if( n < 0 && errno == EINTR ) continue;
+		if( n <= 0 ) return;
+		done += n;
+
+	}
+
+	return;
+
+}
+
+FitDaemon::~FitDaemon() {
+
+	if( listenfd >= 0 ) {
+
+		close( listenfd );
+		unlink( sockpath.c_str() );
+
+	}
+
+}
+
+int FitDaemon::Open( const string &path ) {
+
+	struct sockaddr_un addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if( path.size() >= sizeof(addr.sun_path) ) {
+
+		cerr << "Socket path too long: " << path << endl;
+		return 1;
+
+	}
+
+	strncpy( addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1 );
+
+	listenfd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( listenfd < 0 ) {
+
+		cerr << "Cannot create a socket: " << strerror( errno ) << endl;
+		return 1;
+
+	}
+
+	// A socket left by a daemon that died, but not a live one
+	struct stat st;
+	if( stat( path.c_str(), &st ) == 0 && S_ISSOCK( st.st_mode ) ) {
+
+		if( connect( listenfd, (struct sockaddr*)&addr, sizeof(addr) ) == 0 ) {
+
+			cerr << "geffd is already running on " << path << endl;
+			close( listenfd );
+			listenfd = -1;
+			return 1;
+
+		}
+
+		unlink( path.c_str() );
+
+	}
+
+	// Only this user may connect
+	mode_t mask = umask( 0177 );
+	int result = bind( listenfd, (struct sockaddr*)&addr, sizeof(addr) );
+	umask( mask );
+
+	if( result != 0 || listen( listenfd, 64 ) != 0 ) {
+
+		cerr << "Cannot listen on " << path << ": " << strerror( errno ) << endl;
+		close( listenfd );
+		listenfd = -1;
+		return 1;
+
+	}
+
+	sockpath = path;
+
+	return 0;
+
+}
+
+void FitDaemon::StopOnSignals() {
+
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = OnSignal;
+	sigaction( SIGINT, &sa, 0 );
+	sigaction( SIGTERM, &sa, 0 );
+
+	return;
+
+}
+
+void FitDaemon::Stop() {
+
+	std::lock_guard<std::mutex> lock( qmutex );
+	stopping = true;
+	qcond.notify_all();
+
+	return;
+
+}
+
+int FitDaemon::Run( unsigned int nworkers ) {
+
+	if( listenfd < 0 ) return 1;
+	if( nworkers == 0 ) nworkers = 1;
+
+	WorkerLog logout( cout, 0 ), logerr( cerr, 1 );
+
+	vector<thread> workers;
+	for( unsigned int i = 0; i < nworkers; i++ )
+		workers.push_back( thread( &FitDaemon::Worker, this ) );
+
+	cout << "geffd listening on " << sockpath << " with " << nworkers << " workers\n";
+
+	// Accept until stopped, waking up now and then to check
+	struct pollfd pfd;
+	pfd.fd = listenfd;
+	pfd.events = POLLIN;
+	int result = 0;
+
+	while( true ) {
+
+		{
+			std::lock_guard<std::mutex> lock( qmutex );
+			if( signalled ) stopping = true;
+			if( stopping ) break;
+		}
+
+		int n = poll( &pfd, 1, 200 );
+		if( n < 0 && errno != EINTR ) {
+
+			cerr << "poll() failed: " << strerror( errno ) << endl;
+			result = 1;
+			break;
+
+		}
+
+		if( n <= 0 ) continue;
+
+		int fd = accept4( listenfd, 0, 0, SOCK_CLOEXEC );
+		if( fd < 0 ) continue;
+
+		// A client that stops sending must not hold a worker for ever
+		struct timeval tv = { 10, 0 };
+		setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+
+		std::lock_guard<std::mutex> lock( qmutex );
+		queue.push_back( fd );
+		qcond.notify_one();
+
+	}
+
+	Stop();
+	for( unsigned int i = 0; i < workers.size(); i++ )
+		workers[i].join();
+
+	// Connections nobody took
+	for( unsigned int i = 0; i < queue.size(); i++ )
+		close( queue[i] );
+	queue.clear();
+
+	cout << "geffd stopped after " << nrequests << " requests, ";
+	cout << nhits << " from the cache\n";
+	if( diskcache ) diskcache->PrintStats( cout );
+
+	return result;
+
+}
+
+void FitDaemon::Worker() {
+
+	WorkerLog::Collect();
+
+	while( true ) {
+
+		int fd;
+		{
+			std::unique_lock<std::mutex> lock( qmutex );
+			qcond.wait( lock, [this]{ return stopping || !queue.empty(); } );
+			if( stopping ) return;
+			fd = queue.front();
+			queue.pop_front();
+		}
+
+		// Anything thrown while fitting fails the request, not geffd
+		try {
+
+			Handle( fd );
+
+		}
+
+		catch( const std::exception &e ) {
+
+			SendAll( fd, string( "error " ) + e.what() + "\n@end\n" );
+			close( fd );
+
+		}
+
+		catch( ... ) {
+
+			SendAll( fd, "error unknown failure\n@end\n" );
+			close( fd );
+
+		}
+
+		WorkerLog::Flush();
+
+	}
+
+}
+
+void FitDaemon::Handle( int fd ) {
+
+	// Read up to @end at the start of a line, or the end of the input
+	string request;
+	char buf[65536];
+	unsigned long from = 0;
+	bool complete = false;
+
+	while( !complete && request.size() < kMaxRequest ) {
+
+		ssize_t n = recv( fd, buf, sizeof(buf), 0 );
+		if( n < 0 && errno == EINTR ) continue;
+		if( n < 0 ) {
+
+			SendAll( fd, "error timeout reading the request\n@end\n" );
+			close( fd );
+			return;
+
+		}
+
+		if( n == 0 ) break;
+		request.append( buf, n );
+
+		// Look at the new lines only, starting with the last partial one
+		size_t pos = request.find( "@end", from );
+		while( pos != string::npos && !complete ) {
+
+			if( pos == 0 || request[pos-1] == '\n' ) complete = true;
+			else pos = request.find( "@end", pos + 1 );
+
+		}
+
+		size_t nl = request.find_last_of( '\n' );
+		from = nl == string::npos ? 0 : nl + 1;
+
+	}
+
+	string reply;
+	bool cached = false;
+
+	if( request.size() >= kMaxRequest )
+		reply = "error request too large\n@end\n";
+
+	else if( Fit( request, reply, cached ) )
+		reply = "error " + reply + "\n@end\n";
+
+	{
+		std::lock_guard<std::mutex> lock( cmutex );
+		nrequests++;
+		if( cached ) nhits++;
+	}
+
+	// Last, as Worker() answers and closes fd if anything before throws
+	SendAll( fd, reply );
+	close( fd );
+
+	return;
+
+}
+
+int FitDaemon::Fit( const string &request, string &out, bool &cached ) {
+
+	// Settings, as for geff
+	string model = "poly", templ, plot;
+	double E0 = 350., lambda = 1.;
+	int limits[2] = { 1, 4500 };
+	unsigned int knots = 8, ncorr = 3;
+	bool nocache = false;
+	vector<string> efiles, nfiles;
+
+	// Keyword lines up to the first @ line
+	unsigned long pos = 0;
+	string line, key;
+	while( pos < request.size() && request[pos] != '@' ) {
+
+		unsigned long end = request.find( '\n', pos );
+		if( end == string::npos ) end = request.size();
+		line = request.substr( pos, end - pos );
+		pos = end < request.size() ? end + 1 : end;
+
+		istringstream ss( line );
+		if( !( ss >> key ) || key[0] == '#' ) continue;
+
+		bool ok = true;
+		if( key == "model" ) ok = (bool)( ss >> model );
+		else if( key == "E0" ) ok = (bool)( ss >> E0 );
+		else if( key == "range" ) ok = (bool)( ss >> limits[0] >> limits[1] );
+		else if( key == "knots" ) ok = (bool)( ss >> knots );
+		else if( key == "lambda" ) ok = (bool)( ss >> lambda );
+		else if( key == "template" ) ok = (bool)( ss >> templ );
+		else if( key == "ncorr" ) ok = (bool)( ss >> ncorr );
+		else if( key == "plot" ) ok = (bool)( ss >> plot );
+		else if( key == "nocache" ) nocache = true;
+		else if( key == "eff" ) {
+
+			efiles.push_back( "" );
+			ok = (bool)( ss >> efiles.back() );
+
+		}
+		else if( key == "norm" ) {
+
+			nfiles.push_back( "" );
+			ok = (bool)( ss >> nfiles.back() );
+
+		}
+		else ok = false;
+
+		if( !ok ) {
+
+			out = "bad line: " + line;
+			return 1;
+
+		}
+
+	}
+
+	bool inline_data = pos < request.size() && request.compare( pos, 7, "@source" ) == 0;
+	if( inline_data == !efiles.empty() ) {
+
+		out = "give either eff files or inline @source data";
+		return 1;
+
+	}
+
+	if( nfiles.size() > efiles.size() ) {
+
+		out = "too many norm files";
+		return 1;
+
+	}
+
+	// A fitter of its own, ROOT and the libraries are already loaded
+	GlobalFitter gf( E0, limits[0], limits[1] );
+	if( diskcache ) gf.SetCache( diskcache );
+
+	if( model == "bspline" ) {
+
+		if( knots == 0 || lambda < 0 ) {
+
+			out = "the bspline model needs at least one knot and lambda >= 0";
+			return 1;
+
+		}
+
+		gf.SetSpline( knots, lambda );
+
+	}
+
+	else if( model == "template" ) {
+
+		if( templ.empty() || gf.SetTemplate( templ, ncorr ) ) {
+
+			out = "the template model needs a readable template file";
+			return 1;
+
+		}
+
+	}
+
+	else if( gf.SetModel( model ) ) {
+
+		out = "unknown model " + model;
+		return 1;
+
+	}
+
+	FitEff fe( gf, limits[0], limits[1] );
+	fe.SetResultFile( "" );
+
+	if( inline_data ) {
+
+		StreamReader stream( "<request>" );
+		stream.Feed( request.data() + pos, request.size() - pos );
+		stream.Finish();
+
+		if( stream.NSources() == 0 || fe.SetData( stream.Take() ) ) {
+
+			out = "no sources in the request";
+			return 1;
+
+		}
+
+	}
+
+	else {
+
+		fe.SetVariables( efiles.size() );
+		for( unsigned int i = 0; i < efiles.size(); i++ )
+			fe.AddEfile( efiles[i] );
+		for( unsigned int i = 0; i < nfiles.size(); i++ )
+			fe.AddNfile( nfiles[i] );
+
+		if( fe.ReadData() ) {
+
+			out = "cannot read the data";
+			return 1;
+
+		}
+
+	}
+
+	// Same settings and data give the same reply. The template is
+	// known by its name, size and modification time.
+	ostringstream keyss;
+	keyss.precision( 17 );
+	keyss << model << " " << E0 << " " << limits[0] << " " << limits[1];
+	if( model == "bspline" ) keyss << " " << knots << " " << lambda;
+	if( model == "template" ) {
+
+		struct stat st;
+		if( stat( templ.c_str(), &st ) == 0 )
+			keyss << " " << templ << " " << st.st_size << " " << st.st_mtime;
+		keyss << " " << ncorr;
+
+	}
+
+	keyss << " " << hex << FitCache::Hash( *fe.GetData() );
+	string cachekey = keyss.str();
+
+	// A plot needs the fitted curves, so it is always fitted
+	cached = false;
+	if( !nocache && plot.empty() && Lookup( cachekey, out ) ) {
+
+		cached = true;
+		return 0;
+
+	}
+
+	const EffFitResult &res = fe.GetFitResult();
+	if( fe.DoFit() || res.NPar() == 0 ) {
+
+		out = "the fit failed";
+		return 1;
+
+	}
+
+	// Reply, the cache flag is put in front when it is sent
+	ostringstream os;
+	os.precision( 17 );
+	os << "valid\t" << ( res.IsValid() ? 1 : 0 ) << "\n";
+	os << "chisq\t" << res.Chi2() << "\n";
+	os << "ndf\t" << res.Ndf() << "\n";
+	for( unsigned int i = 0; i < res.NPar(); i++ )
+		os << "par\t" << res.ParName(i) << "\t" << res.Value(i) << "\t" << res.Error(i) << "\n";
+	for( unsigned int i = 0; i < res.NPar(); i++ ) {
+
+		os << "cov";
+		for( unsigned int j = 0; j < res.NPar(); j++ )
+			os << "\t" << res.CovMatrix( i, j );
+		os << "\n";
+
+	}
+
+	string body = os.str();
+	Store( cachekey, body );
+
+	out = "ok\ncached\t0\n" + body;
+
+	if( plot.size() ) {
+
+		fe.DrawResults( plot );
+		out += "plot\t" + plot + "\n";
+
+	}
+
+	out += "@end\n";
+
+	return 0;
+
+}
+
+bool FitDaemon::Lookup( const string &key, string &out ) {
+
+	std::lock_guard<std::mutex> lock( cmutex );
+
+	auto it = cache.find( key );
+	if( it == cache.end() ) return false;
+
+	// Most recently used to the front
+	lru.splice( lru.begin(), lru, it->second );
+	out = "ok\ncached\t1\n" + it->second->second + "@end\n";
+
+	return true;
+
+}
+
+void FitDaemon::Store( const string &key, const string &reply ) {
+
+	if( cachesize == 0 ) return;
+
+	std::lock_guard<std::mutex> lock( cmutex );
+
+	auto it = cache.find( key );
+	if( it != cache.end() ) {
+
+		it->second->second = reply;
+		lru.splice( lru.begin(), lru, it->second );
+		return;
+
+	}
+
+	lru.push_front( make_pair( key, reply ) );
+	cache[key] = lru.begin();
+
+	if( lru.size() > cachesize ) {
+
+		cache.erase( lru.back().first );
+		lru.pop_back();
+
+	}
+
+	return;
+
+}
+
+#endif
@@ -0,0 +1,124 @@
+// Fit server for geffd. It listens on a Unix domain socket and runs
+// each request on a pool of worker threads, with ROOT and the fitter
+// libraries loaded once for all of them. Identical requests, i.e. the
+// same settings and data, are answered from an in-memory cache.
+//
+// A request is a few keyword lines, then optionally the data inline in
+// the framing of StreamReader, ended by @end or by closing the writing
+// side of the socket:
+//
+//   model   <name>           as geff -m, default poly
+//   E0      <keV>            default 350
+//   range   <low> <upp>      default 1 4500
+//   knots   <n>              bspline model
+//   lambda  <x>              bspline model
+//   template <file>          template model, with ncorr <n>
+//   eff     <file>           efficiency data of the next source, as -e
+//   norm    <file>           normalisation data, in the order of -n
+//   plot    <file>           also draw the result to file
+//   nocache                  always fit
+//   @source [label]          inline data instead of files, see
+//   ...                      StreamReader.hh
+//   @end
+//
+// The reply is keyword lines ending with @end:
+//
+//   ok | error <message>
+//   cached  <0|1>
+//   valid   <0|1>
+//   chisq   <x>
+//   ndf     <n>
+//   par     <name> <value> <error>       one line per parameter
+//   cov     <C_k,0> ... <C_k,n-1>        one line per parameter
+//   plot    <file>
+
+#ifndef __FitDaemon_hh__
+#define __FitDaemon_hh__
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __FitCache_hh__
+#include "FitCache.hh"
+#endif
+
+using namespace std;
+
+class FitDaemon {
+
+public:
+
+	FitDaemon( unsigned int _cachesize = 256 ){
+		listenfd = -1;
+		cachesize = _cachesize;
+		stopping = false;
+		nrequests = nhits = 0;
+	};
+	~FitDaemon();
+
+	FitDaemon( const FitDaemon& ) = delete;
+	FitDaemon& operator=( const FitDaemon& ) = delete;
+
+	// Listen on the socket path, only for this user. A stale socket
+	// is replaced. Returns 0 on success.
+	int Open( const string &path );
+
+	// Serve requests with nworkers threads until Stop() or a signal
+	// set by StopOnSignals(). Returns 0 on a clean stop.
+	int Run( unsigned int nworkers );
+
+	void Stop();
+
+	// Also keep results on disk, shared by all workers and restarts
+	inline void SetDiskCache( shared_ptr<FitCache> c ){ diskcache = c; };
+
+	// Stop Run() on SIGINT and SIGTERM
+	static void StopOnSignals();
+
+	// Largest request in bytes, larger ones are refused
+	static const unsigned long kMaxRequest = 64ul << 20;
+
+private:
+
+	// Worker thread, taking connections from the queue. What the fitter
+	// prints for a request comes out as one block when it is done.
+	void Worker();
+
+	// Read a request from fd, answer it and close fd
+	void Handle( int fd );
+
+	// Fit a request and write the reply into out. Returns 0 on success.
+	int Fit( const string &request, string &out, bool &cached );
+
+	// Cached reply of a key, true if there is one
+	bool Lookup( const string &key, string &out );
+	void Store( const string &key, const string &reply );
+
+	int listenfd;
+	string sockpath;
+
+	// Connections waiting for a worker
+	mutex qmutex;
+	condition_variable qcond;
+	deque<int> queue;
+	bool stopping;
+
+	// Replies, least recently used at the back
+	mutex cmutex;
+	list< pair<string,string> > lru;
+	unordered_map< string, list< pair<string,string> >::iterator > cache;
+	unsigned int cachesize;
+	unsigned long nrequests, nhits;
+	shared_ptr<FitCache> diskcache;
+
+};
+
+#endif
@@ -10,7 +10,82 @@
 #include "FitEff.hh"
 #endif
 
-FitEff::FitEff( GlobalFitter gf, int Es, int Ee ) {
+#ifndef __geff_table_hh__
+#include "geff_table.hh"
+#endif
+
+#ifndef __geff_eval_hh__
+#include "geff_eval.hh"
+#endif
+
+#ifdef GEFF_LITE
+#include "TSystem.h"
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+// ROOT graphics are not thread safe, so all
+// instances take turns creating and drawing plots
+static std::mutex plot_mutex;
+
+// C++ keywords and alternative tokens, plus std, which can't name
+// the namespace of generated code
+static const char* kReservedNames[] = {
+	"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+	"bool", "break", "case", "catch", "char", "char8_t", "char16_t", "char32_t",
+	"class", "compl", "concept", "const", "consteval", "constexpr", "constinit",
+	"const_cast", "continue", "co_await", "co_return", "co_yield", "decltype",
+	"default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+	"explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+	"if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+	"not", "not_eq", "nullptr", "operator", "or", "or_eq", "private",
+	"protected", "public", "register", "reinterpret_cast", "requires",
+	"return", "short", "signed", "sizeof", "static", "static_assert",
+	"static_cast", "struct", "switch", "template", "this", "thread_local",
+	"throw", "true", "try", "typedef", "typeid", "typename", "union",
+	"unsigned", "using", "virtual", "void", "volatile", "wchar_t", "while",
+	"xor", "xor_eq", "std"
+};
+
+// A new plot, which in geff-lite first loads the plugin with the
+// graphics, so that fits without plots never load them
+static EffPlot* NewPlot( string name ) {
+	
+#ifdef GEFF_LITE
+	
+	static EffPlot* (*plot_new)( const char* ) = 0;
+	if( !plot_new ) {
+		
+		if( gSystem->Load( "libgeffplot" ) < 0 ) {
+			
+			cerr << "Cannot load libgeffplot, is it in LD_LIBRARY_PATH? No plot is drawn\n";
+			return 0;
+			
+		}
+		
+		plot_new = (EffPlot*(*)( const char* ))gSystem->DynFindSymbol( "libgeffplot", "geff_plot_new" );
+		if( !plot_new ) {
+			
+			cerr << "No geff_plot_new() in libgeffplot, no plot is drawn\n";
+			return 0;
+			
+		}
+		
+	}
+	
+	return plot_new( name.c_str() );
+	
+#else
+	
+	return geff_plot_new( name.c_str() );
+	
+#endif
+	
+}
+
+FitEff::FitEff( GlobalFitter &gf, int Es, int Ee ) {
 	
 	// Assign fitter
 	globalChi2 = &gf;
@@ -19,18 +94,53 @@ FitEff::FitEff( GlobalFitter gf, int Es, int Ee ) {
 	Estart = Es;
 	Eend = Ee;
 	
-	// Check number of parameters in efficiency curve
-	if( npoly > 10 ){
-		
-		cerr << "Why the hell would you want a 9th order polynomial?" << endl;
-		return;
-		
-	}
+	// Default output
+	resultfile = "fitresult.txt";
+	
+	// Nothing set up yet
+	warmstart = false;
+	nsources = 0;
+	npoly = 0;
+	fEff = fErr = 0;
 	
 }
 
 FitEff::~FitEff(){
 
+	// Plots go before the fitter that owns the curves
+	std::lock_guard<std::mutex> lock( plot_mutex );
+	plot.reset();
+
+}
+
+void FitEff::Reset() {
+	
+	// Plots
+	{
+		std::lock_guard<std::mutex> lock( plot_mutex );
+		plot.reset();
+	}
+	
+	// Curves belong to the fitter
+	fEff = fErr = 0;
+	globalChi2->Reset();
+	
+	// Data and parameters
+	data.reset();
+	efiles.clear();
+	nfiles.clear();
+	effpar.clear();
+	par0.clear();
+	parname.clear();
+	errArray.clear();
+	parEffs.clear();
+	fitres = EffFitResult();
+	warmstart = false;
+	nsources = 0;
+	npoly = 0;
+	
+	return;
+	
 }
 
 void FitEff::SetVariables( unsigned int n ) {
@@ -38,13 +148,12 @@ void FitEff::SetVariables( unsigned int n ) {
 	// Set number of sources
 	SetNsources( n );
 	
-	// Set starting parameters
-	// default 5th order polynomial
-	effpar.push_back( -1.84 );	// a
-	effpar.push_back( -0.52 );	// b
-	effpar.push_back( -0.01 );	// c
-	effpar.push_back(  0.06 );	// d
-	effpar.push_back( -0.06 );	// e
+	// Set starting parameters of the model of the fitter,
+	// by default a 5th order polynomial
+	shared_ptr<const EffModel> model = globalChi2->CreateModel();
+	effpar = model->Start();
+	par0.clear();
+	parname.clear();
 	
 	// Check size of parameters etc
 	npoly = effpar.size();
@@ -53,12 +162,10 @@ void FitEff::SetVariables( unsigned int n ) {
 	npars = npoly + nnormpars;
 	
 	// Build arrays
-	string letter;
 	for( unsigned int i = 0; i < npoly; i++ ) {
 		
 		par0.push_back( effpar[i] );
-		letter = 'a' + i;
-		parname.push_back( letter );
+		parname.push_back( model->ParName(i) );
 		
 	}
 	
@@ -73,118 +180,152 @@ void FitEff::SetVariables( unsigned int n ) {
 	errArray.resize( npoly*neffpars+1 );
 	parEffs.resize( neffpars );
 	
-	// Drawing things
-	c1 = new TCanvas( "c1", "efficiency", 1200, 750 );
-	mg = new TMultiGraph();
-	leg = new TLegend( 0.7, 0.7, 0.9, 0.9 );
+	// The canvas is only made by DrawResults(), so that fits
+	// without plots never load or initialise any graphics
 	
 	return;
 	
 }
 
 
-int FitEff::ReadData() {
+int FitEff::ReadStream( int fd ) {
 	
-	double a, b, c, d;
-
-	// Efficiency data from file
-	y.resize( nsources );
-	x.resize( nsources );
-	yerr.resize( nsources );
-	xerr.resize( nsources );
-
-	// Normalisation data (same size as efficiency data)
-	norms.resize( nsources );
-	normserr.resize( nsources );
+	StreamReader stream( fd == 0 ? "<stdin>" : "<fd " + convertInt(fd) + ">" );
 	
-	string line;
-	stringstream line_ss;
+	cout << "Reading sources from " << ( fd == 0 ? "standard input" : "stream" ) << endl;
 	
-	// Open and read efficiency files
-	for( unsigned int i = 0; i < efiles.size(); i++ ) {
+	if( stream.ReadFd( fd ) ) {
 		
-		ifile.open( efiles[i].c_str() );
+		cerr << "Could not read the input stream\n";
+		return 1;
 		
-		if( !ifile.is_open() ){
-			
-			cerr << "Could not open " << efiles[i] << endl;
-			return 1;
-			
-		}
+	}
+	
+	EffData d = stream.Take();
+	if( d.Size() == 0 ) {
 		
-		else cout << "Opened efficiency file: " << efiles[i] << endl;
+		cerr << "No sources in the input stream\n";
+		return 1;
 		
-		while( getline( ifile, line ) ){
-
-			line_ss.str("");
-			line_ss.clear();
-			line_ss << line;
-			if( line.substr( 0, 1 ) != "#" ) {
-				
-				if( line_ss >> a >> b >> c >> d ) {
-
-					x[i].push_back( a );
-					xerr[i].push_back( b );
-					y[i].push_back( c );
-					yerr[i].push_back( d );
-					
-				}
+	}
+	
+	cout << "Read " << d.Size() << " sources from the input stream\n";
+	
+	return SetData( std::move( d ) );
+	
+}
 
-			}
-			
-		}
+int FitEff::SetData( EffData d ) {
+	
+	if( d.Size() == 0 ) return 1;
+	
+	// If there are no normalisation data, fix to 1
+	bool hasnorms = false;
+	for( unsigned int i = 0; i < d.Size(); i++ )
+		if( d[i].NormSize() ) hasnorms = true;
+	
+	if( !hasnorms ) {
 		
-		ifile.close();
+		cout << "I didn't read any normalisation data\n";
+		cout << "Fixing source 1 to have N=1 and contuining...\n";
+		
+		d[0].norm.push_back( 1.0 );
+		d[0].dnorm.push_back( 0.0 );
 		
 	}
 	
-	// Open and read normalisation files
-	for( unsigned int i = 0; i < nfiles.size(); i++ ) {
+	// The number of sources is only known now
+	if( d.Size() != nsources ) SetVariables( d.Size() );
+	
+	data = make_shared<const EffData>( std::move( d ) );
+	
+	return 0;
+	
+}
+
+int FitEff::ReadSource( unsigned int i, EffSource &src ) {
+	
+	vector<double> *ecols[4] = { &src.E, &src.dE, &src.eff, &src.deff };
+	vector<double> *ncols[2] = { &src.norm, &src.dnorm };
+	
+	// Efficiency data from graphs and trees in ROOT files
+	if( RootReader::IsRootSpec( efiles[i] ) ) {
 		
-		ifile.open( nfiles[i].c_str() );
+		if( RootReader::Read( efiles[i], 4, ecols ) ) return 1;
 		
-		if( !ifile.is_open() ){
-			
-			cout << "Could not open " << nfiles[i] << endl;
-			cout << "Assuming that you don't have any data for this source\n";
-			
-		}
+	}
+	
+	// Text files and their caches are read by the core
+	else if( CoreFitter::ReadColumns( efiles[i], 4, ecols, "efficiency" ) ) return 1;
+	
+	// Normalisation data, in the same ways
+	if( i >= nfiles.size() ) return 0;
+	
+	if( RootReader::IsRootSpec( nfiles[i] ) ) {
 		
-		else cout << "Opened normalisation file: " << nfiles[i] << endl;
+		if( RootReader::Read( nfiles[i], 2, ncols ) )
+			cout << "Assuming that you don't have any data for this source\n";
 		
-		while( getline( ifile, line ) ){
-			
-			line_ss.str("");
-			line_ss.clear();
-			line_ss << line;
-			if( line.substr( 0, 1 ) != "#" ) {
-				
-				if( line_ss >> a >> b ) {
-			
-					norms[i].push_back( a );
-					normserr[i].push_back( b );
-					
-				}
-				
-			}
-			
-		}
+	}
+	
+	else if( CoreFitter::ReadColumns( nfiles[i], 2, ncols, "normalisation" ) )
+		cout << "Assuming that you don't have any data for this source\n";
+	
+	return 0;
+	
+}
+
+int FitEff::ReloadSource( unsigned int i ) {
+	
+	if( !data || i >= data->Size() || i >= efiles.size() ) return 1;
+	
+	EffSource src;
+	if( ReadSource( i, src ) ) return 1;
+	
+	// Same rule as in ReadData()
+	if( nfiles.size() == 0 && i == 0 ) {
 		
-		ifile.close();
+		src.norm.push_back( 1.0 );
+		src.dnorm.push_back( 0.0 );
 		
 	}
 	
+	// The other sources are shared with the old data, not read again
+	data = make_shared<const EffData>( *data, i, std::move( src ) );
+	
+	// Start from the last result
+	warmstart = true;
+	
+	return 0;
+	
+}
+
+int FitEff::ReadData() {
+	
+	// Everything framed in one stream
+	if( efiles.size() == 1 && efiles[0] == "-" )
+		return ReadStream( 0 );
+	
+	// Efficiency and normalisation data from file
+	EffData d( nsources );
+	
+	for( unsigned int i = 0; i < efiles.size() && i < nsources; i++ )
+		if( ReadSource( i, d[i] ) ) return 1;
+	
 	// If there are no normalisation files, fix to 1
 	if( nfiles.size() == 0 ) {
 		
 		cout << "I didn't read any normalisation files\n";
 		cout << "Fixing source 1 to have N=1 and contuining...\n";
 		
-		norms[0].push_back( 1.0 );
-		normserr[0].push_back( 0.0 );
+		d[0].norm.push_back( 1.0 );
+		d[0].dnorm.push_back( 0.0 );
 
 	}
 	
+	// From now on the data are only shared, never copied
+	data = make_shared<const EffData>( std::move( d ) );
+	
 	// Check consistency
 	if( nsources == efiles.size() ) return 0;
 	else {
@@ -196,27 +337,47 @@ int FitEff::ReadData() {
 	
 }
 
-void FitEff::DoFit() {
+int FitEff::DoFit() {
 
 	//////////////////////////
 	// Perform a global fit //
 	//////////////////////////
 
 	// Define global chi2 function
-	globalChi2->CopyData( x, xerr, y, yerr, norms, normserr );
-	globalChi2->SetParameters( par0, parname );
+	globalChi2->SetData( data );
+	
+	// Warm start from the last result, e.g. when a source was reloaded
+	int setresult;
+	if( warmstart && fitres.NPar() == npars )
+		setresult = globalChi2->SetParameters( fitres.Parameters(), parname, true );
+	else setresult = globalChi2->SetParameters( par0, parname );
+	warmstart = false;
 
 	// Get fit result
-	fitres = globalChi2->GetFitResult();
+	if( setresult == 0 ) fitres = globalChi2->GetFitResult();
+	else fitres = EffFitResult();
+	
+	if( fitres.NPar() != npars ) {
+		
+		cerr << "The fit failed, no results\n";
+		fitres = EffFitResult();
+		fEff = fErr = 0;
+		return 1;
+		
+	}
 
 	// output to screen and file
-	ofstream fitfile;
-	fitfile.open( "fitresult.txt", ios::out );
 	fitres.Print( std::cout );
-	fitres.Print( fitfile );
 	fitres.PrintCovMatrix( std::cout );
-	fitres.PrintCovMatrix( fitfile );
-	fitfile.close();
+	if( resultfile.size() ) {
+		
+		ofstream fitfile;
+		fitfile.open( resultfile.c_str(), ios::out );
+		fitres.Print( fitfile );
+		fitres.PrintCovMatrix( fitfile );
+		fitfile.close();
+		
+	}
 
 	// Get parameters and covariance
 	// This ignores the normalisation constants
@@ -236,107 +397,485 @@ void FitEff::DoFit() {
 	fEff = globalChi2->GetEffCurve( parEffs );
 	fErr = globalChi2->GetErrCurve( errArray );
 	
-	return;
+	return 0;
 	
 }
 
-void FitEff::DrawResults( string outputfile ) {
+int FitEff::Jackknife( string filename ) {
+	
+	if( fitres.NPar() != npars ) {
+		
+		cerr << "Jackknife needs a converged fit\n";
+		return 1;
+		
+	}
+	
+	// The linearised problem has no smoothing penalty, so no splines,
+	// and needs the exact derivatives of the other models
+	if( globalChi2->GetModelName() == "bspline" ) {
+		
+		cerr << "Jackknife is not available for the bspline model, because";
+		cerr << " its smoothing penalty is not part of the linearised problem\n";
+		return 1;
+		
+	}
+	
+	if( neffpars > GlobalFitter::kMaxEffPars ) {
+		
+		cerr << "Jackknife needs at most " << GlobalFitter::kMaxEffPars;
+		cerr << " efficiency parameters, the " << globalChi2->GetModelName();
+		cerr << " model has " << neffpars << endl;
+		return 1;
+		
+	}
+	
+	if( globalChi2->InitSolution( fitres.Parameters() ) ) {
+		
+		cerr << "Jackknife cannot linearise the fit at its result\n";
+		return 1;
+		
+	}
+	
+	vector<GlobalFitter::PointInfluence> pts;
+	vector<GlobalFitter::SourceInfluence> srcs;
+	if( globalChi2->Jackknife( pts, srcs ) ) return 1;
+	
+	ofstream jkfile;
+	jkfile.open( filename.c_str(), ios::out );
+	if( !jkfile.is_open() ) {
+		
+		cerr << "Cannot write " << filename << endl;
+		return 1;
+		
+	}
 	
-	// Graphs for effiency function
-	gFinal = new TGraph( fEff->GetXmax() - fEff->GetXmin() );
-	gLow = new TGraph( fEff->GetXmax() - fEff->GetXmin() );
-	gUpp = new TGraph( fEff->GetXmax() - fEff->GetXmin() );
+	// Leave one point out, energy or normalisation value as x
+	jkfile << "# source\ttype\tindex\tx\tresidual\tleverage\tstudent\tcook";
+	jkfile << "\tshift\tcurve\tflag";
+	for( unsigned int l = 0; l < npars; l++ )
+		jkfile << "\td_" << parname[l];
+	jkfile << endl;
+	
+	unsigned int noutlier = 0;
+	for( unsigned int k = 0; k < pts.size(); k++ ) {
+		
+		const GlobalFitter::PointInfluence &pt = pts[k];
+		const EffSource &src = (*data)[pt.source];
+		
+		string flag = pt.outlier ? ( pt.influential ? "OI" : "O" ) : ( pt.influential ? "I" : "-" );
+		if( pt.outlier ) noutlier++;
+		
+		jkfile << pt.source + 1 << "\t" << ( pt.norm ? "norm" : "eff" ) << "\t" << pt.index;
+		jkfile << "\t" << ( pt.norm ? src.norm[pt.index] : src.E[pt.index] );
+		jkfile << "\t" << pt.res << "\t" << pt.leverage << "\t" << pt.student;
+		jkfile << "\t" << pt.cook << "\t" << pt.shift << "\t" << pt.curve << "\t" << flag;
+		for( unsigned int l = 0; l < npars; l++ )
+			jkfile << "\t" << pt.dpar[l];
+		jkfile << endl;
+		
+	}
+	
+	// Leave one source out
+	jkfile << "\n# source\tnpoints\tdchisq\tshift\tcurve";
+	for( unsigned int l = 0; l < npars; l++ )
+		jkfile << "\td_" << parname[l];
+	jkfile << endl;
+	
+	for( unsigned int i = 0; i < srcs.size(); i++ ) {
+		
+		jkfile << srcs[i].source + 1 << "\t" << srcs[i].npoints;
+		if( !srcs[i].determined ) {
+			
+			jkfile << "\tundetermined\n";
+			continue;
+			
+		}
+		
+		jkfile << "\t" << srcs[i].dchisq << "\t" << srcs[i].shift << "\t" << srcs[i].curve;
+		for( unsigned int l = 0; l < npars; l++ )
+			jkfile << "\t" << srcs[i].dpar[l];
+		jkfile << endl;
+		
+	}
+	
+	jkfile.close();
+	
+	// Summary on screen
+	cout << "\nJackknife: " << noutlier << " of " << pts.size();
+	cout << " points are outliers (|student| > 3), details in " << filename << endl;
+	
+	for( unsigned int k = 0; k < pts.size(); k++ ) {
+		
+		if( !pts[k].outlier ) continue;
+		
+		const EffSource &src = (*data)[pts[k].source];
+		cout << " source #" << pts[k].source + 1;
+		if( pts[k].norm ) cout << " normalisation " << src.norm[pts[k].index];
+		else cout << " E = " << src.E[pts[k].index] << " keV";
+		cout << ": student = " << pts[k].student << ", curve changes by ";
+		cout << 100. * pts[k].curve << "% without it\n";
+		
+	}
+	
+	cout << "Source\tshift (sigma)\tcurve change (%)\n";
+	for( unsigned int i = 0; i < srcs.size(); i++ ) {
+		
+		cout << srcs[i].source + 1 << "\t";
+		if( srcs[i].determined ) cout << srcs[i].shift << "\t" << 100. * srcs[i].curve << endl;
+		else cout << "undetermined without it\n";
+		
+	}
+	
+	return 0;
+	
+}
 
-	// Fill points on graphs
-	double eff, err;
-	cout << "E (keV)\tEff (%)\terror (%)\n";
-	for( unsigned int i = fEff->GetXmin(); i < fEff->GetXmax(); i++ ) {
+int FitEff::SaveCurve( string filename ) {
+	
+	if( fitres.NPar() != npars ) {
 		
-		eff = fEff->Eval( i ) * fitres.Value(npoly);
-		err = fErr->Eval( i ) * fitres.Value(npoly);
+		cerr << "No fit result to save\n";
+		return 1;
 		
-		if( ( i % 100 == 0 && i < 800 ) || ( i % 500 == 0 && i >= 500 )
-		    || i == 1332 || i == 50 )
-			cout << i << "\t" << eff << "\t" << err << endl;
+	}
+	
+	// Everything is in the format of the core, so that
+	// programs without ROOT write the same files
+	vector<double> cov( npars * npars );
+	for( unsigned int i = 0; i < npars; i++ )
+		for( unsigned int j = 0; j < npars; j++ )
+			cov[i*npars+j] = fitres.CovMatrix(i,j);
+	
+	return CoreFitter::WriteCurve( filename, globalChi2->GetModelName(), globalChi2->GetE0(),
+								  Estart, Eend, npoly, fitres.Parameters(), cov );
+	
+}
+
+int FitEff::SaveCalib( CalibDB &db, unsigned int detector,
+						unsigned int runfirst, unsigned int runlast ) {
+	
+	if( fitres.NPar() != npars ) {
+		
+		cerr << "No fit result to save\n";
+		return 1;
+		
+	}
+	
+	CalibEntry e;
+	e.detector = detector;
+	e.runfirst = runfirst;
+	e.runlast = runlast;
+	e.model = globalChi2->GetModelName();
+	e.E0 = globalChi2->GetE0();
+	e.Elow = Estart;
+	e.Eupp = Eend;
+	e.norm = fitres.Value(npoly);
+	e.chisq = fitres.Chi2();
+	e.ndf = fitres.Ndf();
+	e.status = fitres.Status();
+	e.valid = fitres.IsValid();
+	
+	// Same coefficients as the curve file
+	for( unsigned int i = 0; i < npoly; i++ ) {
+		
+		e.par.push_back( fitres.Value(i) );
+		for( unsigned int j = 0; j < npoly; j++ )
+			e.cov.push_back( fitres.CovMatrix(i,j) );
+		
+	}
+	
+	// Where it came from
+	for( unsigned int i = 0; i < efiles.size(); i++ )
+		e.info += ( i ? " -e " : "-e " ) + efiles[i];
+	for( unsigned int i = 0; i < nfiles.size(); i++ )
+		e.info += " -n " + nfiles[i];
+	
+	if( db.Append( e ) ) return 1;
+	
+	cout << "Calibration of detector " << detector << " for runs " << runfirst;
+	cout << " to " << runlast << " added to " << db.GetPath() << endl;
+	
+	return 0;
+	
+}
+
+int FitEff::MakeTable( unsigned int npoints, bool logE, double &x0, double &dx,
+					   vector<double> &eff, vector<double> &err ) {
+	
+	if( fitres.NPar() != npars || npoints < 2 || ( logE && Estart <= 0 ) ) {
+		
+		cerr << "Cannot make a table without a fit, at least 2 points";
+		cerr << " and, for a log grid, a positive range\n";
+		return 1;
+		
+	}
+	
+	// Grid in the variable of the table, E or ln( E )
+	x0 = logE ? TMath::Log( Estart ) : Estart;
+	double x1 = logE ? TMath::Log( Eend ) : Eend;
+	dx = ( x1 - x0 ) / ( npoints - 1 );
+	
+	// Same curve as drawn, i.e. not divided by the first normalisation
+	eff.resize( npoints );
+	err.resize( npoints );
+	double E;
+	for( unsigned int i = 0; i < npoints; i++ ) {
+		
+		E = x0 + i * dx;
+		if( logE ) E = TMath::Exp( E );
+		
+		eff[i] = fEff->Eval( E ) * fitres.Value(npoly);
+		err[i] = fErr->Eval( E ) * fitres.Value(npoly);
+		
+	}
+	
+	return 0;
+	
+}
+
+int FitEff::ExportTable( string filename, unsigned int npoints, bool logE ) {
+	
+	double x0, dx;
+	vector<double> eff, err;
+	if( MakeTable( npoints, logE, x0, dx, eff, err ) ) return 1;
+	
+	if( EffTable::write( filename, logE, x0, dx, eff, err ) ) {
+		
+		cerr << "Cannot write " << filename << " or its CSV copy\n";
+		return 1;
+		
+	}
+	
+	cout << "Efficiency table of " << npoints << " points written to ";
+	cout << filename << " and " << filename << ".csv\n";
+	
+	return 0;
+	
+}
+
+int FitEff::Publish( EffShm &shm, unsigned int channel, unsigned int npoints, bool logE ) {
+	
+	EffShmCurve c;
+	if( MakeTable( npoints, logE, c.x0, c.dx, c.eff, c.err ) ) return 1;
+	
+	c.model = globalChi2->GetModelName();
+	c.E0 = globalChi2->GetE0();
+	c.Elow = Estart;
+	c.Eupp = Eend;
+	c.norm = fitres.Value(npoly);
+	c.logE = logE;
+	
+	// Coefficients as in SaveCurve, if they fit in a slot
+	if( npoly <= EffCurve::kMaxPars ) {
+		
+		for( unsigned int i = 0; i < npoly; i++ ) {
+			
+			c.par.push_back( fitres.Value(i) );
+			for( unsigned int j = 0; j < npoly; j++ )
+				c.cov.push_back( fitres.CovMatrix(i,j) );
+			
+		}
 		
-		gFinal->SetPoint( i-fEff->GetXmin(), i, eff );
-		gLow->SetPoint( i-fEff->GetXmin(), i, eff-err );
-		gUpp->SetPoint( i-fEff->GetXmin(), i, eff+err );
+	}
+	
+	if( shm.publish( channel, c ) ) {
+		
+		cerr << "Cannot publish to channel " << channel << " of " << shm.nchannels() << endl;
+		return 1;
+		
+	}
+	
+	cout << "Efficiency curve published to channel " << channel;
+	cout << ", generation " << shm.generation( channel ) << endl;
+	
+	if( c.eff.size() > shm.maxtable() ) {
+		
+		cerr << "Table of " << c.eff.size() << " points left out, the segment holds at most ";
+		cerr << shm.maxtable() << ", so table lookups of the channel give NaN\n";
+		
+	}
+	
+	return 0;
+	
+}
 
+int FitEff::EmitCpp( string filename ) {
+	
+	if( fitres.NPar() != npars || globalChi2->GetModelName() != "poly" ) {
+		
+		cerr << "Code can only be generated for a fit of the poly model\n";
+		return 1;
+		
 	}
 	
-	// Graphs for the data
-	gData.resize( nsources );
-	for( unsigned int i = 0; i < nsources; i++ ) {
+	// Namespace and guard from the file name without path and extension,
+	// with no leading or double underscores, which are reserved
+	string base = filename.substr( filename.find_last_of( '/' ) + 1 );
+	base = base.substr( 0, base.find( '.' ) );
+	string name;
+	for( unsigned int i = 0; i < base.size(); i++ ) {
 		
-		gData[i] = new TGraphErrors( x[i].size() );
+		char ch = isalnum( (unsigned char)base[i] ) ? base[i] : '_';
+		if( ch == '_' && ( name.empty() || name[name.size()-1] == '_' ) ) continue;
+		name += ch;
 		
-		gData[i]->SetLineColor(i+1);
-		gData[i]->SetMarkerColor(i+1);
-		gData[i]->SetMarkerStyle(24+i*2);
-		gData[i]->SetMarkerSize(2);
-		gData[i]->SetLineWidth(2);
+	}
+	
+	const char **kend = kReservedNames + sizeof(kReservedNames) / sizeof(kReservedNames[0]);
+	if( name.empty() || isdigit( (unsigned char)name[0] ) ||
+	    std::find( kReservedNames, kend, name ) != kend ) name = "eff_" + name;
+	
+	string guard = "__" + name + "_hh__";
+	
+	// The curve and its error polynomial Q exactly as geff_eval.hh has
+	// them, Q being of degree 2 ( npoly - 1 )
+	vector<double> cov( npoly * npoly );
+	for( unsigned int k = 0; k < npoly; k++ )
+		for( unsigned int l = 0; l < npoly; l++ )
+			cov[k*npoly+l] = fitres.CovMatrix(k,l);
+	
+	EffCurve curve;
+	if( curve.set( globalChi2->GetE0(), Estart, Eend, fitres.Value(npoly), npoly,
+				  fitres.Parameters().data(), cov.data() ) ) {
 		
-		title = "source #" + convertInt(i+1);
-		leg->AddEntry( gData[i], title.c_str(), "lep" );
+		cerr << "Code can only be generated for at most " << EffCurve::kMaxPars << " coefficients\n";
+		return 1;
 		
-		mg->Add( gData[i], "P" );
+	}
+	
+	unsigned int nq = 2 * npoly - 1;
+	const double *c = curve.coefficients();
+	const double *q = curve.error_coefficients();
+	
+	ofstream out;
+	out.open( filename.c_str(), ios::out );
+	if( !out.is_open() ) {
+		
+		cerr << "Cannot write " << filename << endl;
+		return 1;
 		
 	}
+	
+	out << "// Efficiency curve generated by geff, do not edit\n";
+	out << "//   efficiency( E ) = exp( sum_k c_k L^k ), L = ln( E / E0 ), E in keV\n";
+	out << "//   efficiency_error( E ) = efficiency( E ) sqrt( sum_k q_k L^k )\n";
+	out << "// Fitted from";
+	for( unsigned int i = 0; i < efiles.size(); i++ )
+		out << " " << efiles[i];
+	out << "\n// over " << Estart << " to " << Eend << " keV, chi2/ndf = ";
+	out << fitres.Chi2() << "/" << fitres.Ndf() << "\n\n";
+	
+	out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+	out << "#include <cmath>\n\n";
+	out << "namespace " << name << " {\n\n";
+	
+	// Full precision, so that the curve is exactly the fitted one
+	out.precision( 17 );
+	
+	out << "constexpr double E0 = " << globalChi2->GetE0() << ";\n";
+	out << "constexpr double Elow = " << Estart << ";\n";
+	out << "constexpr double Eupp = " << Eend << ";\n\n";
+	
+	out << "constexpr double c[" << npoly << "] = {";
+	for( unsigned int k = 0; k < npoly; k++ )
+		out << ( k ? ", " : " " ) << c[k];
+	out << " };\n";
+	
+	out << "constexpr double q[" << nq << "] = {";
+	for( unsigned int k = 0; k < nq; k++ )
+		out << ( k ? ", " : " " ) << q[k];
+	out << " };\n\n";
+	
+	// Horner form written out, so that nothing is left to loops
+	out << "inline double efficiency( double E ) {\n";
+	out << "\tconst double L = std::log( E * ( 1. / E0 ) );\n";
+	out << "\treturn std::exp( ";
+	for( unsigned int k = 0; k + 1 < npoly; k++ )
+		out << "c[" << k << "] + L * ( ";
+	out << "c[" << npoly - 1 << "]";
+	for( unsigned int k = 0; k + 1 < npoly; k++ )
+		out << " )";
+	out << " );\n";
+	out << "}\n\n";
+	
+	out << "inline double efficiency_error( double E ) {\n";
+	out << "\tconst double L = std::log( E * ( 1. / E0 ) );\n";
+	out << "\tconst double Q = ";
+	for( unsigned int k = 0; k + 1 < nq; k++ )
+		out << "q[" << k << "] + L * ( ";
+	out << "q[" << nq - 1 << "]";
+	for( unsigned int k = 0; k + 1 < nq; k++ )
+		out << " )";
+	out << ";\n";
+	out << "\treturn efficiency( E ) * std::sqrt( Q > 0. ? Q : 0. );\n";
+	out << "}\n\n";
+	
+	out << "}\n\n#endif\n";
+	out.close();
+	
+	cout << "Efficiency curve written as C++ to " << filename << endl;
+	
+	return 0;
+	
+}
 
-	// Fill data points in graphs
-	double scale;
-	for( unsigned  int i = 0; i < nsources; i++ ) {
+void FitEff::PrintResults() {
+	
+	if( !fEff ) return;
+	
+	double eff, err;
+	cout << "E (keV)\tEff (%)\terror (%)\n";
+	for( unsigned int i = fEff->GetXmin(); i < fEff->GetXmax(); i++ ) {
 		
-		for ( unsigned int j = 0; j < x[i].size(); j++ ) {
+		if( ( i % 100 == 0 && i < 800 ) || ( i % 500 == 0 && i >= 500 )
+		    || i == 1332 || i == 50 ) {
 			
-			scale = fitres.Value(npoly+i);
-			gData[i]->SetPoint( j, x[i][j], y[i][j] * scale );
-			gData[i]->SetPointError( j, xerr[i][j], yerr[i][j] * scale );
+			eff = fEff->Eval( i ) * fitres.Value(npoly);
+			err = fErr->Eval( i ) * fitres.Value(npoly);
+			cout << i << "\t" << eff << "\t" << err << endl;
 			
 		}
 		
 	}
 	
-	// Some tidying up
-	gFinal->SetLineColor(nsources+1);
-	gFinal->SetLineWidth(2);
-	gLow->SetLineStyle(10);
-	gLow->SetLineColorAlpha(1,0.3);
-	gLow->SetLineWidth(2);
-	gUpp->SetLineStyle(10);
-	gUpp->SetLineColorAlpha(1,0.3);
-	gUpp->SetLineWidth(2);
-
-	leg->AddEntry( gFinal, "Fit results", "l" );
-	leg->AddEntry( gLow, "Upper/lower boundaries", "l" );
-
-	mg->Add(gLow,"C");
-	mg->Add(gUpp,"C");
-	mg->Add(gFinal,"C");
-	mg->Draw("A");
-	//c1->SetLogx();
-	mg->GetXaxis()->SetRangeUser( Estart, Eend );
-	//c1->SetLogy();
-	mg->GetYaxis()->SetRangeUser( gFinal->Eval(Estart) * 0.9, gFinal->GetMaximum() * 1.1 );
-	//mg->GetYaxis()->UnZoom();
-	c1->SetGridy();
-	c1->SetGridx();
-
-	leg->Draw("same");
-
-	// Labels etc
-	mg->GetXaxis()->SetTitle("Energy (keV)");
-	mg->GetYaxis()->SetTitle("Efficiency");
-	mg->GetXaxis()->SetTickLength(0.015);
-	mg->GetYaxis()->SetTickLength(0.015);
-	mg->GetXaxis()->SetTitleSize(0.045);
-	mg->GetYaxis()->SetTitleSize(0.045);
-	mg->GetYaxis()->SetTitleOffset(0.75);
-	
-	c1->Update();
-
-	c1->SaveAs( outputfile.c_str() );
+	return;
+	
+}
+
+void FitEff::DrawResults( string outputfile ) {
+	
+	if( !fEff ) return;
+	
+	PrintResults();
+	
+	// Curve and data as they are plotted
+	EffPlotInput in;
+	for( unsigned int i = fEff->GetXmin(); i < fEff->GetXmax(); i++ ) {
+		
+		in.E.push_back( i );
+		in.eff.push_back( fEff->Eval( i ) * fitres.Value(npoly) );
+		in.err.push_back( fErr->Eval( i ) * fitres.Value(npoly) );
+		
+	}
+	
+	in.data = data;
+	for( unsigned int i = 0; i < nsources; i++ )
+		in.norm.push_back( fitres.Value(npoly+i) );
+	in.Elow = Estart;
+	in.Eupp = Eend;
+	
+	std::lock_guard<std::mutex> lock( plot_mutex );
+	
+	// Canvas on first use, named after the fitter to be unique
+	if( !plot ) {
+		
+		string name = "c1_" + convertInt( globalChi2->GetId() );
+		plot.reset( NewPlot( name ) );
+		if( !plot ) return;
+		
+	}
+	
+	plot->Draw( in, outputfile );
 	
 	return;
 	
@@ -5,18 +5,12 @@
 #define __FitEff_hh__
 
 #include "TH1.h"
-#include "TCanvas.h"
-#include "TStyle.h"
 #include "TMath.h"
 #include "TRandom.h"
-#include "TGraphErrors.h"
-#include "TGraphAsymmErrors.h"
 #include "TMatrixTSym.h"
 #include "TFile.h"
-#include "TMultiGraph.h"
-#include "Fit/FitResult.h"
-#include "TLegend.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -27,20 +21,63 @@
 #include "convert.hh"
 #endif
 
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#ifndef __RootReader_hh__
+#include "RootReader.hh"
+#endif
+
+#ifndef __StreamReader_hh__
+#include "StreamReader.hh"
+#endif
+
 #ifndef __GlobalFitter_hh__
 #include "GlobalFitter.hh"
 #endif
 
+#ifndef __EffFitResult_hh__
+#include "EffFitResult.hh"
+#endif
+
+#ifndef __EffPlot_hh__
+#include "EffPlot.hh"
+#endif
+
+#ifndef __geff_shm_hh__
+#include "geff_shm.hh"
+#endif
+
+#ifndef __CalibDB_hh__
+#include "CalibDB.hh"
+#endif
+
 using namespace std;
 
 class FitEff {
 	
 public:
 	
-	// Initialisation functions
-	FitEff( GlobalFitter gf, int Es, int Ee );
+	// Initialisation functions, the fitter must outlive this object
+	FitEff( GlobalFitter &gf, int Es, int Ee );
 	~FitEff();
 	
+	FitEff( const FitEff& ) = delete;
+	FitEff& operator=( const FitEff& ) = delete;
+	
+	// Free the data, results and plots, and the fitter's too,
+	// ready for SetVariables() and the files of the next fit
+	void Reset();
+	
 	// Setup functions
 	inline void AddEfile( string filename ){
 		efiles.push_back( filename );
@@ -54,35 +91,88 @@ public:
 
 	void SetVariables( unsigned int n );
 	
+	// Where DoFit() writes the fit result, default "fitresult.txt",
+	// nowhere if empty
+	inline void SetResultFile( string filename ){
+		resultfile = filename;
+		return;
+	};
+	
 	inline void SetNsources( unsigned int n ){
 		nsources = n;
 		return;
 	};
 	
-	// Read data
+	// Read data, from standard input if the only efficiency file is "-"
 	int ReadData();
+	int ReadStream( int fd = 0 );
+	
+	// Take sources read elsewhere, e.g. by geffd from a request. As
+	// for a stream, the first source gets N=1 if none has normalisations.
+	int SetData( EffData d );
+	
+	// Read source i again, e.g. after its files changed. The other
+	// sources are kept and the next DoFit() starts from the last result.
+	int ReloadSource( unsigned int i );
+	
+	inline const vector<string>& GetEfiles() const { return efiles; };
+	inline const vector<string>& GetNfiles() const { return nfiles; };
+	inline EffDataPtr GetData() const { return data; };
+	inline const EffFitResult& GetFitResult() const { return fitres; };
+	
+	// Do fitting, returns 0 on success and 1 if there is no result
+	int DoFit();
 	
-	// Do fitting
-	void DoFit();
+	// Leave-one-out influence of every point and source on the last
+	// fit, written to filename with outliers summarised on screen
+	int Jackknife( string filename );
 	
-	// Draw things
+	// Write the fitted curve, i.e. the model, E0, its coefficients with
+	// their covariance and the normalisation, for geff_eval.hh
+	int SaveCurve( string filename );
+	
+	// Add the fitted curve, as for SaveCurve, with the fit summary and
+	// the input files to a calibration database, valid for the runs
+	// runfirst to runlast of a detector
+	int SaveCalib( CalibDB &db, unsigned int detector,
+				  unsigned int runfirst, unsigned int runlast );
+	
+	// Write the efficiency and its error at npoints over the fit range,
+	// uniform in E or in log( E ), as a table for geff_table.hh
+	int ExportTable( string filename, unsigned int npoints, bool logE );
+	
+	// Publish the curve and its table, as for ExportTable, to a channel
+	// of a shared-memory store, where readers see it replaced in place
+	int Publish( EffShm &shm, unsigned int channel, unsigned int npoints, bool logE );
+	
+	// Write a self-contained C++ header with the fitted poly curve and
+	// its error as inline Horner polynomials, in a namespace named
+	// after the file, e.g. clover3.hh gives clover3::efficiency( E )
+	int EmitCpp( string filename );
+	
+	// Print the efficiency at a few energies
+	void PrintResults();
+	
+	// Print, then plot the curve and data to outputfile. The canvas
+	// is made on the first call, so without it no graphics are set up,
+	// and geff-lite only loads the graphics libraries then.
 	void DrawResults( string outputfile );
 
 private:
 	
+	// Read the efficiency and normalisation files of source i
+	int ReadSource( unsigned int i, EffSource &src );
+	
+	// Efficiency and its error at npoints from x0 in steps of dx, in E
+	// or in ln( E ), over the fit range
+	int MakeTable( unsigned int npoints, bool logE, double &x0, double &dx,
+				  vector<double> &eff, vector<double> &err );
+	
 	// Files for efficiency and normalisation
-	ifstream ifile;
 	vector<string> efiles, nfiles;
 	
-	// Vectors for reading in data
-	vector< vector<double> > y;
-	vector< vector<double> > x;
-	vector< vector<double> > yerr;
-	vector< vector<double> > xerr;
-
-	// Data for normalisation
-	vector< vector<double> > norms;
-	vector< vector<double> > normserr;
+	// Data of all sources, shared with the fitter
+	EffDataPtr data;
 
 	// Number of parameters
 	unsigned int nsources;
@@ -91,7 +181,7 @@ private:
 	unsigned int nnormpars;
 	unsigned int npars;
 	
-	// Efficiency curves
+	// Efficiency curves, owned by the fitter
 	TF1 *fEff, *fErr;
 
 	// Default variables
@@ -106,16 +196,13 @@ private:
 	vector<double> parEffs;
 
 	// Fit results
+	bool warmstart;
+	string resultfile;
 	GlobalFitter *globalChi2;
-	ROOT::Fit::FitResult fitres;
+	EffFitResult fitres;
 
 	// Drawing things
-	TCanvas *c1;
-	vector< TGraphErrors* > gData;
-	TGraph *gFinal, *gLow, *gUpp;
-	TMultiGraph *mg;
-	TLegend* leg;
-	string title;
+	unique_ptr< EffPlot > plot;
 
 };
 #endif
@@ -7,27 +7,64 @@
 #include "GlobalFitter.hh"
 #endif
 
-#include "TCanvas.h"
+#include <atomic>
+#include <sstream>
 
-void GlobalFitter::CopyData( vector< vector<double> > _x,
-							vector< vector<double> > _xerr,
-							vector< vector<double> > _y,
-							vector< vector<double> > _yerr,
-							vector< vector<double> > _norms,
-							vector< vector<double> > _normserr ) {
+unsigned int GlobalFitter::NextId() {
 	
-	x = _x;
-	xerr = _xerr;
-	y = _y;
-	yerr = _yerr;
+	static std::atomic<unsigned int> counter( 0 );
 	
-	norms = _norms;
-	normserr = _normserr;
+	return ++counter;
+	
+}
 
-	nsources = x.size();
+void GlobalFitter::Reset() {
 	
-	BinData();
+	// Fit functions, users before the things they use
+	effi_fcn.clear();
+	norm_fcn.clear();
+	wEffi.clear();
+	wNorm.clear();
+	fEffi.clear();
+	fNorm.clear();
+	fEff.reset();
+	fErr.reset();
+	eff_func.reset();
+	err_func.reset();
+	model.reset();
+	spline = 0;
+	cachehit = false;
+	norm_func.reset();
+	
+	// Binned data are views, so they go before the data
+	effi_data.clear();
+	norm_data.clear();
+	xerr_eff.clear();
+	coord_err.clear();
+	data.reset();
+	data_size = 0;
+	
+	// Parameters
+	sol = FitSolution();
+	par0.clear();
+	parname.clear();
+	effpar.clear();
+	npars = 0;
+	nsources = 0;
+	neffpars = 0;
+	npoly = 0;
+	
+	return;
+	
+}
 
+void GlobalFitter::SetData( EffDataPtr _data ) {
+	
+	data = _data;
+	core.SetData( data );
+	
+	nsources = data->Size();
+	
 	return;
 	
 }
@@ -36,7 +73,7 @@ TF1* GlobalFitter::GetErrCurve( vector<double> _par ) {
 
 	fErr->SetParameters( _par.data() );
 	
-	return fErr;
+	return fErr.get();
 	
 }
 
@@ -44,24 +81,40 @@ TF1* GlobalFitter::GetEffCurve( vector<double> _par ) {
 	
 	fEff->SetParameters( _par.data() );
 	
-	return fEff;
+	return fEff.get();
 	
 }
 
 void GlobalFitter::BinData() {
 	
-	// Data initialisers and filling
+	// Data initialisers, these are views of the shared data
 	effi_data.resize( nsources );
 	norm_data.resize( nsources );
 
 	for ( unsigned int i = 0; i < nsources; i++ ) {
 		
-		effi_data[i] = make_shared< ROOT::Fit::BinData >( opt,
-						x[i].size(), 1, ROOT::Fit::BinData::kCoordError );
+		const EffSource &src = (*data)[i];
 		
-		for ( unsigned int j = 0; j < x[i].size(); j++ ) {
+		// ROOT needs valid pointers for external data
+		if( src.Size() == 0 ) {
 			
-			effi_data[i]->Add( x[i][j], y[i][j], xerr[i][j], yerr[i][j] );
+			effi_data[i] = make_shared< ROOT::Fit::BinData >( opt,
+							0, 1, ROOT::Fit::BinData::kValueError );
+			
+		}
+		
+		// Sources without significant energy errors take the cheap path
+		else if( coord_err[i] ) {
+			
+			effi_data[i] = make_shared< ROOT::Fit::BinData >( src.Size(),
+							src.E.data(), src.eff.data(), xerr_eff[i].data(), src.deff.data() );
+			
+		}
+		
+		else {
+			
+			effi_data[i] = make_shared< ROOT::Fit::BinData >( src.Size(),
+							src.E.data(), src.eff.data(), (const double*)0, src.deff.data() );
 			
 		}
 		
@@ -69,12 +122,20 @@ void GlobalFitter::BinData() {
 	
 	for ( unsigned int i = 0; i < nsources; i++ ) {
 		
-		norm_data[i] = make_shared< ROOT::Fit::BinData >( opt,
-						norms[i].size(), 1, ROOT::Fit::BinData::kValueError );
+		const EffSource &src = (*data)[i];
+		
+		// NormFunc is a constant, so the values double as coordinates
+		if( src.NormSize() == 0 ) {
+			
+			norm_data[i] = make_shared< ROOT::Fit::BinData >( opt,
+							0, 1, ROOT::Fit::BinData::kValueError );
+			
+		}
 		
-		for ( unsigned int j = 0; j < norms[i].size(); j++ ) {
+		else {
 			
-			norm_data[i]->Add( 1.0, norms[i][j], normserr[i][j] );
+			norm_data[i] = make_shared< ROOT::Fit::BinData >( src.NormSize(),
+							src.norm.data(), src.norm.data(), (const double*)0, src.dnorm.data() );
 			
 		}
 		
@@ -93,7 +154,7 @@ void GlobalFitter::BinData() {
 	
 }
 
-void GlobalFitter::SetParameters( vector<double> _par, vector<string> _parname ) {
+int GlobalFitter::SetParameters( vector<double> _par, vector<string> _parname, bool warm ) {
 	
 	par0 = _par;
 	parname = _parname;
@@ -103,26 +164,87 @@ void GlobalFitter::SetParameters( vector<double> _par, vector<string> _parname )
 	neffpars = npoly + 1;
 	
 	// write the efficiency parameters
-	for( unsigned int i = 0; i < neffpars; i++ )
-		effpar.push_back( par0[i] );
+	effpar.assign( par0.begin(), par0.begin() + neffpars );
 	
 	// adjust the normalisation
-	for( unsigned int i = npoly; i < npars; i++ )
-		par0[i] = norms[0][0];
+	for( unsigned int i = npoly; i < npars && !warm; i++ )
+		par0[i] = (*data)[0].NormSize() ? (*data)[0].norm[0] : 1.0;
+	
+	// Exact derivatives are limited to kMaxEffPars efficiency parameters
+	use_gradient = ( neffpars <= kMaxEffPars );
 	
 	// Make individual fits
-	CreateIndividualFits();
+	return CreateIndividualFits();
 	
-	return;
+}
+
+bool GlobalFitter::ClassifyCoordErrors( const double *p ) {
+	
+	// The core decides, the binned data need the errors themselves
+	bool changed = core.ClassifyCoordErrors( p );
+	const vector< vector<bool> > &coord = core.CoordErrors();
+	unsigned int ncoord;
+	
+	xerr_eff.resize( nsources );
+	coord_err.resize( nsources );
+	
+	for( unsigned int i = 0; i < nsources; i++ ) {
+		
+		const EffSource &src = (*data)[i];
+		
+		xerr_eff[i].resize( src.Size() );
+		ncoord = 0;
+		
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+			
+			xerr_eff[i][j] = coord[i][j] ? src.dE[j] : 0.;
+			if( coord[i][j] ) ncoord++;
+			
+		}
+		
+		coord_err[i] = ( ncoord > 0 );
+		
+		cout << "source #" << i << " has " << ncoord << " of " << src.Size();
+		cout << " points with significant energy errors\n";
+		
+	}
+	
+	return changed;
 	
 }
 
-void GlobalFitter::CreateIndividualFits() {
+int GlobalFitter::CreateIndividualFits() {
 	
 	// Function classes
-	eff_func = new ExpFit( E0, neffpars );
-	err_func = new ExpFitErr( E0, neffpars );
-	norm_func = new NormFunc();
+	model = CreateModel();
+	if( !model || model->NPars() != npoly ) {
+		
+		cerr << "The " << modelname << " model needs " << ( model ? model->NPars() : 0 );
+		cerr << " coefficients, but " << npoly << " were given\n";
+		model.reset();
+		spline = 0;
+		return 1;
+		
+	}
+	
+	const EffModelAdapter<SplineModel> *sm =
+		dynamic_cast< const EffModelAdapter<SplineModel>* >( model.get() );
+	spline = sm ? &sm->Model() : 0;
+	
+	// The native fit shares the data and the model
+	core.SetData( data );
+	core.SetModel( model );
+	core.SetCoordErrorThreshold( xthresh );
+	core.SetPenalty( spline ? lambda : 0. );
+	core.Setup();
+	
+	eff_func.reset( new ExpFit( model, neffpars ) );
+	err_func.reset( new ExpFitErr( *eff_func, neffpars ) );
+	norm_func.reset( new NormFunc() );
+	
+	// Find the energy errors that matter at the starting values
+	ClassifyCoordErrors( par0.data() );
+	BinData();
 	
 	// Resize vectors
 	fEffi.resize( nsources );
@@ -132,16 +254,20 @@ void GlobalFitter::CreateIndividualFits() {
 	effi_fcn.resize( nsources );
 	norm_fcn.resize( nsources );
 	
-	// Fit functions for all data
+	// Fit functions for all data, unique to this instance and
+	// kept out of the global list of functions for thread safety
 	string name;
+	string tag = "_" + convertInt(id);
 	for( unsigned int i = 0; i < nsources; i++ ) {
 		
-		name = "fEffi_" + convertInt(i+1);
-		fEffi[i] = make_shared< TF1 >( name.c_str(), eff_func, Estart, Eend, neffpars );
+		name = "fEffi" + tag + "_" + convertInt(i+1);
+		fEffi[i] = make_shared< TF1 >( name.c_str(), eff_func.get(), Estart, Eend,
+									  neffpars, 1, TF1::EAddToList::kNo );
 		wEffi[i] = make_shared< ROOT::Math::WrappedMultiTF1 >( *fEffi[i], 1 );
 		
-		name = "fNorm_" + convertInt(i+1);
-		fNorm[i] = make_shared< TF1 >( name.c_str(), norm_func, -1e6, 1e6, 1 );
+		name = "fNorm" + tag + "_" + convertInt(i+1);
+		fNorm[i] = make_shared< TF1 >( name.c_str(), norm_func.get(), -1e6, 1e6,
+									  1, 1, TF1::EAddToList::kNo );
 		wNorm[i] = make_shared< ROOT::Math::WrappedMultiTF1 >( *fNorm[i], 1 );
 
 	}
@@ -149,72 +275,664 @@ void GlobalFitter::CreateIndividualFits() {
 	// Chi2 functions for all data
 	for( unsigned int i = 0; i < nsources; i++ ) {
 		
-		effi_fcn[i] = new ROOT::Fit::Chi2Function( effi_data[i], wEffi[i] );
-		norm_fcn[i] = new ROOT::Fit::Chi2Function( norm_data[i], wNorm[i] );
+		effi_fcn[i].reset( new ROOT::Fit::Chi2Function( effi_data[i], wEffi[i] ) );
+		norm_fcn[i].reset( new ROOT::Fit::Chi2Function( norm_data[i], wNorm[i] ) );
 		
 	}
 	
 	// Efficiency and error functions
-	fEff = new TF1( "fEff", eff_func, Estart, Eend, neffpars );
-	fErr = new TF1( "fErr", err_func, Estart, Eend, npoly*neffpars+1 );
+	name = "fEff" + tag;
+	fEff.reset( new TF1( name.c_str(), eff_func.get(), Estart, Eend,
+						neffpars, 1, TF1::EAddToList::kNo ) );
+	name = "fErr" + tag;
+	fErr.reset( new TF1( name.c_str(), err_func.get(), Estart, Eend,
+						npoly*neffpars+1, 1, TF1::EAddToList::kNo ) );
 	
-	return;
+	return 0;
 	
 }
 
-ROOT::Fit::FitResult GlobalFitter::GetFitResult() {
+string GlobalFitter::CacheKey() const {
+	
+	// Everything that changes the result, in a fixed format
+	ostringstream ss;
+	ss.precision( 17 );
+	ss << "geff " << FitCache::kVersion << " " << kFitVersion << " " << modelname << " " << npoly;
+	ss << " " << nsources << " " << E0 << " " << Estart << " " << Eend;
+	if( spline ) ss << " " << modelopt.nknots << " " << lambda;
+	if( modelname == "template" ) ss << " " << templhash << " " << modelopt.ncorr;
+	ss << " " << xthresh << " " << use_gradient;
+	ss << ( spline ? " banded" : " native" ) << " Minuit2 Migrad";
+	ss << " " << hex << FitCache::Hash( *data );
 	
-	// Define fitter
-	Chi2Fit chi2fitter = Chi2Fit( effi_fcn, norm_fcn, nsources, npars );
-	ROOT::Fit::Fitter fitter;
-	fitter.Config().SetParamsSettings( npars, par0.data() );
+	return ss.str();
 	
-	// Get initial chisq
-	double chisq0 = chi2fitter.EvalChi2( par0.data() );
-	cout << "Initial chisq = " << chisq0 << endl;
+}
 
-	// set parameter names
-	for( unsigned int i = 0; i < npars; i++ ) {
+EffFitResult GlobalFitter::GetFitResult() {
+	
+	EffFitResult fitres;
+	
+	// Nothing to fit after SetParameters() failed
+	if( !model ) {
 		
-		fitter.Config().ParSettings(i).SetName( parname[i].c_str() );
+		cerr << "No efficiency model set up, not fitting\n";
+		return fitres;
 		
 	}
 	
-	// Fitter options
-	fitter.Config().SetMinimizer( "Minuit2", "Migrad" );
-	//fitter.Config().MinimizerOptions().SetPrintLevel(1);
-	//fitter.Config().SetMinosErrors( true ); // Perform MINOS error analysis, i.e. correlations to all parameters
-	//fitter.Config().MinimizerOptions().SetMaxIterations(1);
-	//fitter.Config().MinimizerOptions().SetMaxFunctionCalls(1);
+	// Unchanged data and settings give the stored result, and
+	// the fitter is left as it would be after the fit
+	string key;
+	cachehit = false;
+	if( cache ) {
+		
+		key = CacheKey();
+		if( cache->Load( key, fitres ) == 0 ) {
+			
+			cout << "Fit result from the cache, " << cache->GetDir() << endl;
+			cachehit = true;
+			par0 = fitres.Parameters();
+			if( ClassifyCoordErrors( par0.data() ) ) RebindData();
+			return fitres;
+			
+		}
+		
+	}
+	
+	// Solve the spline with its banded normal equations, so that
+	// Minuit starts at the minimum and only provides the errors
+	if( spline ) {
+		
+		int status = BandedFit( par0 );
+		if( status != 1 ) {
+			
+			if( status == 2 ) cout << "Banded spline fit did not converge, starting Minuit from its best point\n";
+			ClassifyCoordErrors( par0.data() );
+			RebindData();
+			
+		}
+		
+		else cout << "Banded spline fit failed, starting Minuit from the start values\n";
+		
+	}
+	
+	// Other models are fitted by the core alone, Minuit only takes
+	// over when the native fit does not converge
+	else {
+		
+		CoreResult coreres;
+		core.SetVerbose( true );
+		int status = core.Fit( par0, coreres );
+		if( status != 1 ) {
+			
+			par0 = coreres.par;
+			ClassifyCoordErrors( par0.data() );
+			RebindData();
+			
+		}
+		
+		if( status == 0 ) {
+			
+			fitres = CoreFitResult( coreres );
+			if( cache ) cache->Save( key, fitres );
+			return fitres;
+			
+		}
+		
+		if( status == 2 ) cout << "Native fit did not converge, starting Minuit from its best point\n";
+		else cout << "Native fit failed, starting Minuit from the start values\n";
+		
+	}
 	
-	// fix normalisation if no data
-	if( normserr[0][0] / norms[0][0] < 1e-9 )
-		fitter.Config().ParSettings(npars-nsources).Fix();
+	// A second pass is needed only if the energy errors that
+	// matter are different for the fitted curve
+	for( unsigned int pass = 0; pass < 2; pass++ ) {
+		
+		// Define fitter
+		Chi2Fit chi2fitter = Chi2Fit( effi_fcn, norm_fcn, nsources, npars, this );
+		ROOT::Fit::Fitter fitter;
+		fitter.Config().SetParamsSettings( npars, par0.data() );
 		
+		// Get initial chisq
+		double chisq0 = chi2fitter.EvalChi2( par0.data() );
+		cout << "Initial chisq = " << chisq0 << endl;
 
-	// Do fit of global chi2 fucntion
-	fitter.FitFCN( npars, chi2fitter, 0, data_size, true );
+		// set parameter names
+		for( unsigned int i = 0; i < npars; i++ ) {
+			
+			fitter.Config().ParSettings(i).SetName( parname[i].c_str() );
+			
+		}
+		
+		// Fitter options
+		fitter.Config().SetMinimizer( "Minuit2", "Migrad" );
+		//fitter.Config().MinimizerOptions().SetPrintLevel(1);
+		//fitter.Config().SetMinosErrors( true ); // Perform MINOS error analysis, i.e. correlations to all parameters
+		//fitter.Config().MinimizerOptions().SetMaxIterations(1);
+		//fitter.Config().MinimizerOptions().SetMaxFunctionCalls(1);
+		
+		// fix normalisation if no data
+		if( FirstNormFixed() )
+			fitter.Config().ParSettings(npars-nsources).Fix();
+			
+
+		// Do fit of global chi2 fucntion, with its exact gradient if possible
+		if( use_gradient ) {
+			
+			Chi2Grad chi2grad( *this );
+			fitter.FitFCN( chi2grad, 0, data_size, true );
+			
+		}
+		
+		else fitter.FitFCN( npars, chi2fitter, 0, data_size, true );
+
+		// normalise the errors to chi2/NDF = 1
+		fitres = EffFitResult( fitter.Result() );
+		//fitres.NormalizeErrors();
+		
+		// Check the energy errors again at the fitted values
+		if( pass > 0 || !ClassifyCoordErrors( fitres.Parameters().data() ) )
+			break;
+		
+		cout << "Significant energy errors changed, refitting\n";
+		
+		// Warm start with the new data and chi2 functions
+		par0 = fitres.Parameters();
+		RebindData();
+		
+	}
+	
+	// Only converged fits are kept
+	if( cache && fitres.IsValid() ) cache->Save( key, fitres );
+	
+	return fitres;
+	
+}
 
-	// normalise the errors to chi2/NDF = 1
-	ROOT::Fit::FitResult fitres = fitter.Result();
-	//fitres.NormalizeErrors();
+EffFitResult GlobalFitter::CoreFitResult( const CoreResult &res ) const {
+	
+	EffFitResult fitres;
+	vector<bool> fixed( npars, false );
+	fixed[npoly] = FirstNormFixed();
+	
+	for( unsigned int i = 0; i < npars; i++ ) {
+		
+		fitres.par.push_back( res.par[i] );
+		fitres.err.push_back( fixed[i] ? 0. : res.Error(i) );
+		fitres.fixed.push_back( fixed[i] );
+		fitres.names.push_back( parname[i] );
+		
+	}
+	
+	fitres.cov = res.cov;
+	fitres.minimizer = "geff / Levenberg-Marquardt";
+	fitres.chisq = res.chisq;
+	fitres.edm = res.edm;
+	fitres.ndf = res.ndf;
+	fitres.nfree = res.nfree;
+	fitres.ncalls = res.niter;
+	fitres.status = 0;
+	fitres.covstatus = 3;
+	fitres.valid = true;
 	
 	return fitres;
 	
 }
 
-double GlobalFitter::ExpFit::operator()( double *x, double *par ) {
+void GlobalFitter::RebindData() {
 	
-	unsigned int _npoly = _neffpars - 1;
+	BinData();
+	
+	for( unsigned int i = 0; i < nsources; i++ ) {
+		
+		effi_fcn[i].reset( new ROOT::Fit::Chi2Function( effi_data[i], wEffi[i] ) );
+		norm_fcn[i].reset( new ROOT::Fit::Chi2Function( norm_data[i], wNorm[i] ) );
+		
+	}
 	
-	Double_t f = par[0];
+	return;
 	
-	for( unsigned int i = 1; i < _npoly; i++ )
-		f += par[i] * TMath::Power( TMath::Log( x[0] / _E0 ), (double)i );
+}
+
+void GlobalFitter::Jacobian( const double *p, vector<double> &res, vector<double> &jac ) {
 	
-	f = TMath::Exp(f);
+	core.Residuals( p, res, &jac );
 	
-	return f / par[_npoly];
+	return;
+	
+}
+
+int GlobalFitter::InitSolution( const vector<double> &p ) {
+	
+	if( !data || p.size() != npars || !use_gradient ) return 1;
+	
+	// The penalty is not part of the linearised problem
+	if( spline ) {
+		
+		cerr << "Updates of the solution need the polynomial model\n";
+		return 1;
+		
+	}
+	
+	sol.par = p;
+	sol.nupdates = 0;
+	sol.refitted = false;
+	
+	vector<double> res, jac;
+	Jacobian( p.data(), res, jac );
+	
+	// chi2 and normal matrix J^T J of the linearised problem
+	sol.chisq = 0;
+	sol.cov.assign( npars * npars, 0. );
+	for( unsigned int k = 0; k < res.size(); k++ ) {
+		
+		sol.chisq += res[k] * res[k];
+		
+		const double *row = &jac[k*npars];
+		for( unsigned int l = 0; l < npars; l++ ) {
+			
+			if( row[l] == 0 ) continue;
+			for( unsigned int m = 0; m < npars; m++ )
+				sol.cov[l*npars+m] += row[l] * row[m];
+			
+		}
+		
+	}
+	
+	vector<bool> fixed( npars, false );
+	fixed[npoly] = FirstNormFixed();
+	
+	unsigned int nfree = npars - ( fixed[npoly] ? 1 : 0 );
+	sol.ndf = data_size > (int)nfree ? data_size - nfree : 0;
+	
+	if( CoreFitter::InvertSym( sol.cov, npars, fixed ) ) {
+		
+		cerr << "Normal matrix is singular, cannot update the solution\n";
+		sol.par.clear();
+		return 1;
+		
+	}
+	
+	return 0;
+	
+}
+
+int GlobalFitter::AddPoint( unsigned int i, double E, double dE, double eff, double deff ) {
+	
+	if( sol.par.size() != npars || i >= nsources ) return 1;
+	
+	// Energy error and linearisation at the current solution
+	bool coord = core.CoordError( i, E, dE, deff, sol.par.data() );
+	double xe = coord ? dE : 0.;
+	
+	vector<double> a( npars );
+	double r = core.PointResidual( i, E, dE, eff, deff, coord, sol.par.data(), a.data() );
+	
+	// Append the point to a new copy of this source only
+	EffSource src = (*data)[i];
+	src.E.push_back( E );
+	src.dE.push_back( dE );
+	src.eff.push_back( eff );
+	src.deff.push_back( deff );
+	
+	xerr_eff[i].push_back( xe );
+	if( xe != 0 ) coord_err[i] = true;
+	ChangeSource( i, std::move( src ) );
+	
+	return UpdateSolution( r, a, 1. );
+	
+}
+
+int GlobalFitter::RemovePoint( unsigned int i, unsigned int j ) {
+	
+	if( sol.par.size() != npars || i >= nsources || j >= (*data)[i].Size() ) return 1;
+	
+	const EffSource &old = (*data)[i];
+	vector<double> a( npars );
+	double r = core.PointResidual( i, old.E[j], old.dE[j], old.eff[j], old.deff[j],
+								  xerr_eff[i][j] != 0, sol.par.data(), a.data() );
+	
+	// Remove the point from a new copy of this source only
+	EffSource src = old;
+	src.E.erase( src.E.begin() + j );
+	src.dE.erase( src.dE.begin() + j );
+	src.eff.erase( src.eff.begin() + j );
+	src.deff.erase( src.deff.begin() + j );
+	
+	xerr_eff[i].erase( xerr_eff[i].begin() + j );
+	ChangeSource( i, std::move( src ) );
+	
+	return UpdateSolution( r, a, -1. );
+	
+}
+
+void GlobalFitter::ChangeSource( unsigned int i, EffSource &&src ) {
+	
+	// The binned data are views, so they are rebuilt for the new data
+	data = make_shared<const EffData>( *data, i, std::move( src ) );
+	
+	// The other points keep their energy errors as classified
+	vector< vector<bool> > coord( nsources );
+	for( unsigned int k = 0; k < nsources; k++ )
+		for( unsigned int j = 0; j < xerr_eff[k].size(); j++ )
+			coord[k].push_back( xerr_eff[k][j] != 0 );
+	
+	core.SetData( data );
+	core.SetCoordErrors( coord );
+	RebindData();
+	
+	return;
+	
+}
+
+int GlobalFitter::UpdateSolution( double r, const vector<double> &a, double sign ) {
+	
+	// u = C a and the leverage h = a^T C a
+	vector<double> u( npars, 0. );
+	double h = 0;
+	for( unsigned int l = 0; l < npars; l++ ) {
+		
+		for( unsigned int m = 0; m < npars; m++ )
+			u[l] += sol.cov[l*npars+m] * a[m];
+		h += a[l] * u[l];
+		
+	}
+	
+	double d = 1. + sign * h;
+	
+	// The step is -sign * r * u / d, which has a length in standard
+	// deviations of sqrt( step^T C^-1 step ) = |r| * sqrt( h ) / d
+	if( d < 1e-6 || TMath::Abs( r ) * TMath::Sqrt( h ) / d > update_limit ) {
+		
+		cout << "Change is too large for an update, refitting\n";
+		return Refit();
+		
+	}
+	
+	for( unsigned int l = 0; l < npars; l++ ) {
+		
+		sol.par[l] -= sign * r * u[l] / d;
+		
+		for( unsigned int m = 0; m < npars; m++ )
+			sol.cov[l*npars+m] -= sign * u[l] * u[m] / d;
+		
+	}
+	
+	sol.chisq += sign * r * r / d;
+	if( sign > 0 ) sol.ndf++;
+	else if( sol.ndf > 0 ) sol.ndf--;
+	sol.nupdates++;
+	sol.refitted = false;
+	
+	return 0;
+	
+}
+
+int GlobalFitter::Refit() {
+	
+	SetParameters( sol.par, parname, true );
+	EffFitResult fitres = GetFitResult();
+	
+	if( InitSolution( fitres.Parameters() ) ) return 1;
+	sol.refitted = true;
+	
+	return 0;
+	
+}
+
+int GlobalFitter::Jackknife( vector<PointInfluence> &pts, vector<SourceInfluence> &srcs,
+							unsigned int nsteps ) {
+	
+	pts.clear();
+	srcs.clear();
+	
+	if( sol.par.size() != npars ) return 1;
+	
+	vector<double> res, jac;
+	Jacobian( sol.par.data(), res, jac );
+	unsigned int nrows = res.size();
+	
+	// Normal matrix, i.e. the inverse of the covariance
+	vector<double> hess( npars * npars, 0. );
+	double chisq = 0;
+	for( unsigned int k = 0; k < nrows; k++ ) {
+		
+		chisq += res[k] * res[k];
+		for( unsigned int l = 0; l < npars; l++ )
+			for( unsigned int m = 0; m < npars; m++ )
+				hess[l*npars+m] += jac[k*npars+l] * jac[k*npars+m];
+		
+	}
+	
+	vector<bool> fixed( npars, false );
+	fixed[npoly] = FirstNormFixed();
+	unsigned int nfree = npars - ( fixed[npoly] ? 1 : 0 );
+	
+	// Residuals are only scaled up for a poor fit, never down
+	double s2 = ( sol.ndf > 0 && chisq > sol.ndf ) ? chisq / sol.ndf : 1.;
+	
+	// Length of a shift in standard deviations
+	auto Shift = [&]( const vector<double> &dp ){
+		double d = 0;
+		for( unsigned int l = 0; l < npars; l++ )
+			for( unsigned int m = 0; m < npars; m++ )
+				d += dp[l] * hess[l*npars+m] * dp[m];
+		return TMath::Sqrt( TMath::Max( d, 0. ) );
+	};
+	
+	// Point of each row, in the order of Jacobian()
+	pts.resize( nrows );
+	unsigned int k = 0;
+	for( unsigned int i = 0; i < nsources; i++ )
+		for( unsigned int j = 0; j < (*data)[i].Size(); j++, k++ ) {
+			pts[k].source = i;
+			pts[k].index = j;
+			pts[k].norm = false;
+		}
+	for( unsigned int i = 0; i < nsources; i++ )
+		for( unsigned int j = 0; j < (*data)[i].NormSize(); j++, k++ ) {
+			pts[k].source = i;
+			pts[k].index = j;
+			pts[k].norm = true;
+		}
+	
+	// Leave out one point: the downdated step is C a r / ( 1 - h )
+	vector<double> u( npars );
+	vector<bool> skip( nrows, false );
+	double h, d;
+	for( k = 0; k < nrows; k++ ) {
+		
+		PointInfluence &pt = pts[k];
+		const double *a = &jac[k*npars];
+		
+		h = 0;
+		for( unsigned int l = 0; l < npars; l++ ) {
+			
+			u[l] = 0;
+			for( unsigned int m = 0; m < npars; m++ )
+				u[l] += sol.cov[l*npars+m] * a[m];
+			h += a[l] * u[l];
+			
+		}
+		
+		pt.res = res[k];
+		pt.leverage = h;
+		pt.dpar.assign( npars, 0. );
+		d = 1. - h;
+		
+		// Without this point a parameter is not determined
+		if( d < 1e-9 ) {
+			
+			pt.student = pt.cook = pt.shift = pt.curve = 0;
+			pt.outlier = false;
+			pt.influential = true;
+			continue;
+			
+		}
+		
+		for( unsigned int l = 0; l < npars; l++ )
+			pt.dpar[l] = u[l] * res[k] / d;
+		
+		pt.student = res[k] / TMath::Sqrt( s2 * d );
+		pt.cook = res[k] * res[k] * h / ( nfree * s2 * d * d );
+		pt.outlier = TMath::Abs( pt.student ) > 3.;
+		pt.influential = pt.cook > 4. / nrows;
+		
+		// Relinearise where it matters
+		if( nsteps && ( pt.outlier || pt.influential ) ) {
+			
+			vector<double> p = sol.par;
+			for( unsigned int l = 0; l < npars; l++ )
+				p[l] += pt.dpar[l];
+			
+			skip[k] = true;
+			double c;
+			if( NewtonSteps( p, skip, fixed, nsteps, c ) == 0 )
+				for( unsigned int l = 0; l < npars; l++ )
+					pt.dpar[l] = p[l] - sol.par[l];
+			skip[k] = false;
+			
+		}
+		
+		pt.shift = Shift( pt.dpar );
+		pt.curve = CurveChange( sol.par, pt.dpar );
+		
+	}
+	
+	// Leave out one source, its normalisation is then free of data
+	srcs.resize( nsources );
+	for( unsigned int i = 0; i < nsources; i++ ) {
+		
+		SourceInfluence &src = srcs[i];
+		src.source = i;
+		src.npoints = 0;
+		src.dpar.assign( npars, 0. );
+		src.shift = src.curve = src.dchisq = 0;
+		
+		vector<bool> sfixed = fixed;
+		sfixed[npoly+i] = true;
+		
+		double chisq_rest = 0;
+		for( k = 0; k < nrows; k++ ) {
+			
+			skip[k] = ( pts[k].source == i );
+			if( skip[k] ) src.npoints++;
+			else chisq_rest += res[k] * res[k];
+			
+		}
+		
+		vector<double> p = sol.par;
+		double c;
+		src.determined = ( NewtonSteps( p, skip, sfixed, TMath::Max( nsteps, 1u ), c ) == 0 );
+		
+		if( src.determined ) {
+			
+			for( unsigned int l = 0; l < npars; l++ )
+				if( l != npoly + i ) src.dpar[l] = p[l] - sol.par[l];
+			
+			src.dchisq = c - chisq_rest;
+			src.shift = Shift( src.dpar );
+			src.curve = CurveChange( sol.par, src.dpar );
+			
+		}
+		
+	}
+	
+	return 0;
+	
+}
+
+int GlobalFitter::NewtonSteps( vector<double> &p, const vector<bool> &skip,
+							  const vector<bool> &fixed, unsigned int nsteps, double &chisq ) {
+	
+	vector<double> res, jac, hess, grad;
+	
+	for( unsigned int step = 0; step <= nsteps; step++ ) {
+		
+		Jacobian( p.data(), res, jac );
+		
+		hess.assign( npars * npars, 0. );
+		grad.assign( npars, 0. );
+		chisq = 0;
+		
+		for( unsigned int k = 0; k < res.size(); k++ ) {
+			
+			if( skip[k] ) continue;
+			
+			const double *a = &jac[k*npars];
+			chisq += res[k] * res[k];
+			
+			for( unsigned int l = 0; l < npars; l++ ) {
+				
+				if( a[l] == 0 ) continue;
+				grad[l] += a[l] * res[k];
+				for( unsigned int m = 0; m < npars; m++ )
+					hess[l*npars+m] += a[l] * a[m];
+				
+			}
+			
+		}
+		
+		// The chi2 of the last step is all that's needed
+		if( step == nsteps ) break;
+		
+		if( CoreFitter::InvertSym( hess, npars, fixed ) ) return 1;
+		
+		for( unsigned int l = 0; l < npars; l++ )
+			for( unsigned int m = 0; m < npars; m++ )
+				p[l] -= hess[l*npars+m] * grad[m];
+		
+	}
+	
+	return 0;
+	
+}
+
+double GlobalFitter::CurveChange( const vector<double> &p, const vector<double> &dp ) const {
+	
+	vector<double> c1( npoly );
+	for( unsigned int l = 0; l < npoly; l++ )
+		c1[l] = p[l] + dp[l];
+	
+	// Logarithmic grid over the fit range, the normalisation cancels
+	const unsigned int ngrid = 50;
+	double lo = TMath::Log( TMath::Max( Estart, 1 ) );
+	double hi = TMath::Log( TMath::Max( Eend, Estart + 1 ) );
+	double E[ngrid], f0[ngrid], f1[ngrid];
+	
+	for( unsigned int g = 0; g < ngrid; g++ )
+		E[g] = TMath::Exp( lo + ( hi - lo ) * g / ( ngrid - 1 ) );
+	
+	model->Values( ngrid, E, p.data(), f0 );
+	model->Values( ngrid, E, c1.data(), f1 );
+	
+	double change = 0;
+	for( unsigned int g = 0; g < ngrid; g++ )
+		if( f0[g] > 0 )
+			change = TMath::Max( change, TMath::Abs( f1[g] / f0[g] - 1. ) );
+	
+	return change;
+	
+}
+
+void GlobalFitter::SourcePars( unsigned int i, const double *p, double *q ) const {
+	
+	for( unsigned int j = 0; j < npoly; j++ )
+		q[j] = p[j];
+	
+	q[npoly] = p[npoly+i];
+	
+	return;
+	
+}
+
+double GlobalFitter::Chi2Grad::DoDerivative( const double *p, unsigned int i ) const {
+	
+	vector<double> grad( gf.npars );
+	Evaluate( p, grad.data() );
+	
+	return grad[i];
 	
 }
 
@@ -222,29 +940,324 @@ double GlobalFitter::ExpFitErr::operator()( double *x, double *par ) {
 	
 	unsigned int _npoly = _neffpars - 1;
 	
-	ExpFit expfcn( _E0, _neffpars );
-	vector<double> _effpar;
-	_effpar.resize( _neffpars );
-	for( unsigned int m = 0; m < _neffpars; m++ )
-		_effpar[m] = par[_npoly*_npoly+m];
-	
-	Double_t f = 0, g = 0;
-	Double_t h = TMath::Power( expfcn( x, _effpar.data() ), 2.0 );
+	// Gradient of the efficiency with respect to the coefficients
+	// of the exponent, the normalisation is held constant
+	vector<double> grad( _npoly );
+	_fit.Gradient( x[0], par + _npoly*_npoly, grad.data() );
 	
+	// Propagate the covariance matrix
+	Double_t f = 0;
 	for( unsigned int m = 0; m < _npoly; m++ ) {
 		
-		for( unsigned int n = 0; n < _npoly; n++ ) {
+		if( grad[m] == 0 ) continue;
+		for( unsigned int n = 0; n < _npoly; n++ )
+			f += grad[m] * grad[n] * par[ m*_npoly + n ];
+		
+	}
+	
+	return TMath::Sqrt(f);
+	
+}
+
+double GlobalFitter::ExpFit::Gradient( double E, const double *par, double *grad ) const {
+	
+	unsigned int _npoly = _neffpars - 1;
+	double f = _model->Gradient( E, par, grad );
+	
+	for( unsigned int m = 0; m < _npoly; m++ )
+		grad[m] /= par[_npoly];
+	
+	return f / par[_npoly];
+	
+}
+
+int GlobalFitter::SetModel( const string &name ) {
+	
+	vector<string> names = EffModel::Names();
+	for( unsigned int i = 0; i < names.size(); i++ ) {
+		
+		if( names[i] == name ) {
 			
-			g = h * TMath::Power( TMath::Log( x[0] / _E0 ), (double)m );
-			g *= TMath::Power( TMath::Log( x[0] / _E0 ), (double)n );
-			g *= par[ m*_npoly + n ];
-			f += g;
+			modelname = name;
+			return 0;
 			
 		}
 		
 	}
 	
-	return TMath::Sqrt(f);
+	return 1;
+	
+}
+
+shared_ptr<const EffModel> GlobalFitter::CreateModel() const {
+	
+	return EffModel::Create( modelname, E0, TMath::Log( Estart / E0 ),
+							TMath::Log( Eend / E0 ), modelopt );
+	
+}
+
+int GlobalFitter::SetTemplate( const string &filename, unsigned int ncorr ) {
+	
+	if( ncorr < 1 ) {
+		
+		cerr << "A template needs at least its scale as a parameter\n";
+		return 1;
+		
+	}
+	
+	shared_ptr<SimTable> table = make_shared<SimTable>();
+	if( table->Read( filename ) ) return 1;
+	
+	modelname = "template";
+	modelopt.table = table;
+	modelopt.ncorr = ncorr;
+	templhash = FitCache::HashFile( filename );
+	
+	return 0;
+	
+}
+
+double GlobalFitter::BandedSystem( const double *p, BandMatrix *A, vector<double> *B,
+								  vector<double> *C, vector<double> *g ) const {
+	
+	double chisq = 0;
+	double b[4], db[4], J[4];
+	double f, dfdx, e2, sigma, r, Jn;
+	unsigned int k;
+	vector<double> q( neffpars );
+	
+	if( A ) {
+		
+		A->Resize( npoly, 3 );
+		B->assign( npoly * nsources, 0. );
+		C->assign( nsources, 0. );
+		g->assign( npars, 0. );
+		
+	}
+	
+	for( unsigned int i = 0; i < nsources; i++ ) {
+		
+		const EffSource &src = (*data)[i];
+		SourcePars( i, p, q.data() );
+		
+		// Efficiency data, each touches 4 coefficients and its normalisation
+		for( unsigned int j = 0; j < src.Size(); j++ ) {
+			
+			f = eff_func->Evaluate( src.E[j], q.data() );
+			e2 = src.deff[j] * src.deff[j];
+			
+			if( xerr_eff[i][j] != 0 ) {
+				
+				dfdx = eff_func->DerivE( src.E[j], q.data() ) * xerr_eff[i][j];
+				e2 += dfdx * dfdx;
+				
+			}
+			
+			if( e2 <= 0 ) continue;
+			
+			sigma = TMath::Sqrt( e2 );
+			r = ( src.eff[j] - f ) / sigma;
+			chisq += r * r;
+			
+			if( !A ) continue;
+			
+			k = spline->Basis( TMath::Log( src.E[j] / E0 ), b, db );
+			for( unsigned int m = 0; m < 4; m++ )
+				J[m] = -f * b[m] / sigma;
+			Jn = f / ( p[npoly+i] * sigma );
+			
+			for( unsigned int m = 0; m < 4; m++ ) {
+				
+				for( unsigned int n = 0; n <= m; n++ )
+					(*A)( k+m, k+n ) += J[m] * J[n];
+				
+				(*B)[(k+m)*nsources+i] += J[m] * Jn;
+				(*g)[k+m] += J[m] * r;
+				
+			}
+			
+			(*C)[i] += Jn * Jn;
+			(*g)[npoly+i] += Jn * r;
+			
+		}
+		
+		// Normalisation data
+		for( unsigned int j = 0; j < src.NormSize(); j++ ) {
+			
+			if( src.dnorm[j] == 0 ) continue;
+			
+			r = ( src.norm[j] - p[npoly+i] ) / src.dnorm[j];
+			chisq += r * r;
+			
+			if( !A ) continue;
+			
+			Jn = -1. / src.dnorm[j];
+			(*C)[i] += Jn * Jn;
+			(*g)[npoly+i] += Jn * r;
+			
+		}
+		
+	}
+	
+	// Penalty as extra residuals sqrt( lambda ) * ( c_k - 2 c_k-1 + c_k-2 )
+	chisq += Penalty( p );
+	
+	if( A ) {
+		
+		const double w[3] = { 1., -2., 1. };
+		for( k = 2; k < npoly; k++ ) {
+			
+			r = p[k] - 2. * p[k-1] + p[k-2];
+			for( unsigned int m = 0; m < 3; m++ ) {
+				
+				for( unsigned int n = 0; n <= m; n++ )
+					(*A)( k-2+m, k-2+n ) += lambda * w[m] * w[n];
+				
+				(*g)[k-2+m] += lambda * w[m] * r;
+				
+			}
+			
+		}
+		
+	}
+	
+	return chisq;
+	
+}
+
+int GlobalFitter::BandedFit( vector<double> &p ) {
+	
+	BandMatrix A, Ad;
+	vector<double> B, C, g, Z, S, dx, dy, trial;
+	bool fixnorm = FirstNormFixed();
+	double mu = 1e-3;
+	double chisq, chisq_new = 0;
+	unsigned int iter;
+	unsigned int naccepted = 0;
+	bool converged = false;
+	
+	vector<bool> fixed( nsources, false );
+	fixed[0] = fixnorm;
+	
+	chisq = BandedSystem( p.data(), &A, &B, &C, &g );
+	cout << "Banded spline fit, initial chisq = " << chisq << endl;
+	
+	for( iter = 0; iter < 200; iter++ ) {
+		
+		// Levenberg-Marquardt, increase the damping until the chi2 goes down
+		bool accepted = false;
+		while( mu < 1e10 ) {
+			
+			// Damped coefficient block, L L^T
+			Ad = A;
+			for( unsigned int k = 0; k < npoly; k++ )
+				Ad( k, k ) *= 1. + mu;
+			if( Ad.Decompose() ) {
+				
+				mu *= 10.;
+				continue;
+				
+			}
+			
+			// Z = A^-1 B, one banded solve per source
+			Z = B;
+			vector<double> col( npoly );
+			for( unsigned int i = 0; i < nsources; i++ ) {
+				
+				for( unsigned int k = 0; k < npoly; k++ )
+					col[k] = B[k*nsources+i];
+				Ad.Solve( col.data() );
+				for( unsigned int k = 0; k < npoly; k++ )
+					Z[k*nsources+i] = col[k];
+				
+			}
+			
+			// Schur complement of the normalisations, S = C - B^T A^-1 B
+			dx.assign( g.begin(), g.begin() + npoly );
+			Ad.Solve( dx.data() );
+			S.assign( nsources * nsources, 0. );
+			dy.assign( nsources, 0. );
+			for( unsigned int i = 0; i < nsources; i++ ) {
+				
+				S[i*nsources+i] = C[i] * ( 1. + mu );
+				dy[i] = -g[npoly+i];
+				for( unsigned int k = 0; k < npoly; k++ ) {
+					
+					dy[i] += B[k*nsources+i] * dx[k];
+					for( unsigned int l = 0; l < nsources; l++ )
+						S[i*nsources+l] -= B[k*nsources+i] * Z[k*nsources+l];
+					
+				}
+				
+			}
+			
+			if( CoreFitter::InvertSym( S, nsources, fixed ) ) {
+				
+				mu *= 10.;
+				continue;
+				
+			}
+			
+			// Normalisation step, then the coefficients x = -A^-1 g - Z y
+			vector<double> y( nsources, 0. );
+			for( unsigned int i = 0; i < nsources; i++ )
+				for( unsigned int l = 0; l < nsources; l++ )
+					y[i] += S[i*nsources+l] * dy[l];
+			
+			trial = p;
+			for( unsigned int k = 0; k < npoly; k++ ) {
+				
+				trial[k] -= dx[k];
+				for( unsigned int i = 0; i < nsources; i++ )
+					trial[k] -= Z[k*nsources+i] * y[i];
+				
+			}
+			
+			bool positive = true;
+			for( unsigned int i = 0; i < nsources; i++ ) {
+				
+				trial[npoly+i] += y[i];
+				if( trial[npoly+i] <= 0 ) positive = false;
+				
+			}
+			
+			chisq_new = positive ? BandedSystem( trial.data(), 0, 0, 0, 0 ) : chisq + 1.;
+			
+			if( chisq_new <= chisq ) {
+				
+				accepted = true;
+				mu = TMath::Max( mu * 0.1, 1e-12 );
+				break;
+				
+			}
+			
+			mu *= 10.;
+			
+		}
+		
+		// No step lowers the chi2 any more, i.e. at the minimum
+		// unless not even the first one did
+		if( !accepted ) {
+			
+			converged = ( naccepted > 0 );
+			break;
+			
+		}
+		
+		p = trial;
+		naccepted++;
+		converged = ( chisq - chisq_new <= 1e-9 * chisq + 1e-12 );
+		chisq = BandedSystem( p.data(), &A, &B, &C, &g );
+		
+		if( converged ) break;
+		
+	}
+	
+	cout << "Banded spline fit, chisq = " << chisq << " after " << iter << " iterations\n";
+	
+	if( naccepted == 0 ) return 1;
+	
+	return converged ? 0 : 2;
 	
 }
 
@@ -1,4 +1,9 @@
 // Fitter for the efficiency curves
+//
+// Independent GlobalFitter instances may run concurrently on separate
+// threads, provided ROOT::EnableThreadSafety() was called first. All ROOT
+// objects of an instance carry its unique id and none are added to the
+// global lists of gROOT. A single instance is not safe to share.
 
 #ifndef __GlobalFitter_hh__
 #define __GlobalFitter_hh__
@@ -8,6 +13,7 @@
 #include "Fit/Chi2FCN.h"
 #include "Math/WrappedMultiTF1.h"
 #include "Fit/FitResult.h"
+#include "Math/IFunction.h"
 #include "TF1.h"
 #include "TMath.h"
 
@@ -15,6 +21,35 @@
 #include "convert.hh"
 #endif
 
+#ifndef __Dual_hh__
+#include "Dual.hh"
+#endif
+
+#ifndef __EffModels_hh__
+#include "EffModels.hh"
+#endif
+
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+#ifndef __BandMatrix_hh__
+#include "BandMatrix.hh"
+#endif
+
+#ifndef __EffCore_hh__
+#include "EffCore.hh"
+#endif
+
+#ifndef __EffFitResult_hh__
+#include "EffFitResult.hh"
+#endif
+
+#ifndef __FitCache_hh__
+#include "FitCache.hh"
+#endif
+
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -29,39 +64,188 @@ public:
 		E0 = _E0;
 		Estart = Es;
 		Eend = Ee;
+		xthresh = 1e-4;
+		update_limit = 1.;
+		modelname = "poly";
+		spline = 0;
+		lambda = 1.;
+		templhash = 0;
+		cachehit = false;
+		id = NextId();
 		
 	};
-	virtual ~GlobalFitter(){;};
+	virtual ~GlobalFitter(){ Reset(); };
+	
+	// The fitter owns its functions, so it can't be copied
+	GlobalFitter( const GlobalFitter& ) = delete;
+	GlobalFitter& operator=( const GlobalFitter& ) = delete;
+	
+	// Free all data and functions, keeping E0 and the range,
+	// so that the same instance can be used for another fit
+	void Reset();
 	
-	void CopyData( vector< vector<double> > _x,
-				  vector< vector<double> > _xerr,
-				  vector< vector<double> > _y,
-				  vector< vector<double> > _yerr,
-				  vector< vector<double> > _norms,
-				  vector< vector<double> > _normserr );
+	// Share the data read by FitEff, nothing is copied
+	void SetData( EffDataPtr _data );
 	
 	void BinData();
-	void SetParameters( vector<double> _par, vector<string> _parname );
-	void CreateIndividualFits();
+	
+	// Energy errors only count where ( dE * deff/dE )^2 exceeds
+	// xthresh * deff^2, all other points use the value-error chi2
+	inline void SetCoordErrorThreshold( double t ){
+		xthresh = t;
+		core.SetCoordErrorThreshold( t );
+	};
+	bool ClassifyCoordErrors( const double *p );
+	// With warm = true the normalisations are taken as given too,
+	// e.g. from a previous result, instead of from the data
+	// Returns 0 on success and 1 if the number of coefficients is not
+	// that of the model, which is then not fitted
+	int SetParameters( vector<double> _par, vector<string> _parname, bool warm = false );
+	int CreateIndividualFits();
+	
+	// Efficiency model by name, see EffModels.hh, default "poly".
+	// Returns 0 on success and 1 for an unknown model.
+	int SetModel( const string &name );
+	inline const string& GetModelName() const { return modelname; };
+	inline double GetE0() const { return E0; };
+	
+	// The model for the current settings, e.g. for its starting values
+	// and parameter names. The parameters given to SetParameters() are
+	// its coefficients followed by the normalisations.
+	shared_ptr<const EffModel> CreateModel() const;
+	
+	// Model the log of the efficiency with a cubic B-spline in log( E / E0 ).
+	// The nknots interior knots are uniform over the range, giving nknots + 4
+	// coefficients, and the curvature is penalised by lambda times the sum of
+	// squared second differences of coefficients. The spline is solved with
+	// banded normal equations before the final Minuit fit, which then starts
+	// at the minimum.
+	inline void SetSpline( unsigned int _nknots, double _lambda ){
+		modelname = "bspline";
+		modelopt.nknots = _nknots;
+		lambda = _lambda;
+	};
+	
+	// Scale a simulated efficiency curve, e.g. from GEANT4, read once from
+	// a table of E (keV) | eff, with a correction in log( E / E0 ) of order
+	// ncorr - 1. The fit has only the ncorr terms, the first being the log
+	// of the scale, and the normalisations. Returns 0 on success.
+	int SetTemplate( const string &filename, unsigned int ncorr );
 
 	inline unsigned long GetDataSize(){ return data_size; };
 	
+	// Unique to each instance, used to name its ROOT objects
+	inline unsigned int GetId() const { return id; };
+	static unsigned int NextId();
+	
+	// The curves remain owned by the fitter, valid until Reset()
 	TF1* GetEffCurve( vector<double> _par );
 	TF1* GetErrCurve( vector<double> _par );
 	
-	ROOT::Fit::FitResult GetFitResult();
+	EffFitResult GetFitResult();
+	
+	// Look results up in a cache before fitting and store new ones,
+	// which may be shared by many fitters. Kept by Reset().
+	inline void SetCache( shared_ptr<FitCache> _cache ){ cache = _cache; };
+	inline shared_ptr<FitCache> GetCache() const { return cache; };
+	
+	// Did the last GetFitResult() come from the cache, and its key,
+	// all settings of the fit and a hash of the data
+	inline bool CacheHit() const { return cachehit; };
+	string CacheKey() const;
+	
+	// Normalised residuals r_k = ( y_k - f_k ) / sigma_k of all data points,
+	// efficiency points first then normalisations, in the order of the sources,
+	// and their exact Jacobian dr_k/dp_j stored row-major with npars columns,
+	// both from the core, so that the effective variance is differentiated too.
+	void Jacobian( const double* p, vector<double> &res, vector<double> &jac );
+	
+	// Linearised solution around the fitted parameters, kept up to date
+	// when single efficiency points are added or removed
+	struct FitSolution {
+		
+		vector<double> par;		// parameters
+		vector<double> cov;		// covariance ( J^T J )^-1, npars x npars
+		double chisq;
+		unsigned int ndf;
+		unsigned int nupdates;	// rank-1 updates since the last full fit
+		bool refitted;			// the last change needed a full fit
+		
+	};
+	
+	// Start the updates from converged parameters, e.g. of GetFitResult().
+	// Needs the exact derivatives, i.e. at most kMaxEffPars parameters.
+	int InitSolution( const vector<double> &p );
+	
+	// Add a point to source i, or remove its point j, and update the
+	// solution and covariance with a rank-1 (Sherman-Morrison) update.
+	// If the parameters would move by more than the update limit, in
+	// standard deviations, the problem is refitted instead.
+	// Both return 0 on success and 1 on an error.
+	int AddPoint( unsigned int i, double E, double dE, double eff, double deff );
+	int RemovePoint( unsigned int i, unsigned int j );
+	inline void SetUpdateLimit( double m ){ update_limit = m; };
+	inline const FitSolution& GetSolution() const { return sol; };
+	
+	// The current data, including any added or removed points
+	inline EffDataPtr GetData() const { return data; };
+	
+	// Effect of leaving out a single efficiency or normalisation point
+	struct PointInfluence {
+		
+		unsigned int source;
+		unsigned int index;		// within the efficiency or normalisation data
+		bool norm;				// a normalisation point
+		double res;				// normalised residual
+		double leverage;		// h = a^T C a
+		double student;			// studentised residual
+		double cook;			// Cook's distance
+		double shift;			// parameter shift in standard deviations
+		double curve;			// largest relative change of the curve
+		vector<double> dpar;	// parameter shifts
+		bool outlier;			// |student| > 3
+		bool influential;		// cook > 4 / number of points
+		
+	};
+	
+	// Effect of leaving out a whole source
+	struct SourceInfluence {
+		
+		unsigned int source;
+		unsigned int npoints;
+		double dchisq;			// change of chi2 of the other sources
+		double shift;			// parameter shift in standard deviations
+		double curve;			// largest relative change of the curve
+		vector<double> dpar;	// parameter shifts
+		bool determined;		// false if the rest can't fix the parameters
+		
+	};
+	
+	// Leave-one-point-out and leave-one-source-out diagnostics around the
+	// solution of InitSolution(). The shifts come from downdates of the
+	// normal equations, followed by nsteps Gauss-Newton steps for whole
+	// sources and for outlying or influential points. Returns 0 on success.
+	int Jackknife( vector<PointInfluence> &pts, vector<SourceInfluence> &srcs,
+				  unsigned int nsteps = 3 );
+	
+	// Maximum number of efficiency parameters for the derivative-based fit
+	static const unsigned int kMaxEffPars = kMaxModelPars;
+	
+	// Version of the fit procedure, part of the cache key. Raise it when
+	// a change of the minimisation can change results, so that results
+	// cached before are not used.
+	static const unsigned int kFitVersion = 3;
+	typedef ModelDual DualPar;
 	
 private:
 	
-	// Vectors for holding in data
-	vector< vector<double> > y;
-	vector< vector<double> > x;
-	vector< vector<double> > yerr;
-	vector< vector<double> > xerr;
+	// Data of all sources, shared and never modified
+	EffDataPtr data;
 	
-	// Data for normalisation
-	vector< vector<double> > norms;
-	vector< vector<double> > normserr;
+	// Energy errors that are significant, zero otherwise
+	vector< vector<double> > xerr_eff;
+	vector<bool> coord_err;
+	double xthresh;
 	
 	// Binned data
 	ROOT::Fit::DataOptions opt;
@@ -78,29 +262,32 @@ private:
 	unsigned int neffpars;
 	unsigned int npoly;
 
+	// Instance number
+	unsigned int id;
+	
 	// Default variables
 	double E0;
 	int Estart;
 	int Eend;
 	
 	// Fit functions
-	TF1 *fEff, *fErr;
+	unique_ptr< TF1 > fEff, fErr;
 	vector< shared_ptr< TF1 > > fEffi;
 	vector< shared_ptr< TF1 > > fNorm;
 	vector< shared_ptr< ROOT::Math::WrappedMultiTF1 > > wEffi;
 	vector< shared_ptr< ROOT::Math::WrappedMultiTF1 > > wNorm;
-	vector< ROOT::Fit::Chi2Function* > effi_fcn;
-	vector< ROOT::Fit::Chi2Function* > norm_fcn;
+	vector< unique_ptr< ROOT::Fit::Chi2Function > > effi_fcn;
+	vector< unique_ptr< ROOT::Fit::Chi2Function > > norm_fcn;
 
 	struct Chi2Fit {
 		
-		Chi2Fit( vector< ROOT::Fit::Chi2Function* > & effi_inp,
-				vector< ROOT::Fit::Chi2Function* > & norm_inp,
-				unsigned int _nsources, unsigned int _npars ) {
+		Chi2Fit( const vector< unique_ptr< ROOT::Fit::Chi2Function > > & effi_inp,
+				const vector< unique_ptr< ROOT::Fit::Chi2Function > > & norm_inp,
+				unsigned int _nsources, unsigned int _npars, const GlobalFitter *_gf ) {
 			
 			for( unsigned int i = 0; i < effi_inp.size(); i++ ) {
 
-				effi_vec.push_back( effi_inp[i] );
+				effi_vec.push_back( effi_inp[i].get() );
 				cout << "source #" << i << " has " << effi_vec[i]->NPoints();
 				cout << " efficiency data points and " << effi_vec[i]->NDim();
 				cout << " free parameters\n";
@@ -109,7 +296,7 @@ private:
 			
 			for( unsigned int i = 0; i < norm_inp.size(); i++ ) {
 				
-				norm_vec.push_back( norm_inp[i] );
+				norm_vec.push_back( norm_inp[i].get() );
 				cout << "source #" << i << " has " << norm_vec[i]->NPoints();
 				cout << " normalisation data points\n";
 
@@ -117,6 +304,7 @@ private:
 			
 			nsources = _nsources;
 			npars = _npars;
+			gf = _gf;
 			
 		}
 		
@@ -154,6 +342,9 @@ private:
 			for( unsigned int i = 0; i < norm_vec.size(); i++ )
 				chisq += ( *norm_vec[i] )( pn[i].data() );
 			
+			// Smoothness of a spline
+			chisq += gf->Penalty( p );
+			
 			return chisq;
 			
 		};
@@ -167,24 +358,41 @@ private:
 		unsigned int npars;
 		unsigned int npoly;
 		double chisq;
+		const GlobalFitter *gf;
 
 	};
 		
-	// Function classes
+	// Function classes, the efficiency of a source is the
+	// model divided by the normalisation of that source
 	class ExpFit {
 		
 	public:
 		
-		ExpFit( double _E0_, unsigned int _neffpars_ ){
-			_E0 = _E0_;
+		ExpFit( shared_ptr<const EffModel> _model_, unsigned int _neffpars_ ){
+			_model = _model_;
 			_neffpars = _neffpars_;
 		};
-		double operator()( double *x, double *par );
+		double operator()( double *x, double *par ){
+			return Evaluate( x[0], par );
+		};
 		double Eval( double *x, double *par ){ return (*this)( x, par ); };
+		
+		// Written once for plain and dual numbers
+		template< typename T >
+		T Evaluate( double E, const T *par ) const;
+		
+		// Analytic derivative with respect to the energy
+		template< typename T >
+		T DerivE( double E, const T *par ) const;
+		
+		// Efficiency and its gradient in the model coefficients
+		double Gradient( double E, const double *par, double *grad ) const;
+		
+		inline const EffModel& Model() const { return *_model; };
 
 	private:
 		
-		double _E0;
+		shared_ptr<const EffModel> _model;
 		unsigned int _neffpars;
 
 	};
@@ -193,8 +401,7 @@ private:
 		
 	public:
 		
-		ExpFitErr( double _E0_, unsigned int _neffpars_ ){
-			_E0 = _E0_;
+		ExpFitErr( const ExpFit &_fit_, unsigned int _neffpars_ ) : _fit(_fit_) {
 			_neffpars = _neffpars_;
 		};
 		double operator()( double *x, double *par );
@@ -202,7 +409,7 @@ private:
 
 	private:
 		
-		double _E0;
+		ExpFit _fit;
 		unsigned int _neffpars;
 		
 	};
@@ -217,10 +424,140 @@ private:
 		
 	};
 	
+	// Global chi2 of the core with its exact gradient from automatic
+	// differentiation. The same quantity as Chi2Fit, i.e. effective
+	// variance for the efficiency data and plain chi2 for the normalisations.
+	class Chi2Grad : public ROOT::Math::IMultiGradFunction {
+		
+	public:
+		
+		Chi2Grad( const GlobalFitter &_gf ) : gf(_gf) {;};
+		
+		ROOT::Math::IMultiGenFunction* Clone() const { return new Chi2Grad( gf ); };
+		unsigned int NDim() const { return gf.npars; };
+		
+		void Gradient( const double *p, double *grad ) const { Evaluate( p, grad ); };
+		void FdF( const double *p, double &f, double *grad ) const { f = Evaluate( p, grad ); };
+		
+		double Evaluate( const double *p, double *grad ) const { return gf.core.Chi2( p, grad ); };
+
+	private:
+		
+		double DoEval( const double *p ) const { return Evaluate( p, 0 ); };
+		double DoDerivative( const double *p, unsigned int i ) const;
+		
+		const GlobalFitter &gf;
+		
+	};
+	
+	// Efficiency parameters of source i, i.e. polynomial + its normalisation
+	void SourcePars( unsigned int i, const double *p, double *q ) const;
+	
+	// Chi2, residuals, energy error classification and the native
+	// fit, which the methods of this class adapt
+	CoreFitter core;
+	
+	// Efficiency model, and the spline if it is one
+	string modelname;
+	shared_ptr<const EffModel> model;
+	const SplineModel *spline;
+	
+	// Knots of a spline, the table of a template, and the penalty of
+	// a spline, which is zero for other models
+	ModelOptions modelopt;
+	double lambda;
+	uint64_t templhash;
+	
+	// Results of earlier fits
+	shared_ptr<FitCache> cache;
+	bool cachehit;
+	template< typename T >
+	T Penalty( const T *c ) const;
+	
+	// Penalised chi2 of the spline model at p and, unless A is null, the
+	// normal equations of a Gauss-Newton step. A holds the band of the
+	// coefficients, B their coupling to the normalisations (npoly x nsources),
+	// C the diagonal of the normalisations and g the gradient J^T r.
+	double BandedSystem( const double *p, BandMatrix *A, vector<double> *B,
+						vector<double> *C, vector<double> *g ) const;
+	
+	// Levenberg-Marquardt fit of the spline model with banded normal
+	// equations, O(n) in the number of coefficients. Returns 0 when it
+	// converged, 2 at the iteration limit with p at the best point, and
+	// 1 if no step lowered the chi2, leaving p as it was.
+	int BandedFit( vector<double> &p );
+	
+	// Result of a converged native fit, as Minuit's would be
+	EffFitResult CoreFitResult( const CoreResult &res ) const;
+	
+	// New binned data and chi2 functions after the data changed
+	void RebindData();
+	
+	// Is the first normalisation fixed in the fit?
+	inline bool FirstNormFixed() const { return core.FirstNormFixed(); };
+	
+	// Replace source i, keeping the other sources shared
+	void ChangeSource( unsigned int i, EffSource &&src );
+	
+	// Rank-1 update with sign +1 to add and -1 to remove a point
+	int UpdateSolution( double r, const vector<double> &a, double sign );
+	
+	// Full fit starting from the current solution
+	int Refit();
+	
+	// Gauss-Newton steps from p without the rows in skip, the parameters
+	// in fixed are held constant. Returns 0 on success and the chi2 at p.
+	int NewtonSteps( vector<double> &p, const vector<bool> &skip,
+					const vector<bool> &fixed, unsigned int nsteps, double &chisq );
+	
+	// Largest relative change of the efficiency curve in the
+	// fit range when the parameters p are shifted by dp
+	double CurveChange( const vector<double> &p, const vector<double> &dp ) const;
+	
+	// Incremental updates
+	FitSolution sol;
+	double update_limit;
+	
+	// Use the gradient unless there are too many parameters
+	bool use_gradient;
+	
 	// Function classes
-	ExpFit *eff_func;
-	ExpFitErr *err_func;
-	NormFunc *norm_func;
+	unique_ptr< ExpFit > eff_func;
+	unique_ptr< ExpFitErr > err_func;
+	unique_ptr< NormFunc > norm_func;
 	
 };
+
+template< typename T >
+T GlobalFitter::ExpFit::Evaluate( double E, const T *par ) const {
+	
+	return _model->Value( E, par ) / par[_neffpars-1];
+	
+}
+
+template< typename T >
+T GlobalFitter::ExpFit::DerivE( double E, const T *par ) const {
+	
+	return _model->DerivE( E, par ) / par[_neffpars-1];
+	
+}
+
+template< typename T >
+T GlobalFitter::Penalty( const T *c ) const {
+	
+	T pen = 0.;
+	if( !spline ) return pen;
+	
+	T d;
+	for( unsigned int k = 2; k < npoly; k++ ) {
+		
+		d = c[k] - 2. * c[k-1] + c[k-2];
+		pen += d * d;
+		
+	}
+	
+	return lambda * pen;
+	
+}
+
 #endif
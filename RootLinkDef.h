@@ -4,5 +4,6 @@
 #pragma link off all functions;
 #pragma link C++ class GlobalFitter+;
 #pragma link C++ class FitEff+;
+#pragma link C++ class EffFitResult+;
 #pragma link C++ nestedclass;
 #endif
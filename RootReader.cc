@@ -0,0 +1,177 @@
+// Reader for efficiency and normalisation data stored in ROOT files
+
+#ifndef __RootReader_cc__
+#define __RootReader_cc__
+
+#ifndef __RootReader_hh__
+#include "RootReader.hh"
+#endif
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TObjArray.h"
+#include "TVirtualTreePlayer.h"
+#include "TGraph.h"
+#include "TGraphErrors.h"
+
+#include <iostream>
+#include <memory>
+
+bool RootReader::IsRootSpec( const string &spec ) {
+
+	return spec.find( ".root:" ) != string::npos;
+
+}
+
+string RootReader::FileName( const string &spec ) {
+
+	size_t pos = spec.find( ".root:" );
+	if( pos == string::npos ) return spec;
+
+	return spec.substr( 0, pos + 5 );
+
+}
+
+int RootReader::Read( const string &spec, unsigned int ncols,
+					 vector<double> *cols[] ) {
+
+	// Split into file, object and optional columns
+	size_t pos = spec.find( ".root:" ) + 5;
+	string filename = spec.substr( 0, pos );
+	string objname = spec.substr( pos + 1 );
+	string varexp;
+
+	pos = objname.find( ":" );
+	if( pos != string::npos ) {
+
+		varexp = objname.substr( pos + 1 );
+		objname = objname.substr( 0, pos );
+
+	}
+
+	unique_ptr<TFile> file( TFile::Open( filename.c_str(), "READ" ) );
+	if( !file || file->IsZombie() ) {
+
+		cerr << "Could not open " << filename << endl;
+		return 1;
+
+	}
+
+	TObject *obj = file->Get( objname.c_str() );
+	if( !obj ) {
+
+		cerr << "Could not find " << objname << " in " << filename << endl;
+		return 1;
+
+	}
+
+	// Graphs, errors are zero for a plain TGraph
+	if( TGraph *g = dynamic_cast<TGraph*>( obj ) ) {
+
+		// Unlike trees, graphs read from a file belong to us
+		unique_ptr<TGraph> owner( g );
+		unsigned int n = g->GetN();
+		const double *gx = g->GetX();
+		const double *gy = g->GetY();
+		const double *gex = g->GetEX();
+		const double *gey = g->GetEY();
+		const double *src[4];
+
+		if( ncols == 4 ) {
+
+			src[0] = gx;
+			src[1] = gex;
+			src[2] = gy;
+			src[3] = gey;
+
+		}
+
+		else if( ncols == 2 ) {
+
+			src[0] = gy;
+			src[1] = gey;
+
+		}
+
+		else {
+
+			cerr << "Can't take " << ncols << " columns from graph " << objname << endl;
+			return 1;
+
+		}
+
+		for( unsigned int j = 0; j < ncols; j++ ) {
+
+			if( src[j] ) cols[j]->insert( cols[j]->end(), src[j], src[j] + n );
+			else cols[j]->resize( cols[j]->size() + n, 0. );
+
+		}
+
+		cout << "Read " << n << " points from graph " << objname;
+		cout << " in " << filename << endl;
+
+		return 0;
+
+	}
+
+	// Trees and ntuples, all columns in one pass over the entries
+	if( TTree *t = dynamic_cast<TTree*>( obj ) ) {
+
+		if( varexp.empty() ) {
+
+			TObjArray *leaves = t->GetListOfLeaves();
+			if( (unsigned int)leaves->GetEntries() < ncols ) {
+
+				cerr << "Tree " << objname << " has fewer than " << ncols << " leaves\n";
+				return 1;
+
+			}
+
+			for( unsigned int j = 0; j < ncols; j++ ) {
+
+				if( j ) varexp += ":";
+				varexp += leaves->At(j)->GetName();
+
+			}
+
+		}
+
+		t->SetEstimate( t->GetEntries() + 1 );
+		Long64_t n = t->Draw( varexp.c_str(), "", "goff" );
+
+		if( n < 0 ) {
+
+			cerr << "Could not read " << varexp << " from tree " << objname << endl;
+			return 1;
+
+		}
+
+		if( t->GetPlayer()->GetDimension() != (int)ncols ) {
+
+			cerr << "Tree " << objname << " needs " << ncols;
+			cerr << " columns, got " << varexp << endl;
+			return 1;
+
+		}
+
+		for( unsigned int j = 0; j < ncols; j++ ) {
+
+			const double *v = t->GetVal(j);
+			cols[j]->insert( cols[j]->end(), v, v + n );
+
+		}
+
+		cout << "Read " << n << " entries of " << varexp << " from tree ";
+		cout << objname << " in " << filename << endl;
+
+		return 0;
+
+	}
+
+	cerr << objname << " in " << filename << " is neither a graph nor a tree\n";
+
+	return 1;
+
+}
+#endif
@@ -0,0 +1,36 @@
+// Reader for efficiency and normalisation data stored in ROOT files,
+// given in place of a text file as <file.root>:<object>
+//
+//   file.root:graph              TGraphErrors (or TGraph), the columns are
+//                                x, ex, y, ey for efficiencies and y, ey
+//                                for normalisations
+//   file.root:tree               TTree or TNtuple, the columns are its
+//                                first leaves in order
+//   file.root:tree:E:dE:eff:deff TTree with the columns given explicitly,
+//                                each may be any TTree::Draw expression
+
+#ifndef __RootReader_hh__
+#define __RootReader_hh__
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class RootReader {
+
+public:
+
+	// Does a file name refer to an object in a ROOT file?
+	static bool IsRootSpec( const string &spec );
+
+	// The file part of a spec, or the spec itself if it is not one
+	static string FileName( const string &spec );
+
+	// Fill ncols columns from the object, returns 0 on success
+	static int Read( const string &spec, unsigned int ncols,
+					vector<double> *cols[] );
+
+};
+
+#endif
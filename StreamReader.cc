@@ -0,0 +1,190 @@
+// Incremental reader for many sources framed in one stream
+
+#ifndef __StreamReader_cc__
+#define __StreamReader_cc__
+
+#ifndef __StreamReader_hh__
+#include "StreamReader.hh"
+#endif
+
+#ifndef __DataReader_hh__
+#include "DataReader.hh"
+#endif
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
+
+void StreamReader::NewSource( const string &label ) {
+
+	data.Resize( data.Size() + 1 );
+	labels.push_back( label );
+	innorm = false;
+
+	return;
+
+}
+
+void StreamReader::Line( const char *begin, const char *end ) {
+
+	lineno++;
+
+	// Take CRLF as well
+	if( end > begin && *(end-1) == '\r' ) end--;
+
+	if( begin == end || *begin == '#' ) return;
+
+	// Markers
+	if( *begin == '@' ) {
+
+		const char *p = begin + 1;
+		const char *q = p;
+		while( q < end && !isspace( (unsigned char)*q ) ) q++;
+		string marker( p, q );
+		while( q < end && isspace( (unsigned char)*q ) ) q++;
+
+		if( marker == "source" ) NewSource( string( q, end ) );
+
+		else if( marker == "norm" ) {
+
+			if( data.Size() == 0 ) NewSource( "" );
+			innorm = true;
+
+		}
+
+		else if( marker == "end" ) ended = true;
+
+		else {
+
+			cerr << name << ":" << lineno << ": unknown marker @";
+			cerr << marker << ", line ignored\n";
+			bad++;
+
+		}
+
+		return;
+
+	}
+
+	// Data, for an implicit first source if not framed
+	double val[4];
+	unsigned int ncols = innorm ? 2 : 4;
+	const char *stop;
+	unsigned int n = DataReader::ParseLine( begin, end, ncols, val, &stop );
+
+	if( n == ncols ) {
+
+		if( data.Size() == 0 ) NewSource( "" );
+		EffSource &src = data[data.Size()-1];
+
+		if( innorm ) {
+
+			src.norm.push_back( val[0] );
+			src.dnorm.push_back( val[1] );
+
+		}
+
+		else {
+
+			src.E.push_back( val[0] );
+			src.dE.push_back( val[1] );
+			src.eff.push_back( val[2] );
+			src.deff.push_back( val[3] );
+
+		}
+
+		return;
+
+	}
+
+	// Blank lines are fine
+	while( stop < end && isspace( (unsigned char)*stop ) ) stop++;
+	if( n > 0 || stop < end ) {
+
+		cerr << name << ":" << lineno << ": expected " << ncols;
+		cerr << " numbers but found " << n << ", line ignored\n";
+		bad++;
+
+	}
+
+	return;
+
+}
+
+void StreamReader::Feed( const char *p, unsigned long n ) {
+
+	const char *end = p + n;
+	const char *eol;
+
+	while( !ended && p < end ) {
+
+		eol = (const char*)memchr( p, '\n', end - p );
+
+		// Keep an incomplete line for the next block
+		if( !eol ) {
+
+			partial.append( p, end );
+			return;
+
+		}
+
+		if( partial.empty() ) Line( p, eol );
+
+		else {
+
+			partial.append( p, eol );
+			Line( partial.data(), partial.data() + partial.size() );
+			partial.clear();
+
+		}
+
+		p = eol + 1;
+
+	}
+
+	return;
+
+}
+
+void StreamReader::Finish() {
+
+	if( !ended && !partial.empty() )
+		Line( partial.data(), partial.data() + partial.size() );
+
+	partial.clear();
+
+	return;
+
+}
+
+int StreamReader::ReadFd( int fd ) {
+
+	char block[1<<16];
+	ssize_t n;
+
+	while( !ended ) {
+
+		n = read( fd, block, sizeof(block) );
+
+		if( n == 0 ) break;
+
+		if( n < 0 ) {
+
+			if( errno == EINTR ) continue;
+			return 1;
+
+		}
+
+		Feed( block, n );
+
+	}
+
+	Finish();
+
+	return 0;
+
+}
+#endif
@@ -0,0 +1,70 @@
+// Incremental reader for many sources framed in one stream, so that
+// data can be piped into geff with -e - instead of written to files.
+//
+//   @source [label]    starts a new source, followed by efficiency lines
+//                      E | dE | eff | deff
+//   @norm              normalisation lines of the current source follow
+//                      norm | dnorm
+//   @end               ends the stream, anything after it is not read
+//
+// Lines starting with '#' are comments. A stream without any @source
+// is a single source, i.e. a plain efficiency file can be piped as is.
+
+#ifndef __StreamReader_hh__
+#define __StreamReader_hh__
+
+#include <string>
+
+#ifndef __EffData_hh__
+#include "EffData.hh"
+#endif
+
+using namespace std;
+
+class StreamReader {
+
+public:
+
+	StreamReader( const string &_name = "<stdin>" ){
+		name = _name;
+		innorm = false;
+		ended = false;
+		lineno = 0;
+		bad = 0;
+	};
+
+	// Parse all complete lines, keeping a partial last line for later
+	void Feed( const char *p, unsigned long n );
+
+	// Parse whatever is left once the stream has ended
+	void Finish();
+
+	// Read a file descriptor until its end or @end, parsing each block
+	// as it arrives. Returns 0 on success and 1 on a read error.
+	int ReadFd( int fd );
+
+	inline bool Ended() const { return ended; };
+	inline unsigned int NSources() const { return data.Size(); };
+	inline unsigned int NBad() const { return bad; };
+	inline const vector<string>& Labels() const { return labels; };
+
+	// Hand over the sources once finished
+	inline EffData Take(){ return std::move( data ); };
+
+private:
+
+	void Line( const char *begin, const char *end );
+	void NewSource( const string &label );
+
+	string name;
+	string partial;
+	EffData data;
+	vector<string> labels;
+	bool innorm;
+	bool ended;
+	unsigned long lineno;
+	unsigned int bad;
+
+};
+
+#endif
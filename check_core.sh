@@ -0,0 +1,52 @@
+#!/bin/sh
+# Fit the example data with geff and with geff-core and compare the
+# fitted curves: every coefficient must agree to within a small part
+# of its error and the normalisation to within a relative tolerance.
+# Run by make check, from the directory of the Makefile.
+
+GEFF=${GEFF:-./geff}
+GEFFCORE=${GEFFCORE:-./geff-core}
+TOL=${TOL:-0.01}
+
+DATA="-e example/EffValues_Eu.dat -n example/NormValues_Eu.dat -e example/EffValues_Ba.dat -r 40:4000"
+TMP=${TMPDIR:-/tmp}/geff-check.$$
+mkdir -p $TMP || exit 1
+trap 'rm -rf $TMP' EXIT
+
+rc=0
+for model in poly radware debertin grayahmad bspline; do
+
+	if ! $GEFF $DATA -m $model --no-plot --curve=$TMP/geff.geff > $TMP/geff.log 2>&1; then
+		echo "$model: geff failed, see below"; cat $TMP/geff.log; rc=1; continue
+	fi
+
+	if ! $GEFFCORE $DATA -m $model --curve=$TMP/core.geff > $TMP/core.log 2>&1; then
+		echo "$model: geff-core failed, see below"; cat $TMP/core.log; rc=1; continue
+	fi
+
+	# Differences in units of the error of geff, from the diagonal of cov
+	if awk -v tol=$TOL -v model=$model '
+		FNR == NR && $1 == "par" { for( i = 2; i <= NF; i++ ) a[i-1] = $i; n = NF - 1 }
+		FNR == NR && $1 == "norm" { na = $2 }
+		FNR == NR && $1 == "cov" { k++; e[k] = sqrt( $(k+1) ) }
+		FNR != NR && $1 == "par" { for( i = 2; i <= NF; i++ ) b[i-1] = $i; m = NF - 1 }
+		FNR != NR && $1 == "norm" { nb = $2 }
+		END {
+			if( n == 0 || n != m ) { print model ": different number of coefficients"; exit 1 }
+			bad = 0
+			for( i = 1; i <= n; i++ ) {
+				d = a[i] - b[i]; if( d < 0 ) d = -d
+				if( d > tol * e[i] ) { printf "%s: coefficient %d, %g and %g\n", model, i, a[i], b[i]; bad = 1 }
+			}
+			d = na - nb; if( d < 0 ) d = -d
+			if( d > tol * 1e-2 * na ) { printf "%s: normalisation, %g and %g\n", model, na, nb; bad = 1 }
+			exit bad
+		}' $TMP/geff.geff $TMP/core.geff; then
+		echo "$model: geff and geff-core agree"
+	else
+		rc=1
+	fi
+
+done
+
+exit $rc
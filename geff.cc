@@ -19,12 +19,63 @@
 #include "GlobalFitter.hh"
 #endif
 
+#ifndef __EffCache_hh__
+#include "EffCache.hh"
+#endif
+
+#ifndef __RootReader_hh__
+#include "RootReader.hh"
+#endif
+
+#ifndef __FileWatcher_hh__
+#include "FileWatcher.hh"
+#endif
+
+#ifndef __FitCache_hh__
+#include "FitCache.hh"
+#endif
+
+#include "TROOT.h"
+
+#include <algorithm>
+#include <cstdlib>
 #include <sstream>
 #include <string>
 #include <iostream>
 
+#include <sys/stat.h>
+
 using namespace std;
 
+// Draw the results, or only print them without plots, or with
+// --keep-plot when the fit came from the cache and the plot is
+// newer than the cached result
+void ShowResults( FitEff &fe, GlobalFitter &gf, const string &outputfile,
+				 bool noplot, bool keepplot ) {
+	
+	if( !noplot && keepplot && gf.CacheHit() ) {
+		
+		struct stat st;
+		int64_t entrytime = gf.GetCache()->EntryTime( gf.CacheKey() );
+		if( stat( outputfile.c_str(), &st ) == 0 &&
+		    (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec > entrytime ) {
+			
+			cout << outputfile << " is up to date, not drawn again\n";
+			noplot = true;
+			
+		}
+		
+	}
+	
+	if( noplot ) fe.PrintResults();
+	else fe.DrawResults( outputfile );
+	
+	if( gf.GetCache() ) gf.GetCache()->PrintStats( cout );
+	
+	return;
+	
+}
+
 void PrintUsage( char* progname ) {
 	
 	cout << "\nUsage: \n" << progname;
@@ -35,7 +86,17 @@ void PrintUsage( char* progname ) {
 	cout << "\n normX.dat is the file containing experimentally determined\n";
 	cout << " normalisation constants from arbitrary units to absolute %\n";
 	cout << " for source number X. The format is 2 columns:\n";
-	cout << "  Normalisation (%/arb.) | Error (%/arb.)\n\n";
+	cout << "  Normalisation (%/arb.) | Error (%/arb.)\n";
+	cout << "\n Instead of a text file, data can be read from a ROOT file with\n";
+	cout << " <file.root>:<graph> for a TGraphErrors, using x, ex, y, ey, or\n";
+	cout << " y, ey for normalisations, and <file.root>:<tree> for a TTree or\n";
+	cout << " TNtuple, using its first leaves. Other columns can be chosen with\n";
+	cout << " <file.root>:<tree>:<col1>:<col2>:... as in TTree::Draw.\n";
+	cout << "\n With -e - all sources are read from standard input, as one\n";
+	cout << " efficiency file or framed by lines with markers:\n";
+	cout << "  @source [label]   a new source, efficiency lines follow\n";
+	cout << "  @norm             normalisation lines of this source follow\n";
+	cout << "  @end              end of the input\n\n";
 	cout << " The efficiency curve is determined by a simultaneous fit to all\n";
 	cout << " experimental data. In the case that no normalisation data are\n";
 	cout << " given at all, then it is assumed to be equal to 1 for the first\n";
@@ -48,6 +109,53 @@ void PrintUsage( char* progname ) {
 	cout << " dummy filename, i.e it doesn't have to exist. However, the\n";
 	cout << " ordering of the sources under -n must match those under -e.\n";
 	cout << " \nYou can also set the fitting and plot range with -r <low>:<upp>\n";
+	cout << "\n By default the log of the efficiency is a polynomial in log(E/E0).\n";
+	cout << " With -m bspline it is a cubic B-spline instead, with --knots knots\n";
+	cout << " spread evenly in log(E) over the range and a penalty --lambda on\n";
+	cout << " its curvature. This follows edges and the low-energy turnover in\n";
+	cout << " one fit over the full range.\n";
+	cout << " The standard HPGe forms are also available with -m <model>:\n";
+	cout << "  radware    ln(1e4 eff) = [ (A+Bx+Cx^2)^-G + (D+Ey+Fy^2)^-G ]^(-1/G)\n";
+	cout << "             x = ln(E/100 keV), y = ln(E/1000 keV), as in effit\n";
+	cout << "  debertin   ln(eff) = a_0 + a_1 ln(E/E0) + a_2 (E0/E) + ... + a_4 (E0/E)^3\n";
+	cout << "  grayahmad  eff = (E0/E) ( a + b L + c L^2 + d L^4 + e L^5 ), L = ln(E/E0)\n";
+	cout << "  template   ln(eff) = ln S(E) + c_0 + c_1 L + ..., with S a simulated\n";
+	cout << "             curve, e.g. from GEANT4, read from --template <E|eff file>\n";
+	cout << "             and --ncorr terms c_k (default 3)\n";
+	cout << "\n With --no-plot, no canvas is made and ROOT runs in batch mode,\n";
+	cout << " e.g. on farm nodes. The fit result and all other outputs are\n";
+	cout << " still written.\n";
+	cout << "\n With --cache, fit results are kept in a directory, by default\n";
+	cout << " ~/.cache/geff, under a hash of the data and all fit settings.\n";
+	cout << " A later run on the same inputs reads the result instead of\n";
+	cout << " fitting, and with --keep-plot does not draw an up to date plot.\n";
+	cout << "\n Large files can be converted once to binary caches with --convert.\n";
+	cout << " A cache <file>.geffbin is then read instead of <file> for as long\n";
+	cout << " as <file> is not modified.\n";
+	cout << "\n With --watch, geff keeps running after the first fit and refits,\n";
+	cout << " starting from the last result, whenever an input file is saved.\n";
+	cout << " Only the changed sources are read again. Stop it with Ctrl-C.\n";
+	cout << "\n With --curve, the fitted curve is saved for geff_eval.hh, a\n";
+	cout << " header-only evaluator of the efficiency and its error for sorting\n";
+	cout << " code without ROOT (poly model only).\n";
+	cout << "\n With --table, the curve and its error are written as a lookup\n";
+	cout << " table for geff_table.hh, on --table-points points (1 per keV by\n";
+	cout << " default) uniform in E, or in log(E) with --table-log.\n";
+	cout << "\n With --emit-cpp <file.hh>, the curve and its error are written as\n";
+	cout << " inline C++ functions efficiency(E) and efficiency_error(E) in a\n";
+	cout << " namespace named after the file, for code that can't read files\n";
+	cout << " (poly model only).\n";
+	cout << "\n With --shm <name>:<channel>, the curve and its table, as for\n";
+	cout << " --table, are published to a POSIX shared-memory store, created\n";
+	cout << " with --shm-channels channels if needed. Sort processes read it\n";
+	cout << " with geff_shm.hh and see each refit of --watch in place.\n";
+	cout << "\n With --db, each fit is appended to a calibration database with\n";
+	cout << " its --detector id, the --runs it is valid for, the time and the\n";
+	cout << " fit summary, instead of overwriting fitresult.txt. Look them up\n";
+	cout << " and export them with geffdb.\n";
+	cout << "\n With --jackknife, the effect of leaving out each point and each\n";
+	cout << " source is found from the fit without refitting. Points with a\n";
+	cout << " studentised residual above 3 are flagged as outliers.\n";
 	
 	cout << "\n" << progname << " --help\tfor this detailed help!\n\n\n";
 	
@@ -57,6 +165,9 @@ void PrintUsage( char* progname ) {
 
 int main( int argc, char* argv[] ) {
 	
+	// Before any other ROOT call, so fitters may run on many threads
+	ROOT::EnableThreadSafety();
+	
 	// Some variables
 	string outputfile = "efficiency.pdf";
 	int limits[2] = { 1, 4500 };
@@ -85,6 +196,43 @@ int main( int argc, char* argv[] ) {
 		 cxxopts::value<std::string>(), "<low>:<upp>" )
 		( "z,E0", "the E0 parameter, the energy normalisation from log(E/E0) (keV), default value = 350 keV",
 		 cxxopts::value<float>(), "<E0>" )
+		( "m,model", "efficiency model: poly (default), bspline, radware, debertin, grayahmad or template",
+		 cxxopts::value<std::string>(), "<model>" )
+		( "knots", "number of interior knots of the bspline model, default value = 8",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "lambda", "smoothing of the bspline model, default value = 1",
+		 cxxopts::value<double>(), "<lambda>" )
+		( "template", "simulated efficiency curve (E | eff) of the template model",
+		 cxxopts::value<std::string>(), "<sim.dat>" )
+		( "ncorr", "fitted scale and correction terms of the template model, default value = 3",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "curve", "save the fitted curve for geff_eval.hh",
+		 cxxopts::value<std::string>()->implicit_value("efficiency.geff"), "<efficiency.geff>" )
+		( "table", "export a lookup table of the efficiency for geff_table.hh, and a CSV copy",
+		 cxxopts::value<std::string>()->implicit_value("efficiency.lut"), "<efficiency.lut>" )
+		( "table-points", "points in the lookup table, default value = 1 per keV",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "table-log", "space the lookup table uniformly in log(E)" )
+		( "emit-cpp", "write the fitted curve as a C++ header with inline functions",
+		 cxxopts::value<std::string>(), "<file.hh>" )
+		( "shm", "publish the curve and its table to a channel of a shared-memory store",
+		 cxxopts::value<std::string>(), "</geff:0>" )
+		( "shm-channels", "channels of a new shared-memory store, default value = 64",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "db", "add the result to a calibration database instead of writing fitresult.txt",
+		 cxxopts::value<std::string>(), "<calib.gdb>" )
+		( "detector", "detector id of the result in the database, default value = 0",
+		 cxxopts::value<unsigned int>(), "<id>" )
+		( "runs", "runs the result is valid for in the database, default all",
+		 cxxopts::value<std::string>(), "<first>:<last>" )
+		( "no-plot", "fit and print the results without any graphics, -o is ignored" )
+		( "cache", "keep fit results in a cache directory and reuse them for unchanged inputs",
+		 cxxopts::value<std::string>()->implicit_value(""), "<~/.cache/geff>" )
+		( "keep-plot", "with --cache, don't draw again if the plot is newer than the cached result" )
+		( "convert", "convert the -e and -n files to binary caches (<file>.geffbin) and exit" )
+		( "watch", "refit and redraw whenever one of the input files changes" )
+		( "jackknife", "leave-one-out influence of each point and source, written to a file",
+		 cxxopts::value<std::string>()->implicit_value("jackknife.txt"), "<jackknife.txt>" )
 		( "h,help", "Print more detailed help" )
 		;
 		
@@ -115,6 +263,24 @@ int main( int argc, char* argv[] ) {
 			
 		}
 		
+		else if( std::count( optresult["e"].as<std::vector<std::string>>().begin(),
+							 optresult["e"].as<std::vector<std::string>>().end(), "-" ) &&
+				 ( optresult.count("e") > 1 || optresult.count("n") ) ) {
+			
+			cerr << "With -e - all sources and normalisations come from standard input\n";
+			return 1;
+			
+		}
+		
+		else if( optresult.count("watch") &&
+				 std::count( optresult["e"].as<std::vector<std::string>>().begin(),
+							 optresult["e"].as<std::vector<std::string>>().end(), "-" ) ) {
+			
+			cerr << "Standard input cannot be watched, use files with --watch\n";
+			return 1;
+			
+		}
+		
 		else if( optresult.count("e") < optresult.count("n") ) {
 			
 			cerr << "Too many normalisation files\n";
@@ -122,7 +288,9 @@ int main( int argc, char* argv[] ) {
 			
 		}
 		
-		else if( optresult.count("e") > optresult.count("n") ) {
+		// Standard input holds its own normalisations, if any
+		else if( optresult.count("e") > optresult.count("n") &&
+				 optresult["e"].as<std::vector<std::string>>().at(0) != "-" ) {
 			
 			cout << "Not enough normalisation files\n";
 			cout << "Continuing and assuming there are no normalisation data\n";
@@ -130,10 +298,29 @@ int main( int argc, char* argv[] ) {
 			
 		}
 		
+		// Convert to binary caches, used automatically from now on
+		if( optresult.count("convert") ) {
+			
+			int convresult = 0;
+			
+			for( unsigned int i = 0; i < optresult.count("e"); i++ )
+				convresult |= EffCache::Convert( optresult["e"].as<std::vector<std::string>>().at(i), 4 );
+			
+			for( unsigned int i = 0; i < optresult.count("n"); i++ )
+				convresult |= EffCache::Convert( optresult["n"].as<std::vector<std::string>>().at(i), 2 );
+			
+			return convresult;
+			
+		}
+		
 		// Check for output filename (use default if not)
 		if( optresult.count("o") )
 			outputfile = optresult["o"].as<std::string>();
 		
+		// Without plots, ROOT must never open a display
+		bool noplot = optresult.count("no-plot");
+		if( noplot ) gROOT->SetBatch( kTRUE );
+		
 		// Check for range (use default if not)
 		if( optresult.count("r") ) {
 		
@@ -179,7 +366,133 @@ int main( int argc, char* argv[] ) {
 
 		// If we get this far, create the FitEff and GlobalFitter instances
 		GlobalFitter gf( E0, limits[0], limits[1] );
+		
+		// Results of earlier runs
+		if( optresult.count("cache") )
+			gf.SetCache( make_shared<FitCache>( optresult["cache"].as<std::string>() ) );
+		bool keepplot = optresult.count("keep-plot");
+		
+		// Choose the efficiency model
+		string model = "poly";
+		if( optresult.count("m") )
+			model = optresult["m"].as<std::string>();
+		
+		if( model == "bspline" ) {
+			
+			unsigned int knots = 8;
+			double lambda = 1.;
+			if( optresult.count("knots") )
+				knots = optresult["knots"].as<unsigned int>();
+			if( optresult.count("lambda") )
+				lambda = optresult["lambda"].as<double>();
+			
+			if( knots == 0 || lambda < 0 ) {
+				
+				cerr << "The bspline model needs at least one knot and lambda >= 0\n";
+				return 1;
+				
+			}
+			
+			gf.SetSpline( knots, lambda );
+			
+		}
+		
+		else if( model == "template" ) {
+			
+			if( !optresult.count("template") ) {
+				
+				cerr << "The template model needs a simulated curve with --template <file>\n";
+				return 1;
+				
+			}
+			
+			unsigned int ncorr = 3;
+			if( optresult.count("ncorr") )
+				ncorr = optresult["ncorr"].as<unsigned int>();
+			
+			if( gf.SetTemplate( optresult["template"].as<std::string>(), ncorr ) )
+				return 1;
+			
+		}
+		
+		else if( gf.SetModel( model ) ) {
+			
+			cerr << "Unknown model " << model << ", use one of:";
+			vector<string> names = EffModel::Names();
+			for( unsigned int i = 0; i < names.size(); i++ )
+				cerr << " " << names[i];
+			cerr << endl;
+			return 1;
+			
+		}
+		// Shared-memory store, opened before any fitting
+		EffShm shm;
+		unsigned int shmchannel = 0;
+		if( optresult.count("shm") ) {
+			
+			string shmname = optresult["shm"].as<std::string>();
+			size_t colon = shmname.rfind( ':' );
+			if( colon != string::npos ) {
+				
+				shmchannel = strtoul( shmname.c_str() + colon + 1, NULL, 10 );
+				shmname = shmname.substr( 0, colon );
+				
+			}
+			
+			if( shmname.empty() || shmname[0] != '/' ) shmname = "/" + shmname;
+			
+			unsigned int shmchannels = 64;
+			if( optresult.count("shm-channels") )
+				shmchannels = optresult["shm-channels"].as<unsigned int>();
+			
+			// Room for the table of a new store, an existing one keeps its size
+			unsigned int shmtable = max( 8192, limits[1] - limits[0] + 1 );
+			if( optresult.count("table-points") )
+				shmtable = max( shmtable, optresult["table-points"].as<unsigned int>() );
+			
+			if( shm.create( shmname, shmchannels, shmtable ) || shmchannel >= shm.nchannels() ) {
+				
+				cerr << "Cannot publish to channel " << shmchannel << " of " << shmname << endl;
+				return 1;
+				
+			}
+			
+		}
+		
+		// Calibration database, opened before any fitting
+		CalibDB db;
+		unsigned int detector = 0;
+		unsigned int runs[2] = { 0, 0xffffffff };
+		if( optresult.count("db") ) {
+			
+			if( optresult.count("detector") )
+				detector = optresult["detector"].as<unsigned int>();
+			
+			// A single run, or a range of runs
+			if( optresult.count("runs") ) {
+				
+				string runrange = optresult["runs"].as<std::string>();
+				char colon;
+				stringstream ss( runrange );
+				bool ok = runrange.find(":") == string::npos ? (bool)( ss >> runs[0] ) :
+						  (bool)( ss >> runs[0] >> colon >> runs[1] );
+				if( runrange.find(":") == string::npos ) runs[1] = runs[0];
+				
+				if( !ok || runs[0] > runs[1] ) {
+					
+					cerr << "Runs not in correct format" << endl;
+					return 1;
+					
+				}
+				
+			}
+			
+			if( db.Open( optresult["db"].as<std::string>(), true ) ) return 1;
+			
+		}
+		
 		FitEff fe( gf, limits[0], limits[1] );
+		if( optresult.count("db") ) fe.SetResultFile( "" );
 
 		// Initialise with the number of sources
 		fe.SetVariables( optresult.count("e") );
@@ -197,10 +510,102 @@ int main( int argc, char* argv[] ) {
 		if( readresult > 0 ) return readresult;
 		
 		// Run the fitting
-		fe.DoFit();
+		if( fe.DoFit() ) return 1;
+		
+		// Influence of single points and sources
+		if( optresult.count("jackknife") )
+			fe.Jackknife( optresult["jackknife"].as<std::string>() );
+		
+		// Save the curve for other programs
+		if( optresult.count("curve") )
+			fe.SaveCurve( optresult["curve"].as<std::string>() );
+		
+		// Lookup table, one point per keV by default
+		unsigned int tablepoints = limits[1] - limits[0] + 1;
+		if( optresult.count("table-points") )
+			tablepoints = optresult["table-points"].as<unsigned int>();
+		if( optresult.count("table") )
+			fe.ExportTable( optresult["table"].as<std::string>(), tablepoints,
+						   optresult.count("table-log") );
+		
+		// Curve compiled into other code
+		if( optresult.count("emit-cpp") )
+			fe.EmitCpp( optresult["emit-cpp"].as<std::string>() );
+		
+		// Curve for the sort processes on this node
+		if( optresult.count("shm") )
+			fe.Publish( shm, shmchannel, tablepoints, optresult.count("table-log") );
+		
+		// Keep it with all earlier calibrations
+		if( optresult.count("db") )
+			fe.SaveCalib( db, detector, runs[0], runs[1] );
 		
 		// Draw the results
-		fe.DrawResults( outputfile );
+		ShowResults( fe, gf, outputfile, noplot, keepplot );
+		
+		// Refit whenever the inputs change
+		if( optresult.count("watch") ) {
+			
+			// Tools may truncate a file while it is reloaded, which
+			// a mapping of it would not survive
+			DataReader::SetMapping( false );
+			
+			FileWatcher fw;
+			if( !fw.IsOpen() ) return 1;
+			
+			// ROOT inputs are watched by the file name before the object
+			for( unsigned int i = 0; i < fe.GetEfiles().size(); i++ ) {
+				
+				fw.Add( RootReader::FileName( fe.GetEfiles().at(i) ), i );
+				
+			}
+			
+			for( unsigned int i = 0; i < fe.GetNfiles().size(); i++ ) {
+				
+				fw.Add( RootReader::FileName( fe.GetNfiles().at(i) ), i );
+				
+			}
+			
+			cout << "Watching the input files for changes...\n";
+			
+			vector<unsigned int> changed;
+			while( fw.Wait( changed ) == 0 ) {
+				
+				int reloadresult = 0;
+				for( unsigned int i = 0; i < changed.size(); i++ ) {
+					
+					cout << "Source " << changed[i] << " changed, reading it again\n";
+					reloadresult |= fe.ReloadSource( changed[i] );
+					
+				}
+				
+				// Keep the last good result until the files are fixed
+				if( reloadresult ) {
+					
+					cerr << "Not refitting until the data can be read\n";
+					continue;
+					
+				}
+				
+				if( fe.DoFit() ) continue;
+				if( optresult.count("curve") )
+					fe.SaveCurve( optresult["curve"].as<std::string>() );
+				if( optresult.count("table") )
+					fe.ExportTable( optresult["table"].as<std::string>(), tablepoints,
+								   optresult.count("table-log") );
+				if( optresult.count("emit-cpp") )
+					fe.EmitCpp( optresult["emit-cpp"].as<std::string>() );
+				if( optresult.count("shm") )
+					fe.Publish( shm, shmchannel, tablepoints, optresult.count("table-log") );
+				if( optresult.count("db") )
+					fe.SaveCalib( db, detector, runs[0], runs[1] );
+				ShowResults( fe, gf, outputfile, noplot, keepplot );
+				
+			}
+			
+			return 1;
+			
+		}
 		
 	}
 	
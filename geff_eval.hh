@@ -0,0 +1,237 @@
+// Runtime evaluator of a fitted efficiency curve, for sorting code that
+// needs eff(E) and its error for every gamma ray. Header-only and free of
+// ROOT: copy it next to the sort code and load the curve file written by
+// geff --curve <file>.
+//
+//   EffCurve curve;
+//   if( curve.load( "efficiency.geff" ) ) return 1;
+//   double eff = curve.eval( 1332.5 );
+//   curve.eval_batch( E, n, eff, err );
+//
+// The curve is ln eff = P( L ) with P a polynomial in L = ln( E / E0 ),
+// i.e. the default poly model, which is what the file must hold. Its
+// error is eff sqrt( Q( L ) ), where Q = g^T C g / eff^2 is the
+// polynomial of degree 2 ( n - 1 ) summing the covariance C of the
+// coefficients along its anti-diagonals. Both are precomputed when the
+// file is loaded, so an evaluation is one log, two Horner loops, one
+// exp and one sqrt, with no virtual calls.
+//
+// eval_batch() works on blocks of energies with each step a plain loop
+// over the block, which the compiler vectorises. Build with -O3, and
+// with -ffast-math for the SIMD exp and log of libmvec, which glibc
+// only declares then.
+//
+// Without a curve, i.e. before a successful load() or set(), all
+// evaluations give NaN.
+//
+// Curve file, one keyword per line, lines starting with '#' ignored:
+//   model  poly
+//   E0     <keV>
+//   range  <low> <upp>
+//   norm   <normalisation of the first source>
+//   npar   <n>
+//   par    <c_0> ... <c_n-1>
+//   cov    <C_k,0> ... <C_k,n-1>       (n lines)
+
+#ifndef __geff_eval_hh__
+#define __geff_eval_hh__
+
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class EffCurve {
+
+public:
+
+	// Largest number of coefficients, as in the fit
+	static const unsigned int kMaxPars = 16;
+
+	// Energies per block of eval_batch()
+	static const unsigned int kBlock = 64;
+
+	EffCurve(){
+		npar = 0;
+		E0 = invE0 = 1.;
+		Elow = Eupp = norm = 0.;
+	};
+
+	// Read a curve file, returns 0 on success and 1 on failure
+	int load( const std::string &filename );
+
+	// Set the curve from its n coefficients and their n x n covariance,
+	// e.g. as read from geff_shm.hh. Returns 0 on success.
+	int set( double _E0, double _Elow, double _Eupp, double _norm,
+			unsigned int n, const double *par, const double *cov );
+
+	// Efficiency and its error at E (keV)
+	inline double eval( double E ) const {
+		if( npar == 0 ) return NAN;
+		double L = std::log( E * invE0 );
+		return std::exp( Horner( c, npar, L ) );
+	};
+	inline double error( double E ) const {
+		if( npar == 0 ) return NAN;
+		double L = std::log( E * invE0 );
+		double q = Horner( q2, 2 * npar - 1, L );
+		return std::exp( Horner( c, npar, L ) ) * std::sqrt( q > 0 ? q : 0 );
+	};
+
+	// Efficiency and, unless err is null, its error for n energies
+	void eval_batch( const double *E, size_t n, double *eff, double *err = 0 ) const;
+
+	inline unsigned int size() const { return npar; };
+
+	// Coefficients of P, size() of them, and of Q, 2 size() - 1, e.g.
+	// to write them into code as geff --emit-cpp does
+	inline const double* coefficients() const { return c; };
+	inline const double* error_coefficients() const { return q2; };
+	inline double energy0() const { return E0; };
+	inline double low() const { return Elow; };
+	inline double upp() const { return Eupp; };
+
+	// Efficiency of the first source relative to the curve, i.e.
+	// eval( E ) / norm() is what was fitted to its data
+	inline double normalisation() const { return norm; };
+
+private:
+
+	// n must not be zero
+	static inline double Horner( const double *a, unsigned int n, double x ) {
+		double p = a[n-1];
+		for( unsigned int k = n - 1; k-- > 0; )
+			p = p * x + a[k];
+		return p;
+	};
+
+	unsigned int npar;
+	double E0, invE0;
+	double Elow, Eupp;
+	double norm;
+	double c[kMaxPars];			// coefficients of P
+	double q2[2*kMaxPars-1];	// coefficients of Q
+
+};
+
+inline int EffCurve::load( const std::string &filename ) {
+
+	std::ifstream in( filename.c_str() );
+	if( !in.is_open() ) return 1;
+
+	std::string line, key, model;
+	std::vector<double> par, cov;
+	double x;
+	unsigned int n = 0;
+
+	while( std::getline( in, line ) ) {
+
+		std::istringstream ss( line );
+		if( !( ss >> key ) || key[0] == '#' ) continue;
+
+		if( key == "model" ) ss >> model;
+		else if( key == "E0" ) ss >> E0;
+		else if( key == "range" ) ss >> Elow >> Eupp;
+		else if( key == "norm" ) ss >> norm;
+		else if( key == "npar" ) ss >> n;
+		else if( key == "par" ) while( ss >> x ) par.push_back( x );
+		else if( key == "cov" ) while( ss >> x ) cov.push_back( x );
+
+	}
+
+	if( model != "poly" || par.size() != n || cov.size() != n * n ) {
+
+		npar = 0;
+		return 1;
+
+	}
+
+	return set( E0, Elow, Eupp, norm, n, par.data(), cov.data() );
+
+}
+
+inline int EffCurve::set( double _E0, double _Elow, double _Eupp, double _norm,
+						 unsigned int n, const double *par, const double *cov ) {
+
+	npar = 0;
+	if( n == 0 || n > kMaxPars || !( _E0 > 0 ) ) return 1;
+
+	E0 = _E0;
+	Elow = _Elow;
+	Eupp = _Eupp;
+	norm = _norm;
+	npar = n;
+	invE0 = 1. / E0;
+
+	for( unsigned int k = 0; k < 2 * npar - 1; k++ )
+		q2[k] = 0;
+
+	for( unsigned int k = 0; k < npar; k++ ) {
+
+		c[k] = par[k];
+		for( unsigned int l = 0; l < npar; l++ )
+			q2[k+l] += cov[ k * npar + l ];
+
+	}
+
+	return 0;
+
+}
+
+inline void EffCurve::eval_batch( const double *E, size_t n, double *eff, double *err ) const {
+
+	double L[kBlock], p[kBlock], q[kBlock];
+
+	if( npar == 0 ) {
+
+		for( size_t i = 0; i < n; i++ ) {
+			eff[i] = NAN;
+			if( err ) err[i] = NAN;
+		}
+
+		return;
+
+	}
+
+	unsigned int nq = 2 * npar - 1;
+
+	for( size_t i0 = 0; i0 < n; i0 += kBlock ) {
+
+		unsigned int m = n - i0 < kBlock ? n - i0 : kBlock;
+		const double *Eb = E + i0;
+		double *effb = eff + i0;
+
+		for( unsigned int j = 0; j < m; j++ )
+			L[j] = std::log( Eb[j] * invE0 );
+
+		// Horner over the block, one coefficient at a time
+		for( unsigned int j = 0; j < m; j++ )
+			p[j] = c[npar-1];
+		for( unsigned int k = npar - 1; k-- > 0; )
+			for( unsigned int j = 0; j < m; j++ )
+				p[j] = p[j] * L[j] + c[k];
+
+		for( unsigned int j = 0; j < m; j++ )
+			effb[j] = std::exp( p[j] );
+
+		if( !err ) continue;
+
+		double *errb = err + i0;
+		for( unsigned int j = 0; j < m; j++ )
+			q[j] = q2[nq-1];
+		for( unsigned int k = nq - 1; k-- > 0; )
+			for( unsigned int j = 0; j < m; j++ )
+				q[j] = q[j] * L[j] + q2[k];
+
+		for( unsigned int j = 0; j < m; j++ )
+			errb[j] = effb[j] * std::sqrt( q[j] > 0 ? q[j] : 0 );
+
+	}
+
+	return;
+
+}
+
+#endif
@@ -0,0 +1,480 @@
+// Calibration store in POSIX shared memory, for the many sort processes
+// on a node that each need the efficiency of every detector. geff
+// publishes a fitted curve with --shm <name>:<channel>, and readers map
+// the segment read-only, so all of them share one copy that changes in
+// place whenever a channel is refitted. Header-only and free of ROOT,
+// link the readers with -lrt on older systems.
+//
+//   EffShm shm;
+//   if( shm.open( "/geff" ) ) return 1;
+//   double eff = shm.eval( 12, 1332.5 );		// table of channel 12
+//   EffCurve curve;
+//   shm.curve( 12, curve );						// its poly curve, geff_eval.hh
+//   if( shm.generation( 12 ) != seen ) ...		// refitted since
+//
+// Each channel is a fixed-size slot with a sequence lock: the writer
+// makes the sequence number odd, writes, and makes it even again, and a
+// reader retries if the number was odd or changed while it read. Reads
+// take no locks and never block the writer, and a reader always sees a
+// whole curve, never half of an update. Half the sequence number is the
+// generation of the channel, zero until it is first published. Writers
+// hold a lock on the segment while they publish, so there is only ever
+// one, and a writer that died leaves its slot odd only until the next
+// publish; readers meanwhile give up after kReadTimeout.
+//
+// Layout, all in native byte order:
+//   GeffShmHeader                 magic, version, nchannels, slot size
+//   nchannels slots of slotsize bytes, each
+//     GeffShmSlot                 sequence, curve, covariance, grid
+//     double[maxtable] x 2        table of the efficiency and its error
+
+#ifndef __geff_shm_hh__
+#define __geff_shm_hh__
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef __geff_eval_hh__
+#include "geff_eval.hh"
+#endif
+
+struct GeffShmHeader {
+
+	char magic[8];			// "GEFFSHM", set last when created
+	uint32_t byteorder;		// 0x01020304 as written
+	uint32_t version;
+	uint32_t nchannels;
+	uint32_t maxtable;		// table points per channel
+	uint64_t slotsize;		// bytes per channel
+
+};
+
+struct GeffShmSlot {
+
+	std::atomic<uint64_t> seq;	// odd while being written
+	char model[16];
+	uint32_t npar;			// coefficients, without the normalisation
+	uint32_t ntable;		// table points, 0 for none
+	uint32_t logE;			// table uniform in ln( E ) rather than E
+	uint32_t reserved;
+	double E0, Elow, Eupp;
+	double norm;			// normalisation of the first source
+	double par[EffCurve::kMaxPars];
+	double cov[EffCurve::kMaxPars*EffCurve::kMaxPars];
+	double x0, dx;			// first table point and step
+
+};
+
+// A curve as published and as read back
+struct EffShmCurve {
+
+	std::string model;
+	double E0, Elow, Eupp, norm;
+	std::vector<double> par;		// npar coefficients
+	std::vector<double> cov;		// npar x npar
+	bool logE;
+	double x0, dx;
+	std::vector<double> eff, err;	// the table, may be empty
+	uint64_t generation;
+
+};
+
+class EffShm {
+
+public:
+
+	static const uint32_t kVersion = 1;
+
+	// Time a reader waits for a writer before it gives up, e.g. on one
+	// that died while publishing, in microseconds
+	static const long kReadTimeout = 1000;
+
+	EffShm(){
+		map = 0;
+		len = 0;
+		fd = -1;
+	};
+	~EffShm(){ close(); };
+
+	EffShm( const EffShm& ) = delete;
+	EffShm& operator=( const EffShm& ) = delete;
+
+	// Map an existing segment read-only, returns 0 on success
+	int open( const std::string &name );
+
+	// Map a segment for publishing, creating it with nchannels slots of
+	// maxtable table points if it does not exist. Returns 0 on success.
+	int create( const std::string &name, uint32_t nchannels = 64, uint32_t maxtable = 8192 );
+
+	void close();
+
+	// Publish a curve to a channel, returns 0 on success. The table is
+	// left out, and the curve published, if it has more than maxtable
+	// points, which the caller can check. Blocks while another
+	// process publishes; threads publish through their own EffShm.
+	int publish( uint32_t channel, const EffShmCurve &c );
+
+	// Copy the curve of a channel, returns 0 on success and 1 if the
+	// channel was never published or could not be read
+	int read( uint32_t channel, EffShmCurve &c ) const;
+
+	// The poly curve of a channel for geff_eval.hh, 0 on success
+	int curve( uint32_t channel, EffCurve &c ) const;
+
+	// Efficiency and its error from the table of a channel, linear in
+	// the grid and read in place. NaN if there is no table.
+	inline double eval( uint32_t channel, double E ) const { return Lookup( channel, E, 0 ); };
+	inline double error( uint32_t channel, double E ) const { return Lookup( channel, E, 1 ); };
+
+	// Number of times the channel was published, 0 if never
+	inline uint64_t generation( uint32_t channel ) const {
+		if( channel >= nchannels() ) return 0;
+		return Slot( channel )->seq.load( std::memory_order_acquire ) / 2;
+	};
+
+	inline uint32_t nchannels() const { return map ? Header()->nchannels : 0; };
+	inline uint32_t maxtable() const { return map ? Header()->maxtable : 0; };
+
+private:
+
+	inline const GeffShmHeader* Header() const { return (const GeffShmHeader*)map; };
+	inline GeffShmSlot* Slot( uint32_t i ) const {
+		return (GeffShmSlot*)( (char*)map + sizeof(GeffShmHeader) + i * Header()->slotsize );
+	};
+	inline double* Table( GeffShmSlot *s ) const {
+		return (double*)( (char*)s + sizeof(GeffShmSlot) );
+	};
+
+	static inline uint64_t SlotSize( uint32_t maxtable ) {
+		uint64_t n = sizeof(GeffShmSlot) + 2 * (uint64_t)maxtable * sizeof(double);
+		return ( n + 63 ) & ~(uint64_t)63;
+	};
+
+	// Check the header and the size of a mapping, 0 if valid
+	int Check() const;
+
+	double Lookup( uint32_t channel, double E, unsigned int which ) const;
+
+	// True once a reader waited kReadTimeout since start, which is set
+	// on the first call
+	static bool TimedOut( std::chrono::steady_clock::time_point &start, bool first );
+
+	void *map;
+	unsigned long len;
+	int fd;				// kept open by writers for the lock, -1 if read-only
+
+};
+
+// Atomics shared between processes must not hide a lock in the process
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2 && sizeof(std::atomic<uint64_t>) == 8,
+			  "geff_shm.hh needs lock-free 64-bit atomics" );
+
+inline int EffShm::Check() const {
+
+	const GeffShmHeader *hdr = Header();
+	if( len < sizeof(GeffShmHeader) ) return 1;
+
+	return memcmp( hdr->magic, "GEFFSHM", 8 ) != 0 || hdr->byteorder != 0x01020304 ||
+		   hdr->version != kVersion || hdr->slotsize != SlotSize( hdr->maxtable ) ||
+		   len < sizeof(GeffShmHeader) + hdr->nchannels * hdr->slotsize;
+
+}
+
+inline int EffShm::open( const std::string &name ) {
+
+	close();
+
+	int fd = shm_open( name.c_str(), O_RDONLY, 0 );
+	if( fd < 0 ) return 1;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || (uint64_t)st.st_size < sizeof(GeffShmHeader) ) {
+
+		::close( fd );
+		return 1;
+
+	}
+
+	len = st.st_size;
+	map = mmap( 0, len, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if( map == MAP_FAILED ) {
+
+		map = 0;
+		return 1;
+
+	}
+
+	if( Check() ) {
+
+		close();
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+inline int EffShm::create( const std::string &name, uint32_t nchannels, uint32_t maxtable ) {
+
+	close();
+	if( nchannels == 0 ) return 1;
+
+	// The first process to create it sets it up, the others wait for it
+	bool creator = true;
+	int fd = shm_open( name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644 );
+	if( fd < 0 && errno == EEXIST ) {
+
+		creator = false;
+		fd = shm_open( name.c_str(), O_RDWR, 0 );
+
+	}
+
+	if( fd < 0 ) return 1;
+
+	uint64_t size = sizeof(GeffShmHeader) + nchannels * SlotSize( maxtable );
+	if( creator && ftruncate( fd, size ) != 0 ) {
+
+		::close( fd );
+		shm_unlink( name.c_str() );
+		return 1;
+
+	}
+
+	// Until the creator has sized it
+	struct stat st;
+	for( unsigned int i = 0; i < 1000; i++ ) {
+
+		if( fstat( fd, &st ) != 0 ) break;
+		if( (uint64_t)st.st_size >= sizeof(GeffShmHeader) ) break;
+		usleep( 1000 );
+
+	}
+
+	len = st.st_size;
+	map = len ? mmap( 0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+	if( map == MAP_FAILED ) {
+
+		::close( fd );
+		map = 0;
+		return 1;
+
+	}
+
+	this->fd = fd;
+
+	GeffShmHeader *hdr = (GeffShmHeader*)map;
+	if( creator ) {
+
+		// New memory is zero, i.e. every slot is at generation 0
+		hdr->byteorder = 0x01020304;
+		hdr->version = kVersion;
+		hdr->nchannels = nchannels;
+		hdr->maxtable = maxtable;
+		hdr->slotsize = SlotSize( maxtable );
+		std::atomic_thread_fence( std::memory_order_release );
+		memcpy( hdr->magic, "GEFFSHM", 8 );
+
+	}
+
+	else {
+
+		for( unsigned int i = 0; i < 1000 && memcmp( hdr->magic, "GEFFSHM", 8 ) != 0; i++ )
+			usleep( 1000 );
+		std::atomic_thread_fence( std::memory_order_acquire );
+
+	}
+
+	if( Check() ) {
+
+		close();
+		return 1;
+
+	}
+
+	return 0;
+
+}
+
+inline void EffShm::close() {
+
+	if( map ) munmap( map, len );
+	if( fd >= 0 ) ::close( fd );
+	map = 0;
+	len = 0;
+	fd = -1;
+
+	return;
+
+}
+
+inline int EffShm::publish( uint32_t channel, const EffShmCurve &c ) {
+
+	if( fd < 0 || channel >= nchannels() || c.par.size() > EffCurve::kMaxPars ||
+	    c.cov.size() != c.par.size() * c.par.size() || c.eff.size() != c.err.size() )
+		return 1;
+
+	// One writer at a time. The lock goes with the process, so a writer
+	// that died holds none, and an odd sequence found under the lock was
+	// left by it: the slot is then written again from its odd number.
+	while( flock( fd, LOCK_EX ) != 0 )
+		if( errno != EINTR ) return 1;
+
+	GeffShmSlot *s = Slot( channel );
+	uint64_t seq = s->seq.load( std::memory_order_relaxed );
+	if( seq % 2 == 0 ) s->seq.store( ++seq, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	memset( s->model, 0, sizeof(s->model) );
+	strncpy( s->model, c.model.c_str(), sizeof(s->model) - 1 );
+	s->npar = c.par.size();
+	s->E0 = c.E0;
+	s->Elow = c.Elow;
+	s->Eupp = c.Eupp;
+	s->norm = c.norm;
+	memcpy( s->par, c.par.data(), c.par.size() * sizeof(double) );
+	memcpy( s->cov, c.cov.data(), c.cov.size() * sizeof(double) );
+
+	s->ntable = c.eff.size() <= maxtable() ? c.eff.size() : 0;
+	s->logE = c.logE;
+	s->x0 = c.x0;
+	s->dx = c.dx;
+	double *t = Table( s );
+	memcpy( t, c.eff.data(), s->ntable * sizeof(double) );
+	memcpy( t + maxtable(), c.err.data(), s->ntable * sizeof(double) );
+
+	// Even again, one generation on
+	s->seq.store( seq + 1, std::memory_order_release );
+	flock( fd, LOCK_UN );
+
+	return 0;
+
+}
+
+inline int EffShm::read( uint32_t channel, EffShmCurve &c ) const {
+
+	if( channel >= nchannels() ) return 1;
+
+	GeffShmSlot *s = Slot( channel );
+	const double *t = Table( s );
+
+	std::chrono::steady_clock::time_point start;
+	for( unsigned long i = 0; ; i++ ) {
+
+		uint64_t seq = s->seq.load( std::memory_order_acquire );
+		if( seq == 0 ) return 1;
+		if( seq % 2 ) {
+
+			if( TimedOut( start, i == 0 ) ) return 1;
+			sched_yield();
+			continue;
+
+		}
+
+		unsigned int n = s->npar < EffCurve::kMaxPars ? s->npar : EffCurve::kMaxPars;
+		unsigned int nt = s->ntable < maxtable() ? s->ntable : maxtable();
+		c.model.assign( s->model, strnlen( s->model, sizeof(s->model) ) );
+		c.E0 = s->E0;
+		c.Elow = s->Elow;
+		c.Eupp = s->Eupp;
+		c.norm = s->norm;
+		c.par.assign( s->par, s->par + n );
+		c.cov.assign( s->cov, s->cov + n * n );
+		c.logE = s->logE;
+		c.x0 = s->x0;
+		c.dx = s->dx;
+		c.eff.assign( t, t + nt );
+		c.err.assign( t + maxtable(), t + maxtable() + nt );
+
+		// Valid only if no writer came in between
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if( s->seq.load( std::memory_order_relaxed ) == seq ) {
+
+			c.generation = seq / 2;
+			return 0;
+
+		}
+
+		if( TimedOut( start, i == 0 ) ) return 1;
+
+	}
+
+}
+
+inline int EffShm::curve( uint32_t channel, EffCurve &c ) const {
+
+	EffShmCurve sc;
+	if( read( channel, sc ) || sc.model != "poly" ) return 1;
+
+	return c.set( sc.E0, sc.Elow, sc.Eupp, sc.norm, sc.par.size(), sc.par.data(), sc.cov.data() );
+
+}
+
+inline double EffShm::Lookup( uint32_t channel, double E, unsigned int which ) const {
+
+	if( channel >= nchannels() ) return NAN;
+
+	GeffShmSlot *s = Slot( channel );
+	const double *t = Table( s ) + which * maxtable();
+
+	std::chrono::steady_clock::time_point start;
+	for( unsigned long i = 0; ; i++ ) {
+
+		uint64_t seq = s->seq.load( std::memory_order_acquire );
+		if( seq % 2 ) {
+
+			if( TimedOut( start, i == 0 ) ) return NAN;
+			sched_yield();
+			continue;
+
+		}
+
+		// Linear in the cell of E, the end values outside the grid
+		double y = NAN;
+		uint64_t n = s->ntable < maxtable() ? s->ntable : maxtable();
+		if( n >= 2 && s->dx > 0 ) {
+
+			double x = ( ( s->logE ? std::log( E ) : E ) - s->x0 ) / s->dx;
+			if( !( x > 0 ) ) y = t[0];
+			else if( x >= n - 1 ) y = t[n-1];
+			else {
+
+				uint64_t k = (uint64_t)x;
+				y = t[k] + ( x - k ) * ( t[k+1] - t[k] );
+
+			}
+
+		}
+
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if( s->seq.load( std::memory_order_relaxed ) == seq ) return y;
+		if( TimedOut( start, i == 0 ) ) return NAN;
+
+	}
+
+}
+
+inline bool EffShm::TimedOut( std::chrono::steady_clock::time_point &start, bool first ) {
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if( first ) start = now;
+
+	return std::chrono::duration_cast<std::chrono::microseconds>( now - start ).count() > kReadTimeout;
+
+}
+
+#endif
@@ -0,0 +1,246 @@
+// Lookup table of a fitted efficiency curve and its error, for sorting
+// code that should not evaluate exp and log for every gamma ray.
+// Header-only and free of ROOT: geff writes the table with
+// --table <file>, and EffTable maps it into memory and interpolates.
+//
+//   EffTable table;
+//   if( table.open( "efficiency.lut" ) ) return 1;
+//   double eff = table.eval( 1332.5 );			// linear
+//   double eff3 = table.eval_cubic( 1332.5 );	// Catmull-Rom
+//   double err = table.error( 1332.5 );
+//
+// The grid is uniform in E, or in ln( E ) with --table-log, so finding
+// the cell is index arithmetic without a search. On a uniform E grid a
+// linear lookup is one multiply, two loads and an FMA. A log grid costs
+// one extra log but needs far fewer points to follow the low-energy
+// turnover. Outside the grid the end values are returned.
+//
+// Layout, all in native byte order and 8-byte aligned:
+//   GeffLutHeader                 magic, version, grid
+//   double[n]                     efficiency at the grid points
+//   double[n]                     its error
+// A CSV copy, E,eff,err per line, is written next to it as <file>.csv.
+
+#ifndef __geff_table_hh__
+#define __geff_table_hh__
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct GeffLutHeader {
+
+	char magic[8];			// "GEFFLUT"
+	uint32_t byteorder;		// 0x01020304 as written
+	uint32_t version;
+	uint32_t logE;			// grid uniform in ln( E ) rather than E
+	uint32_t reserved;
+	uint64_t npoints;
+	double x0;				// first grid point, E or ln( E )
+	double dx;				// grid step, in the same variable
+
+};
+
+class EffTable {
+
+public:
+
+	static const uint32_t kVersion = 1;
+
+	EffTable(){
+		map = 0;
+		len = 0;
+		n = 0;
+		logE = false;
+		x0 = dx = inv = 0;
+		eff = err = 0;
+	};
+	~EffTable(){ close(); };
+
+	EffTable( const EffTable& ) = delete;
+	EffTable& operator=( const EffTable& ) = delete;
+
+	// Map a table, returns 0 on success and 1 on failure
+	int open( const std::string &filename );
+	void close();
+
+	// Write the points from x0 with step dx in E, or in ln( E ) if logE
+	// is set, and a CSV copy to filename.csv. Returns 0 on success.
+	static int write( const std::string &filename, bool logE, double x0, double dx,
+					 const std::vector<double> &eff, const std::vector<double> &err );
+
+	// Linear interpolation of the efficiency and its error
+	inline double eval( double E ) const { return Linear( eff, E ); };
+	inline double error( double E ) const { return Linear( err, E ); };
+
+	// Cubic (Catmull-Rom) interpolation, linear in the end cells
+	inline double eval_cubic( double E ) const { return Cubic( eff, E ); };
+	inline double error_cubic( double E ) const { return Cubic( err, E ); };
+
+	inline uint64_t size() const { return n; };
+	inline bool log_grid() const { return logE; };
+	inline double low() const { return Energy( 0 ); };
+	inline double upp() const { return Energy( n - 1 ); };
+	inline double energy( uint64_t i ) const { return Energy( i ); };
+
+private:
+
+	// Grid cell of E and the position t in [0,1] within it
+	inline uint64_t Cell( double E, double &t ) const {
+		double x = ( ( logE ? std::log( E ) : E ) - x0 ) * inv;
+		if( !( x > 0 ) ) { t = 0; return 0; }
+		if( x >= n - 1 ) { t = 1; return n - 2; }
+		uint64_t i = (uint64_t)x;
+		t = x - i;
+		return i;
+	};
+
+	inline double Linear( const double *y, double E ) const {
+		double t;
+		uint64_t i = Cell( E, t );
+		return y[i] + t * ( y[i+1] - y[i] );
+	};
+
+	inline double Cubic( const double *y, double E ) const {
+		double t;
+		uint64_t i = Cell( E, t );
+		if( i == 0 || i + 2 >= n ) return y[i] + t * ( y[i+1] - y[i] );
+		double a = y[i-1], b = y[i], c = y[i+1], d = y[i+2];
+		return b + 0.5 * t * ( c - a + t * ( 2. * a - 5. * b + 4. * c - d +
+										 t * ( 3. * ( b - c ) + d - a ) ) );
+	};
+
+	inline double Energy( uint64_t i ) const {
+		double x = x0 + i * dx;
+		return logE ? std::exp( x ) : x;
+	};
+
+	void *map;
+	unsigned long len;
+	uint64_t n;
+	bool logE;
+	double x0, dx, inv;
+	const double *eff, *err;
+
+};
+
+inline int EffTable::open( const std::string &filename ) {
+
+	close();
+
+	int fd = ::open( filename.c_str(), O_RDONLY );
+	if( fd < 0 ) return 1;
+
+	struct stat st;
+	if( fstat( fd, &st ) != 0 || (uint64_t)st.st_size < sizeof(GeffLutHeader) ) {
+
+		::close( fd );
+		return 1;
+
+	}
+
+	len = st.st_size;
+	map = mmap( 0, len, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if( map == MAP_FAILED ) {
+
+		map = 0;
+		return 1;
+
+	}
+
+	const GeffLutHeader *hdr = (const GeffLutHeader*)map;
+	if( memcmp( hdr->magic, "GEFFLUT", 8 ) != 0 || hdr->byteorder != 0x01020304 ||
+	    hdr->version != kVersion || hdr->npoints < 2 || !( hdr->dx > 0 ) ||
+	    len < sizeof(GeffLutHeader) + 2 * hdr->npoints * sizeof(double) ) {
+
+		close();
+		return 1;
+
+	}
+
+	n = hdr->npoints;
+	logE = hdr->logE;
+	x0 = hdr->x0;
+	dx = hdr->dx;
+	inv = 1. / dx;
+	eff = (const double*)( (const char*)map + sizeof(GeffLutHeader) );
+	err = eff + n;
+
+	return 0;
+
+}
+
+inline void EffTable::close() {
+
+	if( map ) munmap( map, len );
+	map = 0;
+	len = 0;
+	n = 0;
+
+	return;
+
+}
+
+inline int EffTable::write( const std::string &filename, bool logE, double x0, double dx,
+						   const std::vector<double> &eff, const std::vector<double> &err ) {
+
+	if( eff.size() < 2 || err.size() != eff.size() || !( dx > 0 ) ) return 1;
+
+	GeffLutHeader hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, "GEFFLUT", 8 );
+	hdr.byteorder = 0x01020304;
+	hdr.version = kVersion;
+	hdr.logE = logE;
+	hdr.npoints = eff.size();
+	hdr.x0 = x0;
+	hdr.dx = dx;
+
+	// Write to a temporary file of this process and rename, so readers
+	// never see half a table and runs writing the same table don't clash
+	std::string tmpfile = filename + ".tmp" + std::to_string( getpid() );
+	std::ofstream out( tmpfile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+	if( !out.is_open() ) return 1;
+
+	out.write( (const char*)&hdr, sizeof(hdr) );
+	out.write( (const char*)eff.data(), eff.size() * sizeof(double) );
+	out.write( (const char*)err.data(), err.size() * sizeof(double) );
+	out.close();
+
+	if( out.fail() || rename( tmpfile.c_str(), filename.c_str() ) != 0 ) {
+
+		remove( tmpfile.c_str() );
+		return 1;
+
+	}
+
+	std::ofstream csv( ( filename + ".csv" ).c_str(), std::ios::out | std::ios::trunc );
+	if( !csv.is_open() ) return 1;
+
+	csv.precision( 10 );
+	csv << "E,eff,err\n";
+	double x;
+	for( unsigned long i = 0; i < eff.size(); i++ ) {
+
+		x = x0 + i * dx;
+		csv << ( logE ? std::exp( x ) : x ) << "," << eff[i] << "," << err[i] << "\n";
+
+	}
+
+	csv.close();
+
+	return csv.fail() ? 1 : 0;
+
+}
+
+#endif
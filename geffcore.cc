@@ -0,0 +1,196 @@
+// Efficiency fit without ROOT, using only the fitting core. It reads
+// the same text files and caches as geff and fits the same chi2, but
+// prints the result instead of plotting it. Starts in a few ms, e.g.
+// for many short fits on batch nodes.
+
+#ifndef CXXOPTS_HPP_INCLUDED
+#include "cxxopts.hh"
+#endif
+
+#ifndef __EffCore_hh__
+#include "EffCore.hh"
+#endif
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+int main( int argc, char* argv[] ) {
+
+	// Some variables
+	int limits[2] = { 1, 4500 };
+	double E0 = 350.;
+	string modelname = "poly";
+	ModelOptions modelopt;
+	double lambda = 1.;
+
+	try {
+
+		cxxopts::Options options( "geff-core",
+								 "Fit gamma-ray efficiency curves with multiple sources, without ROOT" );
+
+		options.add_options()
+		( "e,eff", "efficiency file for source #X (repeat for each source)",
+		 cxxopts::value<std::vector<std::string>>(), "<effX.dat>" )
+		( "n,norm", "normalisation file for source #X (repeat for each source)",
+		 cxxopts::value<std::vector<std::string>>(), "<normX.dat>" )
+		( "r,range", "fit range in the format <min>:<max> (keV)",
+		 cxxopts::value<std::string>(), "<low>:<upp>" )
+		( "z,E0", "the E0 parameter (keV), default value = 350 keV",
+		 cxxopts::value<float>(), "<E0>" )
+		( "m,model", "efficiency model: poly (default), bspline, radware, debertin, grayahmad or template",
+		 cxxopts::value<std::string>(), "<model>" )
+		( "knots", "number of interior knots of the bspline model, default value = 8",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "lambda", "smoothing of the bspline model, default value = 1",
+		 cxxopts::value<double>(), "<lambda>" )
+		( "template", "simulated efficiency curve (E | eff) of the template model",
+		 cxxopts::value<std::string>(), "<sim.dat>" )
+		( "ncorr", "fitted scale and correction terms of the template model, default value = 3",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "curve", "save the fitted curve for geff_eval.hh",
+		 cxxopts::value<std::string>()->implicit_value("efficiency.geff"), "<efficiency.geff>" )
+		( "h,help", "Print help" )
+		;
+
+		auto optresult = options.parse( argc, argv );
+
+		if( optresult.count("h") || !optresult.count("e") ) {
+
+			cout << options.help() << endl;
+			cout << " Same files and models as geff, see geff --help. ROOT inputs,\n";
+			cout << " standard input, plots and --watch need the full geff.\n\n";
+			return optresult.count("h") ? 0 : 1;
+
+		}
+
+		// Range and E0
+		if( optresult.count("r") ) {
+
+			string range = optresult["r"].as<std::string>();
+			char colon;
+			stringstream ss( range );
+			if( range.find(":") == string::npos || !( ss >> limits[0] >> colon >> limits[1] ) ) {
+
+				cerr << "Range not in correct format" << endl;
+				return 1;
+
+			}
+
+		}
+
+		if( optresult.count("z") )
+			E0 = optresult["z"].as<float>();
+
+		// Model and its options
+		if( optresult.count("m") )
+			modelname = optresult["m"].as<std::string>();
+		if( optresult.count("knots") )
+			modelopt.nknots = optresult["knots"].as<unsigned int>();
+		if( optresult.count("lambda") )
+			lambda = optresult["lambda"].as<double>();
+		if( optresult.count("ncorr") )
+			modelopt.ncorr = optresult["ncorr"].as<unsigned int>();
+
+		if( modelname == "template" ) {
+
+			shared_ptr<SimTable> table = make_shared<SimTable>();
+			if( !optresult.count("template") ||
+			    table->Read( optresult["template"].as<std::string>() ) ) {
+
+				cerr << "The template model needs a simulated curve with --template <file>\n";
+				return 1;
+
+			}
+
+			modelopt.table = table;
+
+		}
+
+		shared_ptr<EffModel> model = EffModel::Create( modelname, E0, log( limits[0] / E0 ),
+													  log( limits[1] / E0 ), modelopt );
+		if( !model ) {
+
+			cerr << "Unknown model " << modelname << ", use one of:";
+			vector<string> names = EffModel::Names();
+			for( unsigned int i = 0; i < names.size(); i++ )
+				cerr << " " << names[i];
+			cerr << endl;
+			return 1;
+
+		}
+
+		// Read the data, normalisation files are optional
+		vector<string> efiles = optresult["e"].as<std::vector<std::string>>();
+		vector<string> nfiles;
+		if( optresult.count("n") )
+			nfiles = optresult["n"].as<std::vector<std::string>>();
+
+		unsigned int nsources = efiles.size();
+		shared_ptr<EffData> data = make_shared<EffData>( nsources );
+		for( unsigned int i = 0; i < nsources; i++ ) {
+
+			EffSource &src = (*data)[i];
+			vector<double> *ecols[4] = { &src.E, &src.dE, &src.eff, &src.deff };
+			vector<double> *ncols[2] = { &src.norm, &src.dnorm };
+
+			if( CoreFitter::ReadColumns( efiles[i], 4, ecols, "efficiency" ) ) return 1;
+			if( i < nfiles.size() && CoreFitter::ReadColumns( nfiles[i], 2, ncols, "normalisation" ) )
+				cout << "Assuming that you don't have any data for this source\n";
+
+		}
+
+		// Starting values as in geff, the normalisations from the first source
+		vector<double> par = model->Start();
+		unsigned int npoly = par.size();
+		double norm0 = (*data)[0].NormSize() ? (*data)[0].norm[0] : 1.0;
+		for( unsigned int i = 0; i < nsources; i++ )
+			par.push_back( norm0 );
+
+		CoreFitter fitter;
+		fitter.SetData( data );
+		fitter.SetModel( model );
+		fitter.SetPenalty( modelname == "bspline" ? lambda : 0. );
+		fitter.SetVerbose( true );
+
+		CoreResult res;
+		int status = fitter.Fit( par, res );
+		if( status == 1 ) {
+
+			cerr << "The fit failed\n";
+			return 1;
+
+		}
+
+		else if( status == 2 )
+			cerr << "The fit did not converge, the result is the best point found\n";
+
+		// Output to screen
+		cout << "\nChi2 / NDf = " << res.chisq << " / " << res.ndf << endl;
+		for( unsigned int i = 0; i < res.par.size(); i++ ) {
+
+			cout << ( i < npoly ? model->ParName(i) : "n_" + to_string( i - npoly ) );
+			cout << "\t= " << res.par[i] << "\t+/- " << res.Error(i) << endl;
+
+		}
+
+		if( optresult.count("curve") )
+			return CoreFitter::WriteCurve( optresult["curve"].as<std::string>(), modelname,
+										  E0, limits[0], limits[1], npoly, res.par, res.cov );
+
+	}
+
+	// catch an error of parsing
+	catch ( const cxxopts::OptionException& e ) {
+
+		cerr << "error parsing options: " << e.what() << endl;
+		return 1;
+
+	}
+
+	return 0;
+
+}
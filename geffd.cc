@@ -0,0 +1,94 @@
+// Fit daemon for gamma-ray efficiency curves. It keeps ROOT and the
+// fitter loaded and answers fit requests on a Unix domain socket, so
+// that many short fits cost no process start or library loading.
+// The request format is described in FitDaemon.hh.
+
+#ifndef CXXOPTS_HPP_INCLUDED
+#include "cxxopts.hh"
+#endif
+
+#ifndef __FitDaemon_hh__
+#include "FitDaemon.hh"
+#endif
+
+#include "TROOT.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <iostream>
+
+using namespace std;
+
+int main( int argc, char* argv[] ) {
+
+	// Before any other ROOT call, the workers fit on many threads
+	ROOT::EnableThreadSafety();
+
+	// Plots are only ever written to files
+	gROOT->SetBatch( kTRUE );
+
+	string sockpath = "geffd.sock";
+	unsigned int nworkers = thread::hardware_concurrency();
+	unsigned int cachesize = 256;
+	shared_ptr<FitCache> diskcache;
+
+	try {
+
+		cxxopts::Options options( "geffd",
+								 "Daemon fitting gamma-ray efficiency curves on request over a Unix socket" );
+
+		options.add_options()
+		( "s,socket", "path of the socket, default geffd.sock",
+		 cxxopts::value<std::string>(), "<geffd.sock>" )
+		( "j,workers", "number of fits run at the same time, default one per core",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "cache", "number of replies kept for identical requests, default 256, 0 to disable",
+		 cxxopts::value<unsigned int>(), "<n>" )
+		( "disk-cache", "also keep fit results in a directory, as geff --cache",
+		 cxxopts::value<std::string>()->implicit_value(""), "<~/.cache/geff>" )
+		( "h,help", "Print help" )
+		;
+
+		auto optresult = options.parse( argc, argv );
+
+		if( optresult.count("h") ) {
+
+			cout << options.help() << endl;
+			cout << " A request is sent as keyword lines, e.g.\n";
+			cout << "  model poly\n  range 40 1500\n  eff effEu.dat\n  norm normEu.dat\n  @end\n";
+			cout << " or with the data inline after the keywords, framed as for geff -e -.\n";
+			cout << " The reply holds the chi2, parameters and covariance. See FitDaemon.hh.\n\n";
+			return 0;
+
+		}
+
+		if( optresult.count("s") )
+			sockpath = optresult["s"].as<std::string>();
+		if( optresult.count("j") )
+			nworkers = optresult["j"].as<unsigned int>();
+		if( optresult.count("cache") )
+			cachesize = optresult["cache"].as<unsigned int>();
+		if( optresult.count("disk-cache") )
+			diskcache = make_shared<FitCache>( optresult["disk-cache"].as<std::string>() );
+
+	}
+
+	// catch an error of parsing
+	catch ( const cxxopts::OptionException& e ) {
+
+		cerr << "error parsing options: " << e.what() << endl;
+		return 1;
+
+	}
+
+	FitDaemon daemon( cachesize );
+	daemon.SetDiskCache( diskcache );
+	if( daemon.Open( sockpath ) ) return 1;
+
+	// Ctrl-C or kill stop it cleanly, removing the socket
+	FitDaemon::StopOnSignals();
+
+	return daemon.Run( nworkers );
+
+}
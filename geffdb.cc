@@ -0,0 +1,158 @@
+// Query and export tool of the calibration database written by
+// geff --db. Free of ROOT, so analysis jobs anywhere can fetch the
+// efficiency curve of a detector for a run.
+
+#ifndef CXXOPTS_HPP_INCLUDED
+#include "cxxopts.hh"
+#endif
+
+#ifndef __CalibDB_hh__
+#include "CalibDB.hh"
+#endif
+
+#include <fstream>
+#include <string>
+#include <iostream>
+
+using namespace std;
+
+int main( int argc, char* argv[] ) {
+
+	string dbfile;
+	unsigned int detector = CalibDB::kAll;
+	int64_t asof = 0;
+
+	try {
+
+		cxxopts::Options options( "geffdb",
+								 "Look up and export efficiency calibrations from a geff database" );
+
+		options.add_options()
+		( "d,db", "calibration database, as written by geff --db",
+		 cxxopts::value<std::string>(), "<calib.gdb>" )
+		( "detector", "detector id",
+		 cxxopts::value<unsigned int>(), "<id>" )
+		( "run", "print the calibration of --detector for this run",
+		 cxxopts::value<unsigned int>(), "<run>" )
+		( "at", "only calibrations made at or before this time, in seconds or YYYY-MM-DD[ HH:MM:SS] UTC",
+		 cxxopts::value<std::string>(), "<time>" )
+		( "curve", "with --run, write the calibration as a curve file for geff_eval.hh",
+		 cxxopts::value<std::string>(), "<efficiency.geff>" )
+		( "list", "list the calibrations of --detector, or of all detectors" )
+		( "export", "write every calibration as a line of a tab-separated table, - for standard output",
+		 cxxopts::value<std::string>(), "<calib.tsv>" )
+		( "h,help", "Print help" )
+		;
+
+		auto optresult = options.parse( argc, argv );
+
+		if( optresult.count("h") || !optresult.count("d") ||
+		    !( optresult.count("run") || optresult.count("list") || optresult.count("export") ) ) {
+
+			cout << options.help() << endl;
+			cout << " e.g. geffdb -d calib.gdb --detector 12 --run 1234 --curve clover12.geff\n";
+			cout << "      geffdb -d calib.gdb --list --detector 12\n";
+			cout << "      geffdb -d calib.gdb --export calib.tsv\n\n";
+			return optresult.count("h") ? 0 : 1;
+
+		}
+
+		dbfile = optresult["d"].as<std::string>();
+		if( optresult.count("detector") )
+			detector = optresult["detector"].as<unsigned int>();
+
+		if( optresult.count("at") && CalibDB::ParseTime( optresult["at"].as<std::string>(), asof ) ) {
+
+			cerr << "Time not in correct format" << endl;
+			return 1;
+
+		}
+
+		CalibDB db;
+		if( db.Open( dbfile ) ) return 1;
+
+		// The calibration of one detector for one run
+		if( optresult.count("run") ) {
+
+			unsigned int run = optresult["run"].as<unsigned int>();
+			CalibEntry e;
+			if( detector == CalibDB::kAll || db.Find( detector, run, e, asof ) ) {
+
+				cerr << "No calibration of detector " << ( detector == CalibDB::kAll ? 0 : detector );
+				cerr << " for run " << run << " in " << dbfile << endl;
+				return 1;
+
+			}
+
+			if( optresult.count("curve") ) {
+
+				ofstream curvefile( optresult["curve"].as<std::string>().c_str(), ios::out );
+				CalibDB::WriteCurve( curvefile, e );
+				curvefile.close();
+				if( curvefile.fail() ) {
+
+					cerr << "Cannot write " << optresult["curve"].as<std::string>() << endl;
+					return 1;
+
+				}
+
+			}
+
+			else CalibDB::WriteCurve( cout, e );
+
+		}
+
+		// Calibrations of a detector, or of all, one line each
+		if( optresult.count("list") ) {
+
+			vector<CalibEntry> entries;
+			if( db.List( detector, entries ) ) return 1;
+
+			unsigned int nshown = 0;
+			cout << "detector\truns\t\tfitted (UTC)\t\tmodel\tchisq/ndf\n";
+			for( unsigned int i = 0; i < entries.size(); i++ ) {
+
+				const CalibEntry &e = entries[i];
+				if( asof != 0 && e.time > asof ) continue;
+				cout << e.detector << "\t\t" << e.runfirst << "-" << e.runlast << "\t";
+				cout << CalibDB::FormatTime( e.time ) << "\t" << e.model << "\t";
+				cout << e.chisq << "/" << e.ndf << ( e.valid ? "" : " not valid" ) << endl;
+				nshown++;
+
+			}
+
+			cout << nshown << " calibrations in " << dbfile << endl;
+
+		}
+
+		// Everything, for other tools
+		if( optresult.count("export") ) {
+
+			string exportfile = optresult["export"].as<std::string>();
+			if( exportfile == "-" ) return db.Export( cout );
+
+			ofstream out( exportfile.c_str(), ios::out );
+			if( !out.is_open() || db.Export( out ) ) {
+
+				cerr << "Cannot write " << exportfile << endl;
+				return 1;
+
+			}
+
+			cout << db.Size() << " calibrations exported to " << exportfile << endl;
+
+		}
+
+	}
+
+	// catch an error of parsing
+	catch ( const cxxopts::OptionException& e ) {
+
+		cerr << "error parsing options: " << e.what() << endl;
+		return 1;
+
+	}
+
+	return 0;
+
+}